@@ -0,0 +1,232 @@
+#pragma once
+
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "vm.h"
+
+// Affine arithmetic kernel shared by the 4- and 8-lane evaluators. Every value is kept as
+// c + x*ex + y*ey + e*ee, where ex and ey are the coordinates of the region scaled to [-1, 1]
+// and ee stands for the approximation errors of the nonlinear operations. Unlike intervals the
+// forms remember how values depend on the position, e.g. that dx and dx^2 grow together.
+
+namespace {
+
+struct AffineForm
+{
+    float c, x, y, e;
+
+    float radius() const { return std::abs(x) + std::abs(y) + e; }
+    float lower() const { return c - radius(); }
+    float upper() const { return c + radius(); }
+};
+
+AffineForm affine_add(const AffineForm& a, const AffineForm& b) {
+    return {a.c + b.c, a.x + b.x, a.y + b.y, a.e + b.e};
+}
+
+AffineForm affine_sub(const AffineForm& a, const AffineForm& b) {
+    return {a.c - b.c, a.x - b.x, a.y - b.y, a.e + b.e};
+}
+
+// alpha * a + zeta with an additional error of delta
+AffineForm affine_linear(const AffineForm& a, float alpha, float zeta, float delta) {
+    return {alpha * a.c + zeta, alpha * a.x, alpha * a.y, std::abs(alpha) * a.e + delta};
+}
+
+AffineForm affine_mul(const AffineForm& a, const AffineForm& b) {
+    return {a.c * b.c, a.c * b.x + b.c * a.x, a.c * b.y + b.c * a.y,
+            std::abs(a.c) * b.e + std::abs(b.c) * a.e + a.radius() * b.radius()};
+}
+
+// Chebyshev approximations of the convex or concave functions on the range [l, u] of the
+// operand: the secant slope and the largest distance between the secant and the function,
+// which is halved between both sides
+AffineForm affine_sqrt(const AffineForm& a, float l, float u) {
+    // Negative inputs are clamped to zero like the interval kernel does
+    if (u <= 0.0f) return {0.0f, 0.0f, 0.0f, 0.0f};
+    if (l <= 0.0f) return {0.5f * std::sqrt(u), 0.0f, 0.0f, 0.5f * std::sqrt(u)};
+    if (u == l) return {std::sqrt(l), 0.0f, 0.0f, 0.0f};
+    const float sl = std::sqrt(l), su = std::sqrt(u);
+    const float alpha = 1.0f / (sl + su);
+    // The tangent with slope alpha touches at 1 / (4 alpha^2)
+    const float t = 0.25f / (alpha * alpha);
+    const float delta = std::sqrt(t) - sl - alpha * (t - l);
+    return affine_linear(a, alpha, sl - alpha * l + 0.5f * delta, 0.5f * delta);
+}
+
+AffineForm affine_reciprocal(const AffineForm& a, float l, float u) {
+    if (l <= 0.0f && u >= 0.0f) return {0.0f, 0.0f, 0.0f, INFINITY};
+    if (u < 0.0f) {
+        AffineForm r = affine_reciprocal({-a.c, -a.x, -a.y, a.e}, -u, -l);
+        return {-r.c, -r.x, -r.y, r.e};
+    }
+    if (u == l) return {1.0f / l, 0.0f, 0.0f, 0.0f};
+    const float alpha = -1.0f / (l * u);
+    // The tangent with slope alpha touches at sqrt(l u)
+    const float t = std::sqrt(l * u);
+    const float delta = 1.0f / l + alpha * (t - l) - 1.0f / t;
+    return affine_linear(a, alpha, 1.0f / l - alpha * l - 0.5f * delta, 0.5f * delta);
+}
+
+AffineForm affine_square(const AffineForm& a, float l, float u) {
+    // The secant is (l + u) t - l u and lies (u - l)^2 / 4 above the square in the middle
+    const float delta = 0.25f * (u - l) * (u - l);
+    return affine_linear(a, l + u, -l * u - 0.5f * delta, 0.5f * delta);
+}
+
+AffineForm affine_abs(const AffineForm& a, float l, float u) {
+    if (l >= 0.0f) return a;
+    if (u <= 0.0f) return {-a.c, -a.x, -a.y, a.e};
+    // |t| lies between alpha t and the secant alpha t + delta
+    const float alpha = (u + l) / (u - l);
+    const float delta = -2.0f * l * u / (u - l);
+    return affine_linear(a, alpha, 0.5f * delta, 0.5f * delta);
+}
+
+// max(a, b) = (a + b) / 2 + |a - b| / 2 keeps the correlation of both operands
+AffineForm affine_max(const AffineForm& a, const AffineForm& b) {
+    const AffineForm d = affine_sub(a, b);
+    if (d.lower() >= 0.0f) return a;
+    if (d.upper() <= 0.0f) return b;
+    const AffineForm h = affine_abs(d, d.lower(), d.upper());
+    const AffineForm s = affine_add(a, b);
+    return {0.5f * (s.c + h.c), 0.5f * (s.x + h.x), 0.5f * (s.y + h.y), 0.5f * (s.e + h.e)};
+}
+
+AffineForm affine_min(const AffineForm& a, const AffineForm& b) {
+    const AffineForm d = affine_sub(a, b);
+    if (d.upper() <= 0.0f) return a;
+    if (d.lower() >= 0.0f) return b;
+    const AffineForm h = affine_abs(d, d.lower(), d.upper());
+    const AffineForm s = affine_add(a, b);
+    return {0.5f * (s.c - h.c), 0.5f * (s.x - h.x), 0.5f * (s.y - h.y), 0.5f * (s.e + h.e)};
+}
+
+template<typename AffineN>
+AffineForm load_form(const AffineN& v, int j) {
+    return {v.center[j], v.x[j], v.y[j], v.error[j]};
+}
+
+template<typename AffineN>
+void store_form(AffineN& v, int j, const AffineForm& f) {
+    v.center[j] = f.c;
+    v.x[j] = f.x;
+    v.y[j] = f.y;
+    v.error[j] = f.e;
+}
+
+// Evaluates the instructions on N regions at once. Intervals are evaluated alongside, they are
+// exact for e.g. the square of a coordinate, where the form has to approximate. Every range in
+// interval_vars is the intersection of both, so pruning and culling can use them like the
+// results of evaluate_intervals, and the nonlinear operations approximate over these ranges.
+template<typename AffineN, typename IntervalN>
+IntervalN evaluate_affine(std::vector<AffineN>& affine_vars, std::vector<IntervalN>& interval_vars, const std::vector<Instruction>& instructions, const IntervalN& x, const IntervalN& y, const IntervalN& z)
+{
+    constexpr int N = sizeof(IntervalN::lower) / sizeof(float);
+
+    const size_t num_instructions = instructions.size();
+
+    for (size_t i = 0; i < num_instructions; ++i) {
+        const Instruction& inst = instructions[i];
+        AffineN& out = affine_vars[i];
+        IntervalN& range = interval_vars[i];
+        const int i0 = inst.input0 == -1 ? i : inst.input0;
+        const int i1 = inst.input1 == -1 ? i : inst.input1;
+
+        for (int j = 0; j < N; ++j) {
+            const AffineForm a = load_form(affine_vars[i0], j);
+            const AffineForm b = load_form(affine_vars[i1], j);
+            const float al = interval_vars[i0].lower[j], au = interval_vars[i0].upper[j];
+            const float bl = interval_vars[i1].lower[j], bu = interval_vars[i1].upper[j];
+            AffineForm r{0.0f, 0.0f, 0.0f, 0.0f};
+            float lower = -INFINITY, upper = INFINITY;
+            switch (inst.op) {
+                case OpCode::VarX:
+                    r = {0.5f * (x.lower[j] + x.upper[j]), 0.5f * (x.upper[j] - x.lower[j]), 0.0f, 0.0f};
+                    break;
+                case OpCode::VarY:
+                    r = {0.5f * (y.lower[j] + y.upper[j]), 0.0f, 0.5f * (y.upper[j] - y.lower[j]), 0.0f};
+                    break;
+                case OpCode::VarZ:
+                    // There is no noise symbol for z, its range goes to the error
+                    r = {0.5f * (z.lower[j] + z.upper[j]), 0.0f, 0.0f, 0.5f * (z.upper[j] - z.lower[j])};
+                    break;
+                case OpCode::Const:
+                case OpCode::Param:
+                    r.c = inst.constant;
+                    break;
+                case OpCode::Add:
+                    r = affine_add(a, b);
+                    lower = al + bl;
+                    upper = au + bu;
+                    break;
+                case OpCode::Sub:
+                    r = affine_sub(a, b);
+                    lower = al - bu;
+                    upper = au - bl;
+                    break;
+                case OpCode::Mul: {
+                    r = affine_mul(a, b);
+                    const float p1 = al * bl, p2 = al * bu, p3 = au * bl, p4 = au * bu;
+                    lower = std::min(std::min(p1, p2), std::min(p3, p4));
+                    upper = std::max(std::max(p1, p2), std::max(p3, p4));
+                    break;
+                }
+                case OpCode::Div: {
+                    // A denominator containing zero makes the result unbounded
+                    const AffineForm q = affine_reciprocal(b, bl, bu);
+                    r = q.e == INFINITY ? q : affine_mul(a, q);
+                    if (bl > 0.0f || bu < 0.0f) {
+                        const float p1 = al / bl, p2 = al / bu, p3 = au / bl, p4 = au / bu;
+                        lower = std::min(std::min(p1, p2), std::min(p3, p4));
+                        upper = std::max(std::max(p1, p2), std::max(p3, p4));
+                    }
+                    break;
+                }
+                case OpCode::Max:
+                    r = affine_max(a, b);
+                    lower = std::max(al, bl);
+                    upper = std::max(au, bu);
+                    break;
+                case OpCode::Min:
+                    r = affine_min(a, b);
+                    lower = std::min(al, bl);
+                    upper = std::min(au, bu);
+                    break;
+                case OpCode::Neg:
+                    r = {-a.c, -a.x, -a.y, a.e};
+                    lower = -au;
+                    upper = -al;
+                    break;
+                case OpCode::Abs:
+                    r = affine_abs(a, al, au);
+                    lower = std::max(std::max(al, -au), 0.0f);
+                    upper = std::max(-al, au);
+                    break;
+                case OpCode::Square: {
+                    r = affine_square(a, al, au);
+                    const float abs_lower = std::max(std::max(al, -au), 0.0f);
+                    const float abs_upper = std::max(-al, au);
+                    lower = abs_lower * abs_lower;
+                    upper = abs_upper * abs_upper;
+                    break;
+                }
+                case OpCode::Sqrt:
+                    r = affine_sqrt(a, al, au);
+                    lower = std::sqrt(std::max(al, 0.0f));
+                    upper = std::sqrt(std::max(au, 0.0f));
+                    break;
+            }
+            store_form(out, j, r);
+            range.lower[j] = std::max(lower, r.lower());
+            range.upper[j] = std::min(upper, r.upper());
+        }
+    }
+
+    return interval_vars[num_instructions - 1];
+}
+
+} // namespace
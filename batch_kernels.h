@@ -0,0 +1,193 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "compiler.h"
+#include "simd_lanes.h"
+
+// Batch evaluation kernels for register allocated tapes. Every slot is a row of `stride`
+// floats and the kernels always process a multiple of their lane width, so the rows have to
+// be padded (see SIMD_BATCH_ALIGNMENT in vm.h). The padding lanes compute garbage that is never read.
+
+// Defined in vm_avx2.cpp and vm_avx512.cpp, only callable on hosts that support the instruction set
+void evaluate_batch_avx2(const RegisterTape& tape, float* vars, size_t stride, size_t n);
+void evaluate_batch_avx512(const RegisterTape& tape, float* vars, size_t stride, size_t n);
+void evaluate_gradient_avx2(const RegisterTape& tape, float* vars, size_t stride, size_t n);
+
+namespace {
+
+template<typename L, typename F>
+inline void binary_op(const RegisterInstruction& inst, float* vars, size_t stride, size_t n, F f) {
+    float* out = vars + inst.output * stride;
+    if (inst.input1 == -1) {
+        const float* a = vars + inst.input0 * stride;
+        const auto c = L::set1(inst.constant);
+        for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, f(L::loadu(a + j), c));
+    } else if (inst.input0 == -1) {
+        const float* b = vars + inst.input1 * stride;
+        const auto c = L::set1(inst.constant);
+        for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, f(c, L::loadu(b + j)));
+    } else {
+        const float* a = vars + inst.input0 * stride;
+        const float* b = vars + inst.input1 * stride;
+        for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, f(L::loadu(a + j), L::loadu(b + j)));
+    }
+}
+
+template<typename L, typename F>
+inline void unary_op(const RegisterInstruction& inst, float* vars, size_t stride, size_t n, F f) {
+    float* out = vars + inst.output * stride;
+    const float* a = vars + inst.input0 * stride;
+    for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, f(L::loadu(a + j)));
+}
+
+// Evaluates the tape on n points, n being a multiple of L::width. The x, y and z coordinates
+// are read from the three rows following the slots of the tape.
+template<typename L>
+void evaluate_batch_lanes(const RegisterTape& tape, float* vars, size_t stride, size_t n) {
+    using V = typename L::V;
+    const float* x_row = vars + tape.num_slots * stride;
+    const float* y_row = x_row + stride;
+    const float* z_row = y_row + stride;
+
+    for (const RegisterInstruction& inst : tape.instructions) {
+        float* out = vars + inst.output * stride;
+        switch (inst.op) {
+            case OpCode::VarX:
+                for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, L::loadu(x_row + j));
+                break;
+            case OpCode::VarY:
+                for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, L::loadu(y_row + j));
+                break;
+            case OpCode::VarZ:
+                for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, L::loadu(z_row + j));
+                break;
+            case OpCode::Const:
+            case OpCode::Param: {
+                const V c = L::set1(inst.constant);
+                for (size_t j = 0; j < n; j += L::width) L::storeu(out + j, c);
+                break;
+            }
+            case OpCode::Add: binary_op<L>(inst, vars, stride, n, [](V a, V b) { return L::add(a, b); }); break;
+            case OpCode::Sub: binary_op<L>(inst, vars, stride, n, [](V a, V b) { return L::sub(a, b); }); break;
+            case OpCode::Mul: binary_op<L>(inst, vars, stride, n, [](V a, V b) { return L::mul(a, b); }); break;
+            case OpCode::Div: binary_op<L>(inst, vars, stride, n, [](V a, V b) { return L::div(a, b); }); break;
+            case OpCode::Max: binary_op<L>(inst, vars, stride, n, [](V a, V b) { return L::max(a, b); }); break;
+            case OpCode::Min: binary_op<L>(inst, vars, stride, n, [](V a, V b) { return L::min(a, b); }); break;
+            case OpCode::Neg: unary_op<L>(inst, vars, stride, n, [](V a) { return L::neg(a); }); break;
+            case OpCode::Abs: unary_op<L>(inst, vars, stride, n, [](V a) { return L::abs(a); }); break;
+            case OpCode::Square: unary_op<L>(inst, vars, stride, n, [](V a) { return L::mul(a, a); }); break;
+            case OpCode::Sqrt: unary_op<L>(inst, vars, stride, n, [](V a) { return L::sqrt(a); }); break;
+        }
+    }
+}
+
+// Forward mode automatic differentiation: every slot holds three rows, the value followed by
+// its derivatives in x and y. The coordinates are read from the three rows after the
+// 3 * num_slots rows of the tape. z is held fixed, so it has no derivative.
+template<typename L>
+void evaluate_gradient_lanes(const RegisterTape& tape, float* vars, size_t stride, size_t n) {
+    using V = typename L::V;
+    struct Dual { V v, dx, dy; };
+
+    const float* x_row = vars + 3 * tape.num_slots * stride;
+    const float* y_row = x_row + stride;
+    const float* z_row = y_row + stride;
+    const V zero = L::set1(0.0f);
+    const V one = L::set1(1.0f);
+
+    for (const RegisterInstruction& inst : tape.instructions) {
+        float* out = vars + 3 * inst.output * stride;
+        // Immediates are constants and have a zero gradient
+        auto load = [&](int slot, size_t j) -> Dual {
+            if (slot == -1) return {L::set1(inst.constant), zero, zero};
+            const float* row = vars + 3 * slot * stride + j;
+            return {L::loadu(row), L::loadu(row + stride), L::loadu(row + 2 * stride)};
+        };
+
+        for (size_t j = 0; j < n; j += L::width) {
+            Dual r = {zero, zero, zero};
+            switch (inst.op) {
+                case OpCode::VarX:
+                    r = {L::loadu(x_row + j), one, zero};
+                    break;
+                case OpCode::VarY:
+                    r = {L::loadu(y_row + j), zero, one};
+                    break;
+                case OpCode::VarZ:
+                    r = {L::loadu(z_row + j), zero, zero};
+                    break;
+                case OpCode::Const:
+                case OpCode::Param:
+                    r = {L::set1(inst.constant), zero, zero};
+                    break;
+                case OpCode::Add: {
+                    Dual a = load(inst.input0, j), b = load(inst.input1, j);
+                    r = {L::add(a.v, b.v), L::add(a.dx, b.dx), L::add(a.dy, b.dy)};
+                    break;
+                }
+                case OpCode::Sub: {
+                    Dual a = load(inst.input0, j), b = load(inst.input1, j);
+                    r = {L::sub(a.v, b.v), L::sub(a.dx, b.dx), L::sub(a.dy, b.dy)};
+                    break;
+                }
+                case OpCode::Mul: {
+                    Dual a = load(inst.input0, j), b = load(inst.input1, j);
+                    r = {L::mul(a.v, b.v), L::add(L::mul(a.dx, b.v), L::mul(a.v, b.dx)), L::add(L::mul(a.dy, b.v), L::mul(a.v, b.dy))};
+                    break;
+                }
+                case OpCode::Div: {
+                    Dual a = load(inst.input0, j), b = load(inst.input1, j);
+                    V q = L::div(a.v, b.v);
+                    // (a / b)' = (a' - q b') / b
+                    r = {q, L::div(L::sub(a.dx, L::mul(q, b.dx)), b.v), L::div(L::sub(a.dy, L::mul(q, b.dy)), b.v)};
+                    break;
+                }
+                case OpCode::Max: {
+                    // Same operand choice as L::max
+                    Dual a = load(inst.input0, j), b = load(inst.input1, j);
+                    auto take_a = L::greater(a.v, b.v);
+                    r = {L::max(a.v, b.v), L::select(take_a, a.dx, b.dx), L::select(take_a, a.dy, b.dy)};
+                    break;
+                }
+                case OpCode::Min: {
+                    Dual a = load(inst.input0, j), b = load(inst.input1, j);
+                    auto take_a = L::less(a.v, b.v);
+                    r = {L::min(a.v, b.v), L::select(take_a, a.dx, b.dx), L::select(take_a, a.dy, b.dy)};
+                    break;
+                }
+                case OpCode::Neg: {
+                    Dual a = load(inst.input0, j);
+                    r = {L::neg(a.v), L::neg(a.dx), L::neg(a.dy)};
+                    break;
+                }
+                case OpCode::Abs: {
+                    Dual a = load(inst.input0, j);
+                    auto negative = L::less(a.v, zero);
+                    r = {L::abs(a.v), L::select(negative, L::neg(a.dx), a.dx), L::select(negative, L::neg(a.dy), a.dy)};
+                    break;
+                }
+                case OpCode::Square: {
+                    Dual a = load(inst.input0, j);
+                    V twice = L::add(a.v, a.v);
+                    r = {L::mul(a.v, a.v), L::mul(twice, a.dx), L::mul(twice, a.dy)};
+                    break;
+                }
+                case OpCode::Sqrt: {
+                    // The gradient is set to zero where the square root is not differentiable
+                    Dual a = load(inst.input0, j);
+                    V root = L::sqrt(a.v);
+                    auto positive = L::greater(root, zero);
+                    V scale = L::select(positive, L::div(L::set1(0.5f), root), zero);
+                    r = {root, L::mul(scale, a.dx), L::mul(scale, a.dy)};
+                    break;
+                }
+            }
+            L::storeu(out + j, r.v);
+            L::storeu(out + stride + j, r.dx);
+            L::storeu(out + 2 * stride + j, r.dy);
+        }
+    }
+}
+
+} // namespace
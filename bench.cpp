@@ -0,0 +1,218 @@
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <cerrno>
+#include <cstdlib>
+
+#include "node.h"
+#include "vm.h"
+#include "shapes.h"
+#include "io.h"
+#include "marching_cubes.h"
+#include "marching_squares.h"
+
+// Scene of `count` disks and rectangles on a jittered grid, joined with smooth unions the
+// same way update_mesh in main.cpp does it. The shapes are kept in `shapes`.
+static Scalar make_scene(int count, float union_radius, std::vector<std::unique_ptr<IShape>>& shapes) {
+    const int side = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count))));
+    const float spacing = 1.8f / side;
+    Scalar scene;
+    for (int i = 0; i < count; ++i) {
+        const float cx = -0.9f + spacing * (i % side + 0.5f) + 0.1f * spacing * ((i * 7) % 5 - 2);
+        const float cy = -0.9f + spacing * (i / side + 0.5f) + 0.1f * spacing * ((i * 3) % 5 - 2);
+        if (i % 2) {
+            auto rect = std::make_unique<Rect>();
+            rect->pos_x = cx;
+            rect->pos_y = cy;
+            rect->width = 0.7f * spacing;
+            rect->height = 0.5f * spacing;
+            shapes.push_back(std::move(rect));
+        } else {
+            auto circle = std::make_unique<Disk>();
+            circle->pos_x = cx;
+            circle->pos_y = cy;
+            circle->radius = 0.35f * spacing;
+            shapes.push_back(std::move(circle));
+        }
+        Scalar shape = shapes.back()->get_sdf();
+        if (i == 0) {
+            scene = shape;
+        } else if (union_radius > 0.0f) {
+            scene = inigo_smin(scene, shape, union_radius);
+        } else {
+            scene = min(scene, shape);
+        }
+    }
+    return scene;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Points per second of evaluate_batch on full MAX_TILE_SIZE tiles of the unpruned tape,
+// i.e. the dense bottom level tiles that end up being sampled
+static void bench_batch(VM& vm, const char* label) {
+    std::vector<float> xs(MAX_TILE_SIZE), ys(MAX_TILE_SIZE);
+    for (int i = 0; i < MAX_TILE_SIZE; ++i) {
+        xs[i] = -1.0f + 2.0f * (i % 16) / 15.0f;
+        ys[i] = -1.0f + 2.0f * (i / 16) / 15.0f;
+    }
+
+    const int iterations = 200;
+    float checksum = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; ++it) {
+        checksum += vm.evaluate_batch(vm.original_tape, xs, ys)[it % MAX_TILE_SIZE];
+    }
+    double elapsed = seconds_since(start);
+    double points = static_cast<double>(iterations) * MAX_TILE_SIZE;
+    printf("  batch %-6s %10.2f Mpoints/s (%.3f ms, checksum %g)\n", label, points / elapsed * 1e-6, elapsed * 1e3, checksum);
+}
+
+static void bench_grid(VM& vm, int resolution, const char* label = "") {
+    std::deque<Tile> tiles;
+    auto start = std::chrono::steady_clock::now();
+    vm.evaluate(tiles, {0, 0, resolution - 1, resolution - 1});
+    double elapsed = seconds_since(start);
+
+    // Work is the number of instructions evaluated for all points of the tiles
+    size_t points = 0, instructions = 0, work = 0;
+    for (const Tile& tile : tiles) {
+        const size_t tile_points = (tile.subgrid.nx + 1) * (tile.subgrid.ny + 1);
+        points += tile_points;
+        instructions += tile.tape->instructions.size();
+        work += tile_points * tile.tape->instructions.size();
+    }
+    printf("  grid %dx%d%s: %zu tiles, %zu skipped, %zu tapes, %zu points, %.1f instructions/tile, %.2fM work, %.3f ms\n", resolution, resolution, label,
+           tiles.size(), vm.skipped_tiles, vm.tapes->size(), points, tiles.empty() ? 0.0 : static_cast<double>(instructions) / tiles.size(), work * 1e-6, elapsed * 1e3);
+}
+
+// Solves the grid in windows of `window` cells, like the editor does for the dirty region
+static void bench_windows(VM& vm, int resolution, int window, const char* label = "") {
+    size_t tiles = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int px = 0; px < resolution; px += window) {
+        for (int py = 0; py < resolution; py += window) {
+            std::deque<Tile> window_tiles;
+            vm.evaluate_window(window_tiles, {px, py, std::min(window, resolution - px), std::min(window, resolution - py)}, resolution, resolution);
+            tiles += window_tiles.size();
+        }
+    }
+    printf("  windows %dx%d of %d cells%s: %zu tiles, %.3f ms\n", resolution, resolution, window, label, tiles, seconds_since(start) * 1e3);
+}
+
+// Marching squares on the collected tiles, on the streamed ones, in windows of 256 cells and
+// with level of detail, dual contouring, and hybrid contouring with exact rectangle tiles.
+// The results keep the tapes of their tiles, so only one of them is alive at a time.
+static void bench_contour(Scalar scene, int resolution) {
+    auto start = std::chrono::steady_clock::now();
+    const size_t edges = implicit_to_mesh(scene, resolution).mesh.edges.size();
+    const double collected = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    implicit_to_mesh_streaming(scene, resolution);
+    const double streaming = seconds_since(start);
+    start = std::chrono::steady_clock::now();
+    implicit_to_mesh_tiled(scene, resolution, 256);
+    const double windows = seconds_since(start);
+    printf("  contour %dx%d: %zu edges, %.3f ms collected, %.3f ms streamed, %.3f ms tiled\n", resolution, resolution, edges, collected * 1e3, streaming * 1e3, windows * 1e3);
+
+    // Coarse tiles where the contour stays within half a cell of their chords
+    ContouringOptions options;
+    options.lod_tolerance = 1.0f / (resolution - 1);
+    start = std::chrono::steady_clock::now();
+    const size_t lod_edges = implicit_to_mesh(scene, resolution, options).mesh.edges.size();
+    printf("  contour %dx%d lod: %zu edges, %.3f ms\n", resolution, resolution, lod_edges, seconds_since(start) * 1e3);
+
+    start = std::chrono::steady_clock::now();
+    const size_t dual_edges = implicit_to_mesh_dual(scene, resolution).mesh.edges.size();
+    printf("  contour %dx%d dual: %zu edges, %.3f ms\n", resolution, resolution, dual_edges, seconds_since(start) * 1e3);
+
+    start = std::chrono::steady_clock::now();
+    const size_t hybrid_edges = implicit_to_mesh_hybrid(scene, resolution).mesh.edges.size();
+    printf("  contour %dx%d hybrid: %zu edges, %.3f ms\n", resolution, resolution, hybrid_edges, seconds_since(start) * 1e3);
+}
+
+// Octree and mesh of a union of spheres, the only 3D scene
+static void bench_volume(int resolution) {
+    Scalar scene = sphere(-0.3f, 0.0f, 0.1f, 0.45f);
+    for (int i = 0; i < 7; ++i) {
+        const float angle = 0.9f * i;
+        scene = inigo_smin(scene, sphere(0.5f * std::cos(angle), 0.5f * std::sin(angle), 0.1f * (i - 3), 0.2f), 0.05f);
+    }
+
+    VM vm(scene);
+    std::deque<Tile3> tiles;
+    auto start = std::chrono::steady_clock::now();
+    vm.evaluate(tiles, {0, 0, 0, resolution - 1, resolution - 1, resolution - 1});
+    const double octree = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    TriangleMesh mesh = implicit_to_mesh3(scene, resolution);
+    const double meshing = seconds_since(start);
+    printf("  volume %d^3: %zu tiles, %.3f ms octree, %zu triangles, %.3f ms mesh\n", resolution, tiles.size(), octree * 1e3, mesh.triangles.size(), meshing * 1e3);
+}
+
+// Tiles and tape lengths of the bounding modes for a tape in the text format of io.h
+static void bench_imported(const char* filename) {
+    std::vector<Instruction> instructions;
+    load_instructions(filename, instructions);
+    VM vm(instructions);
+    printf("%s, %zu instructions, %d slots\n", filename, vm.original_instructions.size(), vm.original_tape.num_slots);
+    bench_grid(vm, 1024);
+    vm.affine = true;
+    bench_grid(vm, 1024, " affine");
+}
+
+// Tapes given on the command line are benchmarked after the built-in scenes
+int main(int argc, char** argv) {
+    const std::pair<int, float> scenes[] = {{16, 0.02f}, {256, 0.02f}, {256, 0.0f}};
+    for (auto [count, union_radius] : scenes) {
+        std::vector<std::unique_ptr<IShape>> shapes;
+        Scalar scene = make_scene(count, union_radius, shapes);
+        VM vm(scene);
+        printf("%d shapes, %s union, %zu instructions, %d slots\n", count, union_radius > 0.0f ? "smooth" : "min", vm.original_instructions.size(), vm.original_tape.num_slots);
+        vm.use_simd = false;
+        bench_batch(vm, "scalar");
+        vm.use_simd = true;
+        bench_batch(vm, "simd");
+        bench_grid(vm, 1024);
+        // Tiles visited when children are also culled by the Lipschitz bound
+        vm.lipschitz_culling = true;
+        bench_grid(vm, 1024, " lipschitz");
+        vm.lipschitz_culling = false;
+        vm.affine = true;
+        bench_grid(vm, 1024, " affine");
+        vm.affine = false;
+        vm.adaptive_tiles = true;
+        bench_grid(vm, 1024, " adaptive");
+        vm.adaptive_tiles = false;
+        // Windows start from the whole program, culling the union keeps the shapes near them
+        bench_windows(vm, 1024, 64);
+        vm.union_culling = false;
+        bench_windows(vm, 1024, 64, " without union culling");
+        vm.union_culling = true;
+        bench_contour(scene, 1024);
+        if (jit_supported()) {
+            vm.jit = std::make_shared<JitCache>();
+            bench_batch(vm, "jit");
+            // Tapes are compiled on their second use, the third run only runs compiled code like
+            // remeshing an unchanged scene in the editor. The large scenes have more tapes than
+            // the cache keeps by default.
+            vm.jit->max_compiled = 1 << 16;
+            for (int run = 0; run < 3; ++run) bench_grid(vm, 1024);
+            printf("  %zu compiled tapes\n", vm.jit->compiled());
+            vm.jit = nullptr;
+        }
+    }
+    printf("8 spheres, smooth union\n");
+    for (int resolution : {256, 512}) bench_volume(resolution);
+    for (int i = 1; i < argc; ++i) bench_imported(argv[i]);
+    return 0;
+}
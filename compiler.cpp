@@ -1,10 +1,13 @@
 #include "compiler.h"
 #include "node.h"
 #include <vector>
-#include <unordered_map>
+#include <array>
+#include <algorithm>
 #include <stack>
 #include <cmath>
 #include <assert.h>
+#include <string.h>
+#include <stdint.h>
 
 struct NodeToProcess {
     int node_index;
@@ -14,7 +17,8 @@ struct NodeToProcess {
 
 std::vector<Instruction> compile(const Scalar& node) {
     std::vector<Instruction> instructions;
-    std::unordered_map<int, int> node_to_instruction;
+    // Instruction of every compiled node, indexed like the node slab
+    std::vector<int> node_to_instruction(NodeManager::get().node_data.size(), -1);
     std::stack<NodeToProcess> stack;
     
     // Start with the root node's index
@@ -28,6 +32,8 @@ std::vector<Instruction> compile(const Scalar& node) {
             const Node& data = NodeManager::get().node_data[current.node_index];
             Instruction inst;
             inst.shape = data.shape;
+            inst.lipschitz = data.lipschitz;
+            inst.constant = 0.0f;
             inst.input0 = -1;
             inst.input1 = -1;
             
@@ -38,10 +44,18 @@ std::vector<Instruction> compile(const Scalar& node) {
                 case NodeType::Y:
                     inst.op = OpCode::VarY;
                     break;
+                case NodeType::Z:
+                    inst.op = OpCode::VarZ;
+                    break;
                 case NodeType::Constant:
                     inst.op = OpCode::Const;
                     inst.constant = data.value;
                     break;
+                case NodeType::Parameter:
+                    inst.op = OpCode::Param;
+                    inst.constant = data.value;
+                    inst.parameter = data.parameter;
+                    break;
                 case NodeType::Add:
                     inst.op = OpCode::Add;
                     inst.input0 = node_to_instruction[data.left_child];
@@ -99,8 +113,7 @@ std::vector<Instruction> compile(const Scalar& node) {
             current.processed = true;
             
             // Check if we've already compiled this node
-            auto it = node_to_instruction.find(current.node_index);
-            if (it != node_to_instruction.end()) {
+            if (node_to_instruction[current.node_index] != -1) {
                 stack.pop();
                 continue;
             }
@@ -119,6 +132,86 @@ std::vector<Instruction> compile(const Scalar& node) {
     return instructions;
 }
 
+static bool is_binary(OpCode op) {
+    switch (op) {
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+        case OpCode::Max:
+        case OpCode::Min:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void allocate_registers(const std::vector<Instruction>& instructions, RegisterTape& tape) {
+    const int num_instructions = static_cast<int>(instructions.size());
+    tape.instructions.clear();
+    tape.instructions.reserve(num_instructions);
+    tape.num_slots = 0;
+
+    // Constant operands of binary instructions become immediates, see RegisterInstruction
+    std::vector<std::pair<bool, bool>> immediate(num_instructions, {false, false});
+    for (int i = 0; i < num_instructions; ++i) {
+        const Instruction& inst = instructions[i];
+        if (!is_binary(inst.op)) continue;
+        if (instructions[inst.input1].op == OpCode::Const) immediate[i].second = true;
+        else if (instructions[inst.input0].op == OpCode::Const) immediate[i].first = true;
+    }
+
+    // Index of the last instruction reading each result. The final result is live until the end.
+    std::vector<int> last_use(num_instructions, -1);
+    for (int i = 0; i < num_instructions; ++i) {
+        const Instruction& inst = instructions[i];
+        if (inst.input0 != -1 && !immediate[i].first) last_use[inst.input0] = i;
+        if (inst.input1 != -1 && !immediate[i].second) last_use[inst.input1] = i;
+    }
+    if (num_instructions > 0) last_use[num_instructions - 1] = num_instructions;
+
+    std::vector<int> slot_of(num_instructions, -1);
+    std::vector<int> free_slots;
+
+    for (int i = 0; i < num_instructions; ++i) {
+        const Instruction& inst = instructions[i];
+        // Constants only used as immediates are not needed anymore
+        if (inst.op == OpCode::Const && last_use[i] == -1) continue;
+
+        RegisterInstruction reg;
+        reg.op = inst.op;
+        reg.constant = inst.constant;
+        reg.input0 = inst.input0 != -1 ? slot_of[inst.input0] : -1;
+        reg.input1 = inst.input1 != -1 ? slot_of[inst.input1] : -1;
+        if (immediate[i].first) {
+            reg.input0 = -1;
+            reg.constant = instructions[inst.input0].constant;
+        }
+        if (immediate[i].second) {
+            reg.input1 = -1;
+            reg.constant = instructions[inst.input1].constant;
+        }
+
+        // Release the inputs before picking the output slot, evaluation is element wise
+        // so reading and writing the same slot is fine
+        if (reg.input0 != -1 && last_use[inst.input0] == i) free_slots.push_back(reg.input0);
+        if (reg.input1 != -1 && inst.input1 != inst.input0 && last_use[inst.input1] == i) free_slots.push_back(reg.input1);
+
+        if (free_slots.empty()) {
+            reg.output = tape.num_slots++;
+        } else {
+            reg.output = free_slots.back();
+            free_slots.pop_back();
+        }
+        slot_of[i] = reg.output;
+
+        // Results nobody reads can be overwritten right away
+        if (last_use[i] == -1) free_slots.push_back(reg.output);
+
+        tape.instructions.push_back(reg);
+    }
+}
+
 // Helper function to evaluate constant operations
 float evaluate_constant_operation(OpCode op, float left_val, float right_val = 0.0f) {
     switch (op) {
@@ -144,7 +237,9 @@ float evaluate_constant_operation(OpCode op, float left_val, float right_val = 0
             return std::sqrt(left_val);
         case OpCode::VarX:
         case OpCode::VarY:
-        case OpCode::Const: {
+        case OpCode::VarZ:
+        case OpCode::Const:
+        case OpCode::Param: {
             assert(false);
             return 0.0f;
         }
@@ -152,116 +247,321 @@ float evaluate_constant_operation(OpCode op, float left_val, float right_val = 0
     return 0.0f;
 }
 
+static bool is_commutative(OpCode op) {
+    return op == OpCode::Add || op == OpCode::Mul || op == OpCode::Max || op == OpCode::Min;
+}
+
+static bool is_constant(const std::vector<Instruction>& values, int index, float value) {
+    return values[index].op == OpCode::Const && values[index].constant == value;
+}
+
+// Applies one rewrite to `inst`, whose inputs refer to `values`. Returns the index of the value
+// `inst` is equal to, or -1. Other simplifications are done in place and keep the shape.
+static int simplify(Instruction& inst, const std::vector<Instruction>& values) {
+    const int a = inst.input0;
+    const int b = inst.input1;
+    auto rewrite = [&](OpCode op, int input0) {
+        inst.op = op;
+        inst.input0 = input0;
+        inst.input1 = -1;
+        return -1;
+    };
+
+    if (is_binary(inst.op)) {
+        if (values[a].op == OpCode::Const && values[b].op == OpCode::Const) {
+            inst.constant = evaluate_constant_operation(inst.op, values[a].constant, values[b].constant);
+            return rewrite(OpCode::Const, -1);
+        }
+        // Constants end up as the second operand, e.g. 0 + x becomes x + 0
+        if (is_commutative(inst.op) && values[a].op == OpCode::Const) {
+            std::swap(inst.input0, inst.input1);
+            return -1;
+        }
+    } else if (a != -1 && values[a].op == OpCode::Const) {
+        inst.constant = evaluate_constant_operation(inst.op, values[a].constant);
+        return rewrite(OpCode::Const, -1);
+    }
+
+    switch (inst.op) {
+        case OpCode::Add:
+            if (is_constant(values, b, 0.0f)) return a;
+            break;
+        case OpCode::Sub:
+            if (is_constant(values, b, 0.0f)) return a;
+            if (is_constant(values, a, 0.0f)) return rewrite(OpCode::Neg, b);
+            break;
+        case OpCode::Mul:
+            if (is_constant(values, b, 1.0f)) return a;
+            if (is_constant(values, b, -1.0f)) return rewrite(OpCode::Neg, a);
+            if (a == b) return rewrite(OpCode::Square, a);
+            break;
+        case OpCode::Div:
+            if (is_constant(values, b, 1.0f)) return a;
+            break;
+        case OpCode::Max:
+        case OpCode::Min:
+            if (a == b) return a;
+            break;
+        case OpCode::Neg:
+            if (values[a].op == OpCode::Neg) return values[a].input0;
+            break;
+        case OpCode::Abs:
+            if (values[a].op == OpCode::Abs || values[a].op == OpCode::Square || values[a].op == OpCode::Sqrt) return a;
+            if (values[a].op == OpCode::Neg) return rewrite(OpCode::Abs, values[a].input0);
+            break;
+        case OpCode::Square:
+            if (values[a].op == OpCode::Neg || values[a].op == OpCode::Abs) return rewrite(OpCode::Square, values[a].input0);
+            break;
+        case OpCode::Sqrt:
+            if (values[a].op == OpCode::Square) return rewrite(OpCode::Abs, values[a].input0);
+            break;
+        default:
+            break;
+    }
+    return -1;
+}
+
+// Value numbering considers two instructions equal if they compute the same value for the same
+// shape. The constant only matters for Const and Param, other instructions may carry anything.
+static bool has_constant(OpCode op) {
+    return op == OpCode::Const || op == OpCode::Param;
+}
+
+static uint64_t value_hash(const Instruction& inst) {
+    uint32_t constant_bits = 0;
+    if (has_constant(inst.op)) memcpy(&constant_bits, &inst.constant, sizeof(constant_bits));
+    uint64_t hash = static_cast<uint32_t>(inst.input0) | static_cast<uint64_t>(static_cast<uint32_t>(inst.input1)) << 32;
+    hash = hash * 0xff51afd7ed558ccdull ^ (constant_bits | static_cast<uint64_t>(inst.op) << 32);
+    hash = hash * 0xc4ceb9fe1a85ec53ull ^ static_cast<uint32_t>(inst.parameter) ^ reinterpret_cast<uintptr_t>(inst.shape);
+    return hash ^ (hash >> 29);
+}
+
+static bool same_value(const Instruction& a, const Instruction& b) {
+    return a.op == b.op && a.input0 == b.input0 && a.input1 == b.input1 && a.shape == b.shape && a.parameter == b.parameter &&
+           (!has_constant(a.op) || memcmp(&a.constant, &b.constant, sizeof(float)) == 0);
+}
+
 void optimize_instructions(std::vector<Instruction>& instructions) {
-    // Constant propagation pass
-    std::vector<bool> is_constant(instructions.size(), false);
-    std::vector<float> constant_values(instructions.size(), 0.0f);
-    
-    // First pass: identify constants and propagate them
+    if (instructions.empty()) return;
+
+    // Value numbering: every instruction is expressed in terms of the values computed so far,
+    // simplified and then either mapped to an equal earlier value or appended as a new one
+    std::vector<Instruction> values;
+    values.reserve(instructions.size());
+    std::vector<int> value_of(instructions.size());
+    // Open addressing table of the indices of the values, at most half full
+    size_t capacity = 16;
+    while (capacity < 2 * instructions.size()) capacity *= 2;
+    std::vector<int> numbering(capacity, -1);
+
     for (size_t i = 0; i < instructions.size(); ++i) {
-        Instruction& inst = instructions[i];
-        
-        switch (inst.op) {
-            case OpCode::VarX:
-            case OpCode::VarY:
-                // Variables are not constants
-                is_constant[i] = false;
-                break;
-                
-            case OpCode::Const:
-                // Already a constant
-                is_constant[i] = true;
-                constant_values[i] = inst.constant;
-                break;
-                
-            case OpCode::Add:
-            case OpCode::Sub:
-            case OpCode::Mul:
-            case OpCode::Div:
-            case OpCode::Max:
-            case OpCode::Min:
-                if (inst.input0 != -1 && inst.input1 != -1 && 
-                    is_constant[inst.input0] && is_constant[inst.input1]) {
-                    float result = evaluate_constant_operation(inst.op, 
-                        constant_values[inst.input0], constant_values[inst.input1]);
-                    
-                    inst.op = OpCode::Const;
-                    inst.constant = result;
-                    inst.input0 = -1;
-                    inst.input1 = -1;
-                    
-                    is_constant[i] = true;
-                    constant_values[i] = result;
-                } else {
-                    is_constant[i] = false;
-                }
-                break;
-                
-            case OpCode::Neg:
-            case OpCode::Abs:
-            case OpCode::Square:
-            case OpCode::Sqrt:
-                // Unary operations
-                if (inst.input0 != -1 && is_constant[inst.input0]) {
-                    // Input is constant, we can fold this operation
-                    float result = evaluate_constant_operation(inst.op, 
-                        constant_values[inst.input0]);
-                    
-                    // Convert this instruction to a constant
-                    inst.op = OpCode::Const;
-                    inst.constant = result;
-                    inst.input0 = -1;
-                    inst.input1 = -1;
-                    
-                    is_constant[i] = true;
-                    constant_values[i] = result;
-                } else {
-                    is_constant[i] = false;
-                }
-                break;
+        Instruction inst = instructions[i];
+        if (inst.input0 != -1) inst.input0 = value_of[inst.input0];
+        if (inst.input1 != -1) inst.input1 = value_of[inst.input1];
+
+        int alias = -1;
+        for (;;) {
+            const Instruction before = inst;
+            alias = simplify(inst, values);
+            // The instruction of a shape is kept, tiles are matched to shapes through it
+            if (alias != -1 && inst.shape && values[alias].shape != inst.shape) alias = -1;
+            if (alias != -1) break;
+            if (inst.op == before.op && inst.input0 == before.input0 && inst.input1 == before.input1) break;
+        }
+        if (alias != -1) {
+            value_of[i] = alias;
+            continue;
+        }
+
+        size_t slot = value_hash(inst) & (capacity - 1);
+        while (numbering[slot] != -1 && !same_value(values[numbering[slot]], inst)) slot = (slot + 1) & (capacity - 1);
+        if (numbering[slot] == -1) {
+            numbering[slot] = values.size();
+            values.push_back(inst);
         }
+        value_of[i] = numbering[slot];
     }
-    
-    // Dead code elimination pass
-    if (instructions.empty()) return;
-    
-    std::vector<bool> is_referenced(instructions.size(), false);
-    
-    is_referenced[instructions.size() - 1] = true;
-    
-    // Work backwards to mark all transitively referenced instructions
-    for (int i = instructions.size() - 1; i >= 0; --i) {
-        if (is_referenced[i]) {
-            const Instruction& inst = instructions[i];
-            if (inst.input0 != -1 && inst.input0 < (int)instructions.size()) {
-                is_referenced[inst.input0] = true;
+
+    // Dead code elimination. Values after the result are not referenced by it, so the result
+    // ends up being the last instruction again.
+    const int result = value_of.back();
+    std::vector<bool> is_referenced(values.size(), false);
+    is_referenced[result] = true;
+    for (int i = result; i >= 0; --i) {
+        if (!is_referenced[i]) continue;
+        if (values[i].input0 != -1) is_referenced[values[i].input0] = true;
+        if (values[i].input1 != -1) is_referenced[values[i].input1] = true;
+    }
+
+    std::vector<int> old_to_new(values.size(), -1);
+    instructions.clear();
+    for (int i = 0; i <= result; ++i) {
+        if (!is_referenced[i]) continue;
+        Instruction inst = values[i];
+        if (inst.input0 != -1) inst.input0 = old_to_new[inst.input0];
+        if (inst.input1 != -1) inst.input1 = old_to_new[inst.input1];
+        old_to_new[i] = instructions.size();
+        instructions.push_back(inst);
+    }
+}
+
+// Builds a balanced tree over leaves[lo, hi) by splitting at the median of the centers along the
+// longer side of their extent, so every subtree covers a compact part of the domain
+static int build_balanced(OpCode op, std::vector<std::pair<int, std::array<float, 2>>>& leaves, size_t lo, size_t hi, std::vector<Instruction>& output) {
+    if (hi - lo == 1) return leaves[lo].first;
+
+    float lower[2] = {leaves[lo].second[0], leaves[lo].second[1]};
+    float upper[2] = {lower[0], lower[1]};
+    for (size_t i = lo + 1; i < hi; ++i) {
+        for (int axis = 0; axis < 2; ++axis) {
+            lower[axis] = std::min(lower[axis], leaves[i].second[axis]);
+            upper[axis] = std::max(upper[axis], leaves[i].second[axis]);
+        }
+    }
+    const int axis = upper[0] - lower[0] >= upper[1] - lower[1] ? 0 : 1;
+    const size_t mid = lo + (hi - lo) / 2;
+    std::nth_element(leaves.begin() + lo, leaves.begin() + mid, leaves.begin() + hi,
+                     [axis](const auto& a, const auto& b) { return a.second[axis] < b.second[axis]; });
+
+    Instruction inst;
+    inst.op = op;
+    inst.constant = 0.0f;
+    inst.shape = nullptr;
+    inst.input0 = build_balanced(op, leaves, lo, mid, output);
+    inst.input1 = build_balanced(op, leaves, mid, hi, output);
+    output.push_back(inst);
+    return output.size() - 1;
+}
+
+void balance_min_max(std::vector<Instruction>& instructions) {
+    const int n = static_cast<int>(instructions.size());
+
+    // Region covered by the shapes each instruction depends on
+    std::vector<Bounds> bounds(n);
+    std::vector<bool> has_bounds(n, false);
+    std::vector<int> uses(n, 0);
+    for (int i = 0; i < n; ++i) {
+        const Instruction& inst = instructions[i];
+        if (inst.shape) {
+            bounds[i] = inst.shape->get_bounds();
+            has_bounds[i] = true;
+        }
+        for (int input : {inst.input0, inst.input1}) {
+            if (input == -1) continue;
+            ++uses[input];
+            if (inst.shape || !has_bounds[input]) continue;
+            bounds[i] = has_bounds[i] ? bounds[i].merged(bounds[input]) : bounds[input];
+            has_bounds[i] = true;
+        }
+    }
+
+    // A Min (Max) whose only use is another Min (Max) is part of the same group. Instructions of
+    // shapes stay leaves, tiles are matched to shapes through them.
+    auto absorbed = [&](int parent, int child) {
+        return instructions[child].op == instructions[parent].op && uses[child] == 1 && !instructions[child].shape;
+    };
+    std::vector<bool> is_absorbed(n, false);
+    for (int i = 0; i < n; ++i) {
+        const Instruction& inst = instructions[i];
+        if (inst.op != OpCode::Min && inst.op != OpCode::Max) continue;
+        if (absorbed(i, inst.input0)) is_absorbed[inst.input0] = true;
+        if (absorbed(i, inst.input1)) is_absorbed[inst.input1] = true;
+    }
+
+    std::vector<Instruction> output;
+    output.reserve(n);
+    std::vector<int> old_to_new(n, -1);
+    std::vector<int> stack;
+    std::vector<std::pair<int, std::array<float, 2>>> leaves, unbounded;
+    bool rebalanced = false;
+    for (int i = 0; i < n; ++i) {
+        if (is_absorbed[i]) continue;
+        Instruction inst = instructions[i];
+        if (inst.op != OpCode::Min && inst.op != OpCode::Max) {
+            if (inst.input0 != -1) inst.input0 = old_to_new[inst.input0];
+            if (inst.input1 != -1) inst.input1 = old_to_new[inst.input1];
+            old_to_new[i] = output.size();
+            output.push_back(inst);
+            continue;
+        }
+
+        // Collect the operands of the group rooted at i
+        leaves.clear();
+        unbounded.clear();
+        stack.assign({inst.input1, inst.input0});
+        while (!stack.empty()) {
+            const int current = stack.back();
+            stack.pop_back();
+            if (is_absorbed[current]) {
+                stack.push_back(instructions[current].input1);
+                stack.push_back(instructions[current].input0);
+                continue;
             }
-            if (inst.input1 != -1 && inst.input1 < (int)instructions.size()) {
-                is_referenced[inst.input1] = true;
+            if (has_bounds[current]) {
+                const Bounds& b = bounds[current];
+                leaves.push_back({old_to_new[current], {0.5f * (b.x_min + b.x_max), 0.5f * (b.y_min + b.y_max)}});
+            } else {
+                unbounded.push_back({old_to_new[current], {0.0f, 0.0f}});
             }
         }
-    }
-    
-    // Create mapping from old indices to new indices
-    std::vector<int> old_to_new(instructions.size(), -1);
-    std::vector<Instruction> new_instructions;
-    new_instructions.reserve(instructions.size());
-    
-    for (size_t i = 0; i < instructions.size(); ++i) {
-        if (is_referenced[i]) {
-            old_to_new[i] = new_instructions.size();
-            new_instructions.push_back(instructions[i]);
+
+        rebalanced |= leaves.size() + unbounded.size() > 2;
+
+        // Operands without shapes are joined with the balanced tree last
+        int root = -1;
+        for (auto* group : {&leaves, &unbounded}) {
+            if (group->empty()) continue;
+            const int subtree = build_balanced(inst.op, *group, 0, group->size(), output);
+            if (root == -1) {
+                root = subtree;
+                continue;
+            }
+            Instruction join = inst;
+            join.shape = nullptr;
+            join.lipschitz = INFINITY;
+            join.input0 = root;
+            join.input1 = subtree;
+            output.push_back(join);
+            root = output.size() - 1;
         }
+        // A group has at least two operands, so its root is a new instruction and can take over
+        // the shape of the old one
+        output[root].shape = inst.shape;
+        output[root].lipschitz = inst.lipschitz;
+        old_to_new[i] = root;
     }
-    
-    for (Instruction& inst : new_instructions) {
-        if (inst.input0 != -1) {
-            inst.input0 = old_to_new[inst.input0];
+
+    // The operands of the groups were all computed before the trees that combine them. Emitting
+    // the instructions in depth first order from the result computes every operand right before
+    // its use, which keeps the number of live values low.
+    if (!rebalanced) {
+        instructions = std::move(output);
+        return;
+    }
+    const int num_output = static_cast<int>(output.size());
+    std::vector<int> order(num_output, -1);
+    instructions.clear();
+    stack.assign({num_output - 1});
+    while (!stack.empty()) {
+        const int current = stack.back();
+        if (order[current] != -1) {
+            stack.pop_back();
+            continue;
         }
-        if (inst.input1 != -1) {
-            inst.input1 = old_to_new[inst.input1];
+        const Instruction& inst = output[current];
+        bool ready = true;
+        for (int input : {inst.input1, inst.input0}) {
+            if (input != -1 && order[input] == -1) {
+                stack.push_back(input);
+                ready = false;
+            }
         }
+        if (!ready) continue;
+        stack.pop_back();
+        Instruction scheduled = inst;
+        if (scheduled.input0 != -1) scheduled.input0 = order[scheduled.input0];
+        if (scheduled.input1 != -1) scheduled.input1 = order[scheduled.input1];
+        order[current] = instructions.size();
+        instructions.push_back(scheduled);
     }
-    
-    instructions = std::move(new_instructions);
 }
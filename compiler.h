@@ -1,11 +1,13 @@
 #pragma once
 
+#include <math.h>
+
 #include <vector>
 #include "shapes.h"
 
 struct Scalar;
 
-enum class OpCode { VarX, VarY, Const, Add, Sub, Mul, Div, Max, Min, Neg, Abs, Square, Sqrt };
+enum class OpCode { VarX, VarY, VarZ, Const, Param, Add, Sub, Mul, Div, Max, Min, Neg, Abs, Square, Sqrt };
 
 struct Instruction 
 {
@@ -14,9 +16,42 @@ struct Instruction
     int input1;
     OpCode op;
     const IShape* shape;
+    // Slot in the parameter buffer read by a Param instruction, `constant` holds its bound value
+    int parameter = -1;
+    // Bound on the Lipschitz constant of the value, taken from the node
+    float lipschitz = INFINITY;
+};
+
+// Instruction of a register allocated tape. Instead of one result per instruction, results
+// are written to slots which are reused once the value they hold is no longer needed.
+// Binary instructions with a constant operand carry it as an immediate: the input is -1
+// and its value is stored in `constant`, so constants do not occupy slots or dispatches.
+struct RegisterInstruction
+{
+    OpCode op;
+    int output;
+    int input0;
+    int input1;
+    float constant;
+};
+
+struct RegisterTape
+{
+    std::vector<RegisterInstruction> instructions;
+    int num_slots = 0;
 };
 
 std::vector<Instruction> compile(const Scalar& node);
 
+// Assigns every instruction an output slot based on the liveness of its result. Inputs whose
+// last use is the current instruction are released first, so an instruction may write to
+// the slot of one of its inputs. The result of the tape is in the output of its last instruction.
+void allocate_registers(const std::vector<Instruction>& instructions, RegisterTape& tape);
+
 // Optimization pass that applies various optimizations including constant propagation
-void optimize_instructions(std::vector<Instruction>& instructions);
\ No newline at end of file
+void optimize_instructions(std::vector<Instruction>& instructions);
+
+// Flattens chains of Min (Max) into groups and rebuilds each group as a balanced tree in which
+// operands close to each other, judged by the bounds of their shapes, share subtrees. Pruning
+// can then drop a whole far away subtree at once.
+void balance_min_max(std::vector<Instruction>& instructions);
\ No newline at end of file
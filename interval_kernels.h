@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+
+#include "vm.h"
+#include "simd_lanes.h"
+
+// Interval arithmetic kernels shared by the 4- and 8-lane evaluators. The kernel is written
+// once against the lane operations in simd_lanes.h and instantiated for scalar, SSE and AVX lanes.
+
+// Defined in vm_avx2.cpp, only callable on hosts that support AVX2
+Interval8 evaluate_interval8_avx2(std::vector<Interval8>& interval_vars, const std::vector<Instruction>& instructions, const Interval8& x, const Interval8& y, const Interval8& z);
+
+namespace {
+
+// Evaluates the instructions on N intervals at once, where N is the lane count of IntervalN.
+// The lanes are processed in chunks of L::width.
+template<typename L, typename IntervalN>
+IntervalN evaluate_intervals(std::vector<IntervalN>& interval_vars, const std::vector<Instruction>& instructions, const IntervalN& x, const IntervalN& y, const IntervalN& z)
+{
+    using V = typename L::V;
+    constexpr int N = sizeof(IntervalN::lower) / sizeof(float);
+    static_assert(N % L::width == 0);
+
+    const size_t num_instructions = instructions.size();
+
+    for(size_t i = 0; i < num_instructions; ++i) {
+        const Instruction& inst = instructions[i];
+        IntervalN& out = interval_vars[i];
+        const IntervalN& in0 = interval_vars[inst.input0 == -1 ? i : inst.input0];
+        const IntervalN& in1 = interval_vars[inst.input1 == -1 ? i : inst.input1];
+
+        for(int j = 0; j < N; j += L::width) {
+            V lower = L::set1(0.0f), upper = lower;
+            switch(inst.op) {
+                case OpCode::VarX:
+                    lower = L::load(x.lower + j);
+                    upper = L::load(x.upper + j);
+                    break;
+                case OpCode::VarY:
+                    lower = L::load(y.lower + j);
+                    upper = L::load(y.upper + j);
+                    break;
+                case OpCode::VarZ:
+                    lower = L::load(z.lower + j);
+                    upper = L::load(z.upper + j);
+                    break;
+                case OpCode::Const:
+                case OpCode::Param:
+                    lower = upper = L::set1(inst.constant);
+                    break;
+                case OpCode::Add:
+                    lower = L::add(L::load(in0.lower + j), L::load(in1.lower + j));
+                    upper = L::add(L::load(in0.upper + j), L::load(in1.upper + j));
+                    break;
+                case OpCode::Sub:
+                    lower = L::sub(L::load(in0.lower + j), L::load(in1.upper + j));
+                    upper = L::sub(L::load(in0.upper + j), L::load(in1.lower + j));
+                    break;
+                case OpCode::Mul: {
+                    V a = L::load(in0.lower + j), b = L::load(in0.upper + j);
+                    V c = L::load(in1.lower + j), d = L::load(in1.upper + j);
+                    V p1 = L::mul(a, c), p2 = L::mul(a, d), p3 = L::mul(b, c), p4 = L::mul(b, d);
+                    lower = L::min(L::min(p1, p2), L::min(p3, p4));
+                    upper = L::max(L::max(p1, p2), L::max(p3, p4));
+                    break;
+                }
+                case OpCode::Div: {
+                    V a = L::load(in0.lower + j), b = L::load(in0.upper + j);
+                    V c = L::load(in1.lower + j), d = L::load(in1.upper + j);
+                    V p1 = L::div(a, c), p2 = L::div(a, d), p3 = L::div(b, c), p4 = L::div(b, d);
+                    // A denominator containing zero makes the result unbounded
+                    auto unbounded = L::straddles_zero(c, d);
+                    lower = L::select(unbounded, L::set1(-std::numeric_limits<float>::infinity()), L::min(L::min(p1, p2), L::min(p3, p4)));
+                    upper = L::select(unbounded, L::set1(std::numeric_limits<float>::infinity()), L::max(L::max(p1, p2), L::max(p3, p4)));
+                    break;
+                }
+                case OpCode::Max:
+                    lower = L::max(L::load(in0.lower + j), L::load(in1.lower + j));
+                    upper = L::max(L::load(in0.upper + j), L::load(in1.upper + j));
+                    break;
+                case OpCode::Min:
+                    lower = L::min(L::load(in0.lower + j), L::load(in1.lower + j));
+                    upper = L::min(L::load(in0.upper + j), L::load(in1.upper + j));
+                    break;
+                case OpCode::Neg:
+                    lower = L::neg(L::load(in0.upper + j));
+                    upper = L::neg(L::load(in0.lower + j));
+                    break;
+                case OpCode::Abs: {
+                    // [l, u] if l >= 0, [-u, -l] if u <= 0 and [0, max(-l, u)] otherwise
+                    V l = L::load(in0.lower + j), u = L::load(in0.upper + j);
+                    lower = L::max(L::max(l, L::neg(u)), L::set1(0.0f));
+                    upper = L::max(L::neg(l), u);
+                    break;
+                }
+                case OpCode::Square: {
+                    // Square the absolute value interval, see Abs
+                    V l = L::load(in0.lower + j), u = L::load(in0.upper + j);
+                    V abs_lower = L::max(L::max(l, L::neg(u)), L::set1(0.0f));
+                    V abs_upper = L::max(L::neg(l), u);
+                    lower = L::mul(abs_lower, abs_lower);
+                    upper = L::mul(abs_upper, abs_upper);
+                    break;
+                }
+                case OpCode::Sqrt:
+                    // Negative parts of the input are clamped to zero
+                    lower = L::sqrt(L::max(L::set1(0.0f), L::load(in0.lower + j)));
+                    upper = L::sqrt(L::max(L::set1(0.0f), L::load(in0.upper + j)));
+                    break;
+            }
+            L::store(out.lower + j, lower);
+            L::store(out.upper + j, upper);
+        }
+    }
+
+    return interval_vars[num_instructions - 1];
+}
+
+} // namespace
@@ -62,6 +62,10 @@ void parse_instructions(std::istream& file, std::vector<Instruction>& instructio
         {
             inst.op = OpCode::VarY;
         } 
+        else if (tokens[1] == "var-z") 
+        {
+            inst.op = OpCode::VarZ;
+        } 
         else if (tokens[1] == "const") 
         {
             inst.op = OpCode::Const;
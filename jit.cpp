@@ -0,0 +1,443 @@
+#include <assert.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "jit.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define HYBRID_MODELING_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+uint64_t hash_tape(const RegisterTape& tape) {
+    // Looked up once per tile, so it has to be cheap compared to evaluating the tile. The
+    // multiplications are independent of each other, only the rotate and xor are serial.
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ tape.num_slots;
+    for (const RegisterInstruction& inst : tape.instructions) {
+        uint32_t constant;
+        memcpy(&constant, &inst.constant, sizeof(constant));
+        const uint64_t a = static_cast<uint32_t>(inst.output) | static_cast<uint64_t>(static_cast<uint32_t>(inst.input0)) << 32;
+        const uint64_t b = static_cast<uint32_t>(inst.input1) | static_cast<uint64_t>(constant) << 32;
+        hash = ((hash << 5) | (hash >> 59)) ^ (a * 0xff51afd7ed558ccdull + b * 0xc4ceb9fe1a85ec53ull + static_cast<uint64_t>(inst.op));
+    }
+    // Final avalanche of murmur3
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool same_tape(const RegisterTape& a, const RegisterTape& b) {
+    if (a.num_slots != b.num_slots || a.instructions.size() != b.instructions.size()) return false;
+    // Constants are compared bitwise, the code does not depend on anything else
+    return std::equal(a.instructions.begin(), a.instructions.end(), b.instructions.begin(),
+                      [](const RegisterInstruction& x, const RegisterInstruction& y) {
+                          return x.op == y.op && x.output == y.output && x.input0 == y.input0 && x.input1 == y.input1 &&
+                                 memcmp(&x.constant, &y.constant, sizeof(float)) == 0;
+                      });
+}
+
+#if defined(HYBRID_MODELING_JIT_X86_64)
+
+// Machine code for the System V calling convention. The arguments of JitFunction arrive in
+// rdi (x), rsi (y), rdx (out), rcx (slots) and r8 (n). Constants are broadcast vectors in a
+// pool after the code, addressed relative to rip.
+class Assembler
+{
+public:
+    std::vector<uint8_t> code;
+
+    // Reserves for `size` bytes of code with up to `constants` rip relative operands
+    Assembler(int lanes, size_t size, size_t constants) : lanes(lanes) {
+        code.reserve(size);
+        fixups.reserve(constants);
+    }
+
+    void bytes(std::initializer_list<uint8_t> b) { code.insert(code.end(), b); }
+
+    void u32(uint32_t v) {
+        for (int i = 0; i < 4; ++i) code.push_back((v >> (8 * i)) & 0xff);
+    }
+
+    // Legacy SSE encoding, `op xmm, [base + disp32]`, `op xmm, xmm` and `op xmm, [rip + constant]`
+    // for the packed single precision opcodes (movups = 0x10, addps = 0x58 etc.)
+    void sse_memory(uint8_t opcode, int xmm, int base, int32_t disp) { bytes({0x0f, opcode, static_cast<uint8_t>(0x80 | (xmm << 3) | base)}); u32(disp); }
+    void sse_register(uint8_t opcode, int dst, int src) { bytes({0x0f, opcode, static_cast<uint8_t>(0xc0 | (dst << 3) | src)}); }
+    void sse_constant(uint8_t opcode, int xmm, uint32_t bits) { bytes({0x0f, opcode, static_cast<uint8_t>(0x05 | (xmm << 3))}); constant(bits); }
+
+    // VEX encoding on ymm registers, `op dst, src0, ...` with the same opcodes. Instructions
+    // without a first source (loads, stores, sqrt) pass 0 for it.
+    void avx_memory(uint8_t opcode, int dst, int base, int32_t disp) { vex(dst, 0, 0); bytes({opcode, static_cast<uint8_t>(0x80 | ((dst & 7) << 3) | base)}); u32(disp); }
+    void avx_register(uint8_t opcode, int dst, int src0, int src1) { vex(dst, src0, src1); bytes({opcode, static_cast<uint8_t>(0xc0 | ((dst & 7) << 3) | (src1 & 7))}); }
+    void avx_constant(uint8_t opcode, int dst, int src0, uint32_t bits) { vex(dst, src0, 0); bytes({opcode, static_cast<uint8_t>(0x05 | ((dst & 7) << 3))}); constant(bits); }
+
+    // Appends the constant pool after the code and resolves the rip relative operands
+    void place_constants() {
+        const size_t vector_size = 4 * lanes;
+        while (code.size() % vector_size) code.push_back(0xcc);
+        std::vector<uint32_t> pool;
+        std::unordered_map<uint32_t, size_t> pool_index;
+        pool_index.reserve(fixups.size());
+        for (const Fixup& fixup : fixups) {
+            auto [it, inserted] = pool_index.try_emplace(fixup.bits, pool.size());
+            if (inserted) pool.push_back(fixup.bits);
+            const int64_t target = code.size() + vector_size * it->second;
+            const int32_t disp = static_cast<int32_t>(target - (fixup.offset + 4));
+            memcpy(code.data() + fixup.offset, &disp, sizeof(disp));
+        }
+        for (uint32_t bits : pool) {
+            for (int lane = 0; lane < lanes; ++lane) u32(bits);
+        }
+    }
+
+private:
+    struct Fixup
+    {
+        size_t offset;
+        uint32_t bits;
+    };
+    int lanes;
+    std::vector<Fixup> fixups;
+
+    // rip relative displacement, patched once the pool is placed
+    void constant(uint32_t bits) {
+        fixups.push_back({code.size(), bits});
+        u32(0);
+    }
+
+    // 256 bit, map 0F, no mandatory prefix. The two byte form cannot extend the rm register.
+    void vex(int reg, int src0, int rm) {
+        const uint8_t tail = static_cast<uint8_t>(((~src0 & 15) << 3) | 0x04);
+        if (rm < 8) {
+            bytes({0xc5, static_cast<uint8_t>((reg < 8 ? 0x80 : 0) | tail)});
+        } else {
+            bytes({0xc4, static_cast<uint8_t>((reg < 8 ? 0x80 : 0) | 0x40 | 0x01), tail});
+        }
+    }
+};
+
+enum Register { RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+
+constexpr uint8_t MOVUPS_LOAD = 0x10, MOVUPS_STORE = 0x11, MOVAPS = 0x28, ANDPS = 0x54, XORPS = 0x57, SQRTPS = 0x51, MULPS = 0x59;
+
+uint32_t float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+uint8_t binary_opcode(OpCode op) {
+    switch (op) {
+        case OpCode::Add: return 0x58;
+        case OpCode::Sub: return 0x5c;
+        case OpCode::Mul: return 0x59;
+        case OpCode::Div: return 0x5e;
+        case OpCode::Max: return 0x5f;
+        case OpCode::Min: return 0x5d;
+        default: assert(false); return 0;
+    }
+}
+
+// Loop around the body: `test r8, r8; jz end; body; advance; sub r8, points; jnz body`.
+// The pointers to x, y and out advance by `points` floats per iteration.
+template<typename Body>
+void emit_loop(Assembler& a, int points, Body body) {
+    a.bytes({0x4d, 0x85, 0xc0, 0x0f, 0x84});
+    const size_t skip_offset = a.code.size();
+    a.u32(0);
+    const size_t loop_start = a.code.size();
+
+    body();
+
+    const uint8_t step = static_cast<uint8_t>(4 * points);
+    a.bytes({0x48, 0x83, 0xc7, step, 0x48, 0x83, 0xc6, step, 0x48, 0x83, 0xc2, step, 0x49, 0x83, 0xe8, static_cast<uint8_t>(points), 0x0f, 0x85});
+    a.u32(static_cast<uint32_t>(static_cast<int32_t>(loop_start - (a.code.size() + 4))));
+    const int32_t skip = static_cast<int32_t>(a.code.size() - (skip_offset + 4));
+    memcpy(a.code.data() + skip_offset, &skip, sizeof(skip));
+}
+
+// Four points per iteration in xmm0 with the second operand in xmm1. Slot s of the current
+// points is at rcx + 16 * s, so this works for any number of slots.
+std::vector<uint8_t> assemble_sse(const RegisterTape& tape) {
+    Assembler a(4, 24 * tape.instructions.size() + 64, tape.instructions.size());
+    emit_loop(a, 4, [&] {
+        // Slot whose value is still in xmm0, loads of it are skipped
+        int cached = -1;
+        auto load_slot = [&](int xmm, int slot) {
+            if (slot == cached) {
+                if (xmm == 1) a.sse_register(MOVAPS, 1, 0);
+            } else {
+                a.sse_memory(MOVUPS_LOAD, xmm, RCX, 16 * slot);
+            }
+        };
+
+        for (const RegisterInstruction& inst : tape.instructions) {
+            switch (inst.op) {
+                case OpCode::VarX: a.sse_memory(MOVUPS_LOAD, 0, RDI, 0); break;
+                case OpCode::VarY: a.sse_memory(MOVUPS_LOAD, 0, RSI, 0); break;
+                case OpCode::VarZ: assert(false); break;
+                case OpCode::Const:
+                case OpCode::Param: a.sse_constant(MOVUPS_LOAD, 0, float_bits(inst.constant)); break;
+                case OpCode::Add:
+                case OpCode::Sub:
+                case OpCode::Mul:
+                case OpCode::Div:
+                case OpCode::Max:
+                case OpCode::Min:
+                    // The second operand first, loading the first one may overwrite xmm0
+                    if (inst.input1 == -1) {
+                        load_slot(0, inst.input0);
+                        a.sse_constant(binary_opcode(inst.op), 0, float_bits(inst.constant));
+                    } else {
+                        load_slot(1, inst.input1);
+                        if (inst.input0 == -1) {
+                            a.sse_constant(MOVUPS_LOAD, 0, float_bits(inst.constant));
+                        } else {
+                            load_slot(0, inst.input0);
+                        }
+                        a.sse_register(binary_opcode(inst.op), 0, 1);
+                    }
+                    break;
+                case OpCode::Neg:
+                    load_slot(0, inst.input0);
+                    a.sse_constant(XORPS, 0, 0x80000000u);
+                    break;
+                case OpCode::Abs:
+                    load_slot(0, inst.input0);
+                    a.sse_constant(ANDPS, 0, 0x7fffffffu);
+                    break;
+                case OpCode::Square:
+                    load_slot(0, inst.input0);
+                    a.sse_register(MULPS, 0, 0);
+                    break;
+                case OpCode::Sqrt:
+                    load_slot(0, inst.input0);
+                    a.sse_register(SQRTPS, 0, 0);
+                    break;
+            }
+            a.sse_memory(MOVUPS_STORE, 0, RCX, 16 * inst.output);
+            cached = inst.output;
+        }
+        a.sse_memory(MOVUPS_STORE, 0, RDX, 0);
+    });
+    a.bytes({0xc3}); // ret
+    a.place_constants();
+    return std::move(a.code);
+}
+
+// Slots live in ymm registers, `unroll` registers per slot for 8 * unroll points per
+// iteration. ymm15 holds constants that are the first operand of a binary instruction.
+std::vector<uint8_t> assemble_avx(const RegisterTape& tape, int unroll) {
+    constexpr int TEMP = 15;
+    Assembler a(8, 16 * unroll * tape.instructions.size() + 64, unroll * tape.instructions.size());
+    auto reg = [&](int slot, int u) { return slot * unroll + u; };
+    emit_loop(a, 8 * unroll, [&] {
+        for (const RegisterInstruction& inst : tape.instructions) {
+            for (int u = 0; u < unroll; ++u) {
+                const int out = reg(inst.output, u);
+                switch (inst.op) {
+                    case OpCode::VarX: a.avx_memory(MOVUPS_LOAD, out, RDI, 32 * u); break;
+                    case OpCode::VarY: a.avx_memory(MOVUPS_LOAD, out, RSI, 32 * u); break;
+                    case OpCode::VarZ: assert(false); break;
+                    case OpCode::Const:
+                    case OpCode::Param: a.avx_constant(MOVUPS_LOAD, out, 0, float_bits(inst.constant)); break;
+                    case OpCode::Add:
+                    case OpCode::Sub:
+                    case OpCode::Mul:
+                    case OpCode::Div:
+                    case OpCode::Max:
+                    case OpCode::Min:
+                        if (inst.input1 == -1) {
+                            a.avx_constant(binary_opcode(inst.op), out, reg(inst.input0, u), float_bits(inst.constant));
+                        } else if (inst.input0 == -1) {
+                            a.avx_constant(MOVUPS_LOAD, TEMP, 0, float_bits(inst.constant));
+                            a.avx_register(binary_opcode(inst.op), out, TEMP, reg(inst.input1, u));
+                        } else {
+                            a.avx_register(binary_opcode(inst.op), out, reg(inst.input0, u), reg(inst.input1, u));
+                        }
+                        break;
+                    case OpCode::Neg: a.avx_constant(XORPS, out, reg(inst.input0, u), 0x80000000u); break;
+                    case OpCode::Abs: a.avx_constant(ANDPS, out, reg(inst.input0, u), 0x7fffffffu); break;
+                    case OpCode::Square: a.avx_register(MULPS, out, reg(inst.input0, u), reg(inst.input0, u)); break;
+                    case OpCode::Sqrt: a.avx_register(SQRTPS, out, 0, reg(inst.input0, u)); break;
+                }
+            }
+        }
+        for (int u = 0; u < unroll; ++u) {
+            a.avx_memory(MOVUPS_STORE, reg(tape.instructions.back().output, u), RDX, 32 * u);
+        }
+    });
+    a.bytes({0xc5, 0xf8, 0x77, 0xc3}); // vzeroupper; ret
+    a.place_constants();
+    return std::move(a.code);
+}
+
+std::vector<uint8_t> assemble(const RegisterTape& tape) {
+    // 15 ymm registers for the slots, two per slot if they fit for 16 points per iteration
+    static const bool has_avx = __builtin_cpu_supports("avx");
+    if (has_avx && 2 * tape.num_slots <= 15) return assemble_avx(tape, 2);
+    if (has_avx && tape.num_slots <= 15) return assemble_avx(tape, 1);
+    return assemble_sse(tape);
+}
+
+#endif
+
+} // namespace
+
+// Executable memory holding one compiled tape, along with the tape to compare lookups with
+struct JitCache::Code
+{
+    void* memory = nullptr;
+    size_t size = 0;
+    JitFunction function = nullptr;
+    RegisterTape tape;
+    std::atomic<uint64_t> last_use{0};
+
+    ~Code() {
+#if defined(HYBRID_MODELING_JIT_X86_64)
+        if (memory) munmap(memory, size);
+#endif
+    }
+};
+
+bool jit_supported() {
+#if defined(HYBRID_MODELING_JIT_X86_64)
+    return true;
+#else
+    return false;
+#endif
+}
+
+JitCache::JitCache() = default;
+JitCache::~JitCache() = default;
+
+std::shared_ptr<const JitFunction> JitCache::find(Shard& shard, uint64_t hash, const RegisterTape& tape) {
+    auto it = shard.compiled.find(hash);
+    if (it == shard.compiled.end()) return nullptr;
+    for (const std::shared_ptr<Code>& code : it->second) {
+        if (same_tape(code->tape, tape)) {
+            code->last_use.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+            return std::shared_ptr<const JitFunction>(code, &code->function);
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const JitFunction> JitCache::get(const RegisterTape& tape) {
+    if (!jit_supported() || tape.instructions.empty()) return nullptr;
+    // JitFunction has no z row, tapes of 3D programs are left to the interpreter
+    if (std::any_of(tape.instructions.begin(), tape.instructions.end(), [](const RegisterInstruction& inst) { return inst.op == OpCode::VarZ; })) return nullptr;
+
+    const uint64_t hash = hash_tape(tape);
+    Shard& shard = shards[hash >> 60];
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        if (auto function = find(shard, hash, tape)) return function;
+    }
+
+    const uint32_t fingerprint = static_cast<uint32_t>(tape.instructions.size()) ^ (static_cast<uint32_t>(tape.num_slots) << 20);
+    {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        // Another thread may have published it since the lookup
+        if (auto function = find(shard, hash, tape)) return function;
+        if (shard.cold.size() >= MAX_COLD && !shard.cold.count(hash)) {
+            std::erase_if(shard.cold, [](const auto& entry) { return !entry.second.compiling && !entry.second.failed; });
+        }
+        Cold& cold = shard.cold[hash];
+        if (cold.fingerprint != fingerprint && !cold.compiling) cold = {fingerprint};
+        if (cold.failed || cold.compiling || ++cold.uses < compile_threshold) return nullptr;
+        cold.compiling = true;
+    }
+
+    // Compiled without the lock, other threads keep interpreting the tape meanwhile
+    std::shared_ptr<Code> code;
+#if defined(HYBRID_MODELING_JIT_X86_64)
+    {
+        // Written while mapped read/write, then flipped to read/execute
+        std::vector<uint8_t> bytes = assemble(tape);
+        const size_t page = sysconf(_SC_PAGESIZE);
+        code = std::make_shared<Code>();
+        code->size = (bytes.size() + page - 1) / page * page;
+        void* memory = mmap(nullptr, code->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            code = nullptr;
+        } else {
+            code->memory = memory;
+            memcpy(memory, bytes.data(), bytes.size());
+            if (mprotect(memory, code->size, PROT_READ | PROT_EXEC) == 0) {
+                code->function = reinterpret_cast<JitFunction>(memory);
+                code->tape = tape;
+            } else {
+                code = nullptr;
+            }
+        }
+    }
+#endif
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (!code) {
+        // Failed compiles are not retried
+        Cold& cold = shard.cold[hash];
+        cold.compiling = false;
+        cold.failed = true;
+        return nullptr;
+    }
+    shard.cold.erase(hash);
+    code->last_use.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+    shard.compiled[hash].push_back(code);
+    ++shard.num_compiled;
+
+    // Releases the least recently used functions of the shard beyond its share of the bound
+    const size_t max_shard_compiled = std::max<size_t>(1, (max_compiled + NUM_SHARDS - 1) / NUM_SHARDS);
+    while (shard.num_compiled > max_shard_compiled) {
+        auto oldest_bucket = shard.compiled.end();
+        size_t oldest_index = 0;
+        uint64_t oldest_use = UINT64_MAX;
+        for (auto it = shard.compiled.begin(); it != shard.compiled.end(); ++it) {
+            for (size_t i = 0; i < it->second.size(); ++i) {
+                const uint64_t use = it->second[i]->last_use.load(std::memory_order_relaxed);
+                if (use < oldest_use) {
+                    oldest_bucket = it;
+                    oldest_index = i;
+                    oldest_use = use;
+                }
+            }
+        }
+        oldest_bucket->second.erase(oldest_bucket->second.begin() + oldest_index);
+        if (oldest_bucket->second.empty()) shard.compiled.erase(oldest_bucket);
+        --shard.num_compiled;
+    }
+    return std::shared_ptr<const JitFunction>(code, &code->function);
+}
+
+size_t JitCache::size() const {
+    size_t count = 0;
+    for (const Shard& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        count += shard.num_compiled + shard.cold.size();
+    }
+    return count;
+}
+
+size_t JitCache::compiled() const {
+    size_t count = 0;
+    for (const Shard& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        count += shard.num_compiled;
+    }
+    return count;
+}
+
+void JitCache::clear() {
+    for (Shard& shard : shards) {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.compiled.clear();
+        shard.cold.clear();
+        shard.num_compiled = 0;
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <array>
+
+#include "compiler.h"
+
+// Native code for a register tape. It evaluates n points (a multiple of 16) read from the x
+// and y rows and writes the result to the out row. Slots are kept in registers if the tape
+// has few enough of them, otherwise `slots` holds them and has to fit 4 * num_slots floats.
+using JitFunction = void (*)(const float* x, const float* y, float* out, float* slots, size_t n);
+
+// Whether the host has a JIT backend, currently x86-64 with the System V calling convention
+bool jit_supported();
+
+// Compiled functions of register tapes. Tapes are looked up by their hash and compared in
+// full, so identical tapes (e.g. the pruned tapes of neighbouring tiles) share one function.
+// Safe to use from several threads.
+class JitCache
+{
+public:
+    // Tapes are only compiled once they were requested this many times, the cost of
+    // compiling a tape that is evaluated once is not worth it
+    int compile_threshold = 2;
+
+    // Compiled functions kept, the least recently used ones are released beyond it. The bound
+    // applies to each of the shards the tapes are spread over by hash, rounded up. Lowering it
+    // takes effect as the shards compile new functions.
+    size_t max_compiled = 4096;
+
+    JitCache();
+    ~JitCache();
+    JitCache(const JitCache&) = delete;
+    JitCache& operator=(const JitCache&) = delete;
+
+    // Returns the function for the tape or nullptr if the tape is not hot yet, reads z, failed
+    // to compile or the host is not supported. The function stays valid while the pointer is
+    // held, even if the cache releases it meanwhile.
+    std::shared_ptr<const JitFunction> get(const RegisterTape& tape);
+
+    // Number of tapes in the cache, compiled or not
+    size_t size() const;
+
+    // Number of compiled functions
+    size_t compiled() const;
+
+    // Releases all functions, the running ones once their callers drop them
+    void clear();
+
+private:
+    struct Code;
+
+    // Tape that is not compiled yet. Only a fingerprint is kept besides the hash, a collision
+    // makes a tape hot early but the code is always compiled from the requested tape.
+    struct Cold
+    {
+        uint32_t fingerprint = 0;
+        int uses = 0;
+        bool compiling = false;
+        bool failed = false;
+    };
+
+    struct Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<uint64_t, std::vector<std::shared_ptr<Code>>> compiled;
+        std::unordered_map<uint64_t, Cold> cold;
+        size_t num_compiled = 0;
+    };
+
+    static constexpr size_t NUM_SHARDS = 16;
+    // Cold entries of a shard beyond which the use counts are forgotten
+    static constexpr size_t MAX_COLD = 4096;
+
+    std::shared_ptr<const JitFunction> find(Shard& shard, uint64_t hash, const RegisterTape& tape);
+
+    std::array<Shard, NUM_SHARDS> shards;
+    // Ticks of the lookups, the compiled functions remember the last one that returned them
+    std::atomic<uint64_t> clock{0};
+};
@@ -42,8 +42,15 @@ Mesh& mesh = contour_result.mesh; // Reference for easy access
 
 // Global parameters for mesh generation
 int resolution = 32;
+// Region of the plane that is contoured, the canvas shows -1..1 around its center at SCALE
+Bounds domain = {-1.0f, -1.0f, 1.0f, 1.0f};
 float union_radius = 0.1f;
 bool use_brep_union = false; // Toggle between brep and implicit union
+bool use_hybrid = false; // Mesh tiles of hard unions of rectangles from their outlines
+// Compiled tapes are kept across remeshing, so dragging a shape only compiles the tiles it touches
+std::shared_ptr<JitCache> jit_cache = std::make_shared<JitCache>();
+// Tiles of the last implicit union, changing a single shape only solves the tiles around it again
+std::unique_ptr<IncrementalContouring> contouring;
 std::vector<std::unique_ptr<IShape>> shapes;
 int selected_shape_index = -1;
 int ui_selected_shape_index = -1; // For UI selection (different from drag selection)
@@ -93,11 +100,33 @@ inline sf::Color color_for_shape(const IShape* shape) {
 
 } // namespace
 
+// Union of all shapes, smooth if the union radius is positive. The properties of the shapes
+// are parameters, their values are appended to `parameters`.
+Scalar combined_sdf(std::vector<float>& parameters) {
+    Scalar sdf = shapes[0]->get_parametric_sdf(parameters);
+
+    for (size_t i = 1; i < shapes.size(); ++i) {
+        Scalar current_shape = shapes[i]->get_parametric_sdf(parameters);
+
+        if (union_radius > 0.0f) {
+            sdf = inigo_smin(sdf, current_shape, Scalar(union_radius));
+        } else {
+            sdf = min(sdf, current_shape);
+        }
+    }
+    return sdf;
+}
+
 void update_mesh() {
+    ContouringOptions options;
+    options.jit = jit_cache;
+    options.window = domain;
+    contouring = nullptr;
+
     if (shapes.empty()) {
         // Create an empty mesh or a default shape
         Scalar empty_sdf = disk(Scalar(10.0f), Scalar(10.0f), Scalar(0.01f)); // Very small disk far away
-        contour_result = implicit_to_mesh(empty_sdf, resolution);
+        contour_result = implicit_to_mesh(empty_sdf, resolution, options);
         return;
     }
     
@@ -106,23 +135,30 @@ void update_mesh() {
         contour_result.mesh = union_mesh;
         contour_result.sign_change_data.clear();
         contour_result.expressions_list.clear();
+    } else if (use_hybrid) {
+        // Not incremental, edits of single shapes rebuild the whole contour
+        std::vector<float> parameters;
+        contour_result = implicit_to_mesh_hybrid(combined_sdf(parameters), resolution, options);
     } else {
-        Scalar combined_sdf = shapes[0]->get_sdf();
-        
-        for (size_t i = 1; i < shapes.size(); ++i) {
-            Scalar current_shape = shapes[i]->get_sdf();
-            
-            if (union_radius > 0.0f) {
-                combined_sdf = inigo_smin(combined_sdf, current_shape, Scalar(union_radius));
-            } else {
-                combined_sdf = min(combined_sdf, current_shape);
-            }
-        }
-        
-        contour_result = implicit_to_mesh(combined_sdf, resolution);
+        contouring = std::make_unique<IncrementalContouring>(resolution, options);
+        std::vector<float> parameters;
+        contour_result = contouring->rebuild(combined_sdf(parameters));
     }
 }
 
+// Updates the mesh after the properties of a single shape changed, `old_bounds` are the
+// bounds the shape had before. The SDF keeps its structure, so only the parameters are rebound.
+void update_mesh(const IShape* shape, Bounds old_bounds) {
+    if (!contouring || use_brep_union) {
+        update_mesh();
+        return;
+    }
+    std::vector<float> parameters;
+    for (const auto& s : shapes) s->get_parameters(parameters);
+    const Bounds region = old_bounds.merged(shape->get_bounds()).expanded(inigo_smin_width(union_radius));
+    contour_result = contouring->update(parameters, shape, region);
+}
+
 // ============================================================================
 // Global constants & forward declarations
 // ============================================================================
@@ -254,6 +290,7 @@ bool handle_events(sf::RenderWindow& window) {
                 float delta_y = delta.y / SCALE;
                 last_mouse_pos = mousePos;
 
+                const Bounds old_bounds = shapes[selected_shape_index]->get_bounds();
                 if (Disk* disk_shape = dynamic_cast<Disk*>(shapes[selected_shape_index].get())) {
                     disk_shape->pos_x += delta_x;
                     disk_shape->pos_y += delta_y;
@@ -262,7 +299,7 @@ bool handle_events(sf::RenderWindow& window) {
                     rect_shape->pos_y += delta_y;
                 }
                 
-                update_mesh();
+                update_mesh(shapes[selected_shape_index].get(), old_bounds);
             }
         }
     }
@@ -293,7 +330,8 @@ void render_imgui_controls() {
         resolution = std::max(4, std::min(resolution, 256));
         update_mesh();
     }
-    ImGui::Text("Current resolution: %dx%d grid", resolution, resolution);
+    const auto [cells_x, cells_y] = grid_cells(resolution, domain);
+    ImGui::Text("Current resolution: %dx%d grid", cells_x + 1, cells_y + 1);
 
     ImGui::Separator();
 
@@ -302,6 +340,9 @@ void render_imgui_controls() {
             update_mesh();
         }
         ImGui::Text("Union Type: %s", union_radius > 0.0f ? "Smooth Union" : "Min Union (Sharp)");
+        if (ImGui::Checkbox("Exact tiles of hard unions", &use_hybrid)) {
+            update_mesh();
+        }
     } else {
         ImGui::Text("Explicit boolean operations: Shape outlines combined");
     }
@@ -354,9 +395,10 @@ void render_imgui_controls() {
 
         ImGui::Separator();
 
+        const Bounds old_bounds = shape->get_bounds();
         bool shape_changed = shape->render_ui_properties();
         if (shape_changed) {
-            update_mesh();
+            update_mesh(shape, old_bounds);
         }
 
         ImGui::Separator();
@@ -379,23 +421,25 @@ void render_imgui_controls() {
 // Rendering helpers
 // ============================================================================
 void draw_grid(sf::RenderWindow& window) {
-    const float grid_spacing = 2.0f / (resolution - 1);
+    const auto [cells_x, cells_y] = grid_cells(resolution, domain);
+    const float x_spacing = (domain.x_max - domain.x_min) / cells_x;
+    const float y_spacing = (domain.y_max - domain.y_min) / cells_y;
     sf::Color grid_color(150, 150, 150, 50);
 
-    for (int i = 0; i < resolution; ++i) {
-        float x = -1.0f + i * grid_spacing;
+    for (int i = 0; i <= cells_x; ++i) {
+        float x = domain.x_min + i * x_spacing;
         std::array<sf::Vertex, 2> line = {
-            sf::Vertex{sf::Vector2f(CENTER_X + x * SCALE, CENTER_Y - SCALE), grid_color},
-            sf::Vertex{sf::Vector2f(CENTER_X + x * SCALE, CENTER_Y + SCALE), grid_color}
+            sf::Vertex{sf::Vector2f(CENTER_X + x * SCALE, CENTER_Y + domain.y_min * SCALE), grid_color},
+            sf::Vertex{sf::Vector2f(CENTER_X + x * SCALE, CENTER_Y + domain.y_max * SCALE), grid_color}
         };
         window.draw(line.data(), line.size(), sf::PrimitiveType::Lines);
     }
 
-    for (int i = 0; i < resolution; ++i) {
-        float y = -1.0f + i * grid_spacing;
+    for (int i = 0; i <= cells_y; ++i) {
+        float y = domain.y_min + i * y_spacing;
         std::array<sf::Vertex, 2> line = {
-            sf::Vertex{sf::Vector2f(CENTER_X - SCALE, CENTER_Y + y * SCALE), grid_color},
-            sf::Vertex{sf::Vector2f(CENTER_X + SCALE, CENTER_Y + y * SCALE), grid_color}
+            sf::Vertex{sf::Vector2f(CENTER_X + domain.x_min * SCALE, CENTER_Y + y * SCALE), grid_color},
+            sf::Vertex{sf::Vector2f(CENTER_X + domain.x_max * SCALE, CENTER_Y + y * SCALE), grid_color}
         };
         window.draw(line.data(), line.size(), sf::PrimitiveType::Lines);
     }
@@ -438,7 +482,7 @@ void draw_visualization_data_points(sf::RenderWindow& window) {
                 for(const auto& entry : contour_result.sign_change_data) {
                     int expression_idx = entry.second.second;
                     if (expression_idx >= 0 && static_cast<size_t>(expression_idx) < contour_result.expressions_list.size()) {
-                        float length = static_cast<float>(contour_result.expressions_list[expression_idx].size());
+                        float length = static_cast<float>(contour_result.expressions_list[expression_idx]->instructions.size());
                         min_display_value = std::min(min_display_value, length);
                         max_display_value = std::max(max_display_value, length);
                     }
@@ -467,23 +511,24 @@ void draw_visualization_data_points(sf::RenderWindow& window) {
     float hoveredValue = 0.0f;
     std::string hoveredLabel = "";
 
+    const auto [cells_x, cells_y] = grid_cells(resolution, domain);
     for (const auto& entry : contour_result.sign_change_data) {
         int vertex_idx = entry.first;
         float sdf_value = entry.second.first;
         int expression_idx = entry.second.second;
         assert(expression_idx >= 0 && expression_idx < static_cast<int>(contour_result.expressions_list.size()));
 
-        int i = vertex_idx / resolution;
-        int j = vertex_idx % resolution;
-        float x = -1.0f + j * (2.0f / (resolution-1));
-        float y = -1.0f + i * (2.0f / (resolution-1));
+        int i = vertex_idx / (cells_x + 1);
+        int j = vertex_idx % (cells_x + 1);
+        float x = domain.x_min + j * ((domain.x_max - domain.x_min) / cells_x);
+        float y = domain.y_min + i * ((domain.y_max - domain.y_min) / cells_y);
 
         float current_value_to_display = 0.0f;
         if (visualization_mode == 1) {
-            current_value_to_display = static_cast<float>(contour_result.expressions_list[expression_idx].size());
+            current_value_to_display = static_cast<float>(contour_result.expressions_list[expression_idx]->instructions.size());
         } else if (visualization_mode == 2) {
             const IShape* shape = nullptr;
-            const auto& insts = contour_result.expressions_list[expression_idx];
+            const auto& insts = contour_result.expressions_list[expression_idx]->instructions;
             if(!insts.empty()) shape = insts.back().shape;
             if (shape) {
                 sign_change_vertex.setFillColor(color_for_shape(shape));
@@ -509,7 +554,7 @@ void draw_visualization_data_points(sf::RenderWindow& window) {
                 hoveredLabel = "Instruction Length: ";
             } else if (visualization_mode == 2) {
                 const IShape* shape = nullptr;
-                const auto& insts = contour_result.expressions_list[expression_idx];
+                const auto& insts = contour_result.expressions_list[expression_idx]->instructions;
                 if(!insts.empty()) shape = insts.back().shape;
                 if (shape) {
                     hoveredLabel = "Shape: " + shape->name;
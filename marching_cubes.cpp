@@ -0,0 +1,121 @@
+#include "marching_cubes.h"
+#include "vm.h"
+
+#include <deque>
+#include <utility>
+#include <unordered_map>
+
+// Corners of a cell are numbered by the bits x = 1, y = 2 and z = 4. The six tetrahedra around
+// the diagonal from corner 0 to corner 7 split every face of the cell along the diagonal through
+// its lowest corner, so neighbouring cells split their common face the same way.
+static const int cell_tetrahedra[6][4] = {
+    {0, 1, 3, 7}, {0, 1, 5, 7}, {0, 2, 3, 7}, {0, 2, 6, 7}, {0, 4, 5, 7}, {0, 4, 6, 7},
+};
+
+static std::array<float, 3> cross(const std::array<float, 3>& a, const std::array<float, 3>& b) {
+    return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
+}
+
+TriangleMesh implicit_to_mesh3(Scalar implicit, int resolution) {
+    VM vm(implicit);
+    const int cells = resolution - 1;
+    std::deque<Tile3> tiles;
+    vm.evaluate(tiles, {0, 0, 0, cells, cells, cells});
+
+    const float x_step = (vm.domain_x_max - vm.domain_x_min) / cells;
+    const float y_step = (vm.domain_y_max - vm.domain_y_min) / cells;
+    const float z_step = (vm.domain_z_max - vm.domain_z_min) / cells;
+
+    TriangleMesh mesh;
+    // Vertex of every grid edge with a sign change, the key holds the indices of both grid points
+    std::unordered_map<uint64_t, uint32_t> edge_vertices;
+
+    // Corners of the current cell
+    std::array<float, 8> values;
+    std::array<uint32_t, 8> points;
+    std::array<std::array<float, 3>, 8> positions;
+
+    auto edge_vertex = [&](int a, int b) {
+        // Both cells of an edge look it up and interpolate from its lower grid point
+        if (points[a] > points[b]) std::swap(a, b);
+        const uint64_t key = static_cast<uint64_t>(points[a]) | static_cast<uint64_t>(points[b]) << 32;
+        auto [it, inserted] = edge_vertices.try_emplace(key, static_cast<uint32_t>(mesh.vertices.size()));
+        if (inserted) {
+            const float t = values[a] / (values[a] - values[b]);
+            const std::array<float, 3>& pa = positions[a];
+            const std::array<float, 3>& pb = positions[b];
+            mesh.vertices.push_back({pa[0] + t * (pb[0] - pa[0]), pa[1] + t * (pb[1] - pa[1]), pa[2] + t * (pb[2] - pa[2])});
+        }
+        return it->second;
+    };
+
+    // Adds the triangle so that its normal points along `outward`
+    auto add_triangle = [&](uint32_t v0, uint32_t v1, uint32_t v2, const std::array<float, 3>& outward) {
+        const std::array<float, 3>& p0 = mesh.vertices[v0];
+        const std::array<float, 3>& p1 = mesh.vertices[v1];
+        const std::array<float, 3>& p2 = mesh.vertices[v2];
+        const std::array<float, 3> n = cross({p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]}, {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]});
+        if (n[0] * outward[0] + n[1] * outward[1] + n[2] * outward[2] < 0.0f) std::swap(v1, v2);
+        mesh.triangles.push_back({v0, v1, v2});
+    };
+
+    for (const Tile3& tile : tiles) {
+        const Subgrid3& s = tile.subgrid;
+        const int row = s.nx + 1;
+        const int layer = row * (s.ny + 1);
+
+        for (int z = 0; z < s.nz; ++z) {
+            for (int y = 0; y < s.ny; ++y) {
+                for (int x = 0; x < s.nx; ++x) {
+                    int negative = 0;
+                    for (int c = 0; c < 8; ++c) {
+                        const int dx = c & 1, dy = (c >> 1) & 1, dz = c >> 2;
+                        values[c] = tile.values[(z + dz) * layer + (y + dy) * row + x + dx];
+                        negative += values[c] < 0.0f;
+                    }
+                    if (negative == 0 || negative == 8) continue;
+
+                    for (int c = 0; c < 8; ++c) {
+                        const int gx = s.px + x + (c & 1);
+                        const int gy = s.py + y + ((c >> 1) & 1);
+                        const int gz = s.pz + z + (c >> 2);
+                        points[c] = (static_cast<uint32_t>(gz) * resolution + gy) * resolution + gx;
+                        positions[c] = {vm.domain_x_min + gx * x_step, vm.domain_y_min + gy * y_step, vm.domain_z_min + gz * z_step};
+                    }
+
+                    for (const auto& tet : cell_tetrahedra) {
+                        int inside[4], outside[4];
+                        int num_inside = 0, num_outside = 0;
+                        for (int corner : tet) {
+                            if (values[corner] < 0.0f) inside[num_inside++] = corner;
+                            else outside[num_outside++] = corner;
+                        }
+                        if (num_inside == 0 || num_outside == 0) continue;
+
+                        // The surface faces from the inside corners towards the outside ones
+                        std::array<float, 3> outward{0.0f, 0.0f, 0.0f};
+                        for (int k = 0; k < 3; ++k) {
+                            for (int i = 0; i < num_outside; ++i) outward[k] += positions[outside[i]][k] / num_outside;
+                            for (int i = 0; i < num_inside; ++i) outward[k] -= positions[inside[i]][k] / num_inside;
+                        }
+
+                        if (num_inside == 1) {
+                            add_triangle(edge_vertex(inside[0], outside[0]), edge_vertex(inside[0], outside[1]), edge_vertex(inside[0], outside[2]), outward);
+                        } else if (num_inside == 3) {
+                            add_triangle(edge_vertex(inside[0], outside[0]), edge_vertex(inside[1], outside[0]), edge_vertex(inside[2], outside[0]), outward);
+                        } else {
+                            // The four crossings form a quad, consecutive ones share a corner
+                            const uint32_t q0 = edge_vertex(inside[0], outside[0]);
+                            const uint32_t q1 = edge_vertex(inside[0], outside[1]);
+                            const uint32_t q2 = edge_vertex(inside[1], outside[1]);
+                            const uint32_t q3 = edge_vertex(inside[1], outside[0]);
+                            add_triangle(q0, q1, q2, outward);
+                            add_triangle(q0, q2, q3, outward);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return mesh;
+}
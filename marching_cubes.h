@@ -0,0 +1,20 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+#include "node.h"
+
+// Indexed triangle mesh of a surface in 3D
+struct TriangleMesh {
+    std::vector<std::array<float, 3>> vertices;
+    std::vector<std::array<uint32_t, 3>> triangles;
+};
+
+// Meshes the zero level set on a grid of resolution^3 points over the domain box of the VM.
+// The cells of the octree tiles are split into tetrahedra, which unlike the cases of marching
+// cubes need no tables to resolve ambiguous faces. Vertices are shared between all triangles
+// of a grid edge, and the triangles are oriented counterclockwise seen from outside, i.e. from
+// where the SDF is positive.
+TriangleMesh implicit_to_mesh3(Scalar implicit, int resolution);
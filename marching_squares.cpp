@@ -3,7 +3,14 @@
 #include <cmath>
 #include <cstdio>
 #include <vector> 
+#include <array>
+#include <algorithm>
 #include <unordered_map>
+#include <mutex>
+#include <map>
+#include <span>
+#include <tuple>
+#include <omp.h>
 
 // Interpolate the zero crossing between two values
 static float interpolate(float v1, float v2) {
@@ -11,13 +18,49 @@ static float interpolate(float v1, float v2) {
     return -v1 / (v2 - v1);
 }
 
-// Hasher for edge key pairs
-struct Hasher {
-    size_t operator()(const std::pair<uint32_t, uint32_t>& p) const {
-        return std::hash<uint64_t>{}(uint64_t(p.first) | (uint64_t(p.second) << 32));
-    }
+// A crossing on the grid edge from (x0, y0) to (x0 + ex, y0 + ey) at parameter t
+struct EdgeCrossing {
+    uint32_t id;
+    float x0, y0;
+    float ex, ey;
+    float t;
 };
 
+// Refines the crossings of a tile with Newton steps on the tile's tape, restricted
+// to the edge each crossing lies on, and computes the normals at the final positions
+static void refine_crossings(VM& vm, const RegisterTape& tape, std::vector<EdgeCrossing>& crossings, int newton_steps,
+                             std::vector<std::pair<float, float>>& vertices, std::vector<std::pair<float, float>>& normals) {
+    std::array<float, MAX_TILE_SIZE> xs;
+    std::array<float, MAX_TILE_SIZE> ys;
+
+    for (size_t begin = 0; begin < crossings.size(); begin += MAX_TILE_SIZE) {
+        const size_t count = std::min(crossings.size() - begin, static_cast<size_t>(MAX_TILE_SIZE));
+        for (int step = 0; step <= newton_steps; ++step) {
+            for (size_t k = 0; k < count; ++k) {
+                const EdgeCrossing& c = crossings[begin + k];
+                xs[k] = c.x0 + c.t * c.ex;
+                ys[k] = c.y0 + c.t * c.ey;
+            }
+            BatchGradient g = vm.evaluate_batch_gradient(tape, {xs.data(), count}, {ys.data(), count});
+
+            for (size_t k = 0; k < count; ++k) {
+                EdgeCrossing& c = crossings[begin + k];
+                if (step < newton_steps) {
+                    // Derivative along the edge, steps leaving the edge are rejected
+                    const float slope = g.dx[k] * c.ex + g.dy[k] * c.ey;
+                    if (std::abs(slope) < 1e-12f) continue;
+                    const float t = c.t - g.value[k] / slope;
+                    if (t >= 0.0f && t <= 1.0f) c.t = t;
+                } else {
+                    const float length = std::sqrt(g.dx[k] * g.dx[k] + g.dy[k] * g.dy[k]);
+                    vertices[c.id] = {xs[k], ys[k]};
+                    normals[c.id] = length > 0.0f ? std::make_pair(g.dx[k] / length, g.dy[k] / length) : std::make_pair(0.0f, 0.0f);
+                }
+            }
+        }
+    }
+}
+
 // Edge indices for marching squares lookup
 struct EdgeIndices {
     int i1, j1, i2, j2;
@@ -81,129 +124,1098 @@ ContouringResult create_disk_mesh(float radius, int segments) {
     return result;
 }
 
+// Contours a coarse tile, see Tile::stride. Its cells are the cells of the lattice, where a cell
+// on a side of the tile has every grid point of that side as a corner. The crossings on the
+// sides are thus the ones a tile with stride 1 finds there. Lattice edges are indexed like the
+// grid edges of a fine tile, with lattice points instead of grid points, and followed by the
+// grid edges of the lower, upper, left and right side.
+static void contour_coarse_tile(VM& vm, const Tile& tile, const ContouringOptions& options, TileContour& contour) {
+    const float x_step = (vm.domain_x_max - vm.domain_x_min) / vm.grid_nx;
+    const float y_step = (vm.domain_y_max - vm.domain_y_min) / vm.grid_ny;
+    const int row = vm.grid_nx + 1;
+    const Subgrid& subgrid = tile.subgrid;
+    const int nx = subgrid.nx;
+    const int ny = subgrid.ny;
+    const int stride = tile.stride;
+    const int lattice_nx = lattice_lines(nx, stride);
+    const int lattice_ny = lattice_lines(ny, stride);
+    const int lower = lattice_nx * lattice_ny;
+    const int upper = lower + nx + 1;
+    const int left = upper + nx + 1;
+    const int right = left + ny + 1;
+
+    // Value at a local grid point on a side of the tile or on the lattice
+    auto value = [&](int x, int y) {
+        if (y == 0) return tile.values[lower + x];
+        if (y == ny) return tile.values[upper + x];
+        if (x == 0) return tile.values[left + y];
+        if (x == nx) return tile.values[right + y];
+        return tile.values[(y / stride) * lattice_nx + x / stride];
+    };
+    const int side_edges = 2 * lattice_nx * lattice_ny;
+    auto lower_edge = [&](int x) { return side_edges + x; };
+    auto upper_edge = [&](int x) { return side_edges + nx + x; };
+    auto left_edge = [&](int y) { return side_edges + 2 * nx + y; };
+    auto right_edge = [&](int y) { return side_edges + 2 * nx + ny + y; };
+
+    std::vector<EdgeCrossing> tile_crossings;
+    std::array<uint32_t, 2 * MAX_TILE_SIZE> crossing_of_edge;
+    // Adds the crossing on the edge from local grid point (x, y) to (x + ex, y + ey), if any
+    auto add_crossing = [&](int edge, int x, int y, int ex, int ey, bool shared) {
+        const float v0 = value(x, y);
+        const float v1 = value(x + ex, y + ey);
+        if (get_sign(v0) * get_sign(v1) >= 0) return;
+        const float t = interpolate(v0, v1);
+        assert(t >= 0.0f && t <= 1.0f);
+        const int gx = subgrid.px + x;
+        const int gy = subgrid.py + y;
+        const uint32_t id = tile_crossings.size();
+        tile_crossings.push_back({id, vm.domain_x_min + gx * x_step, vm.domain_y_min + gy * y_step, ex * x_step, ey * y_step, t});
+        crossing_of_edge[edge] = id;
+        if (shared) contour.border.push_back({2 * (static_cast<uint64_t>(gy) * row + gx) + (ey != 0), id});
+    };
+
+    // Sides of the tile are shared unless they are on the grid border
+    for (int x = 0; x < nx; ++x) {
+        add_crossing(lower_edge(x), x, 0, 1, 0, subgrid.py != 0);
+        add_crossing(upper_edge(x), x, ny, 1, 0, subgrid.py + ny != vm.grid_ny);
+    }
+    for (int y = 0; y < ny; ++y) {
+        add_crossing(left_edge(y), 0, y, 0, 1, subgrid.px != 0);
+        add_crossing(right_edge(y), nx, y, 0, 1, subgrid.px + nx != vm.grid_nx);
+    }
+    for (int j = 0; j < lattice_ny; ++j) {
+        const int y0 = lattice_line(j, ny, stride);
+        for (int i = 0; i < lattice_nx; ++i) {
+            const int x0 = lattice_line(i, nx, stride);
+            const int p = j * lattice_nx + i;
+            if (i + 1 < lattice_nx && j > 0 && j + 1 < lattice_ny) add_crossing(2 * p, x0, y0, lattice_line(i + 1, nx, stride) - x0, 0, false);
+            if (j + 1 < lattice_ny && i > 0 && i + 1 < lattice_nx) add_crossing(2 * p + 1, x0, y0, 0, lattice_line(j + 1, ny, stride) - y0, false);
+        }
+    }
+
+    contour.vertices.resize(tile_crossings.size());
+    contour.normals.resize(tile_crossings.size());
+    refine_crossings(vm, tile.tape->registers, tile_crossings, options.newton_steps, contour.vertices, contour.normals);
+
+    // Corners of a cell in counterclockwise order and the crossings on the edges between them,
+    // with whether the edge leaves the negative side
+    std::vector<std::pair<int, int>> corners;
+    std::vector<std::pair<uint32_t, bool>> crossings;
+    for (int j = 0; j + 1 < lattice_ny; ++j) {
+        const int y0 = lattice_line(j, ny, stride);
+        const int y1 = lattice_line(j + 1, ny, stride);
+        for (int i = 0; i + 1 < lattice_nx; ++i) {
+            const int x0 = lattice_line(i, nx, stride);
+            const int x1 = lattice_line(i + 1, nx, stride);
+            const int p = j * lattice_nx + i;
+            corners.clear();
+            crossings.clear();
+            // Steps to the next corner over the given edge, back to the first corner at the end
+            auto walk = [&](int x, int y, int edge) {
+                if (!corners.empty()) {
+                    auto [px, py] = corners.back();
+                    const float v0 = value(px, py);
+                    const float v1 = value(x, y);
+                    if (get_sign(v0) != get_sign(v1)) crossings.push_back({crossing_of_edge[edge], v0 < 0.0f});
+                }
+                corners.push_back({x, y});
+            };
+            walk(x0, y0, -1);
+            if (j == 0) {
+                for (int x = x0 + 1; x <= x1; ++x) walk(x, y0, lower_edge(x - 1));
+            } else {
+                walk(x1, y0, 2 * p);
+            }
+            if (i + 2 == lattice_nx) {
+                for (int y = y0 + 1; y <= y1; ++y) walk(x1, y, right_edge(y - 1));
+            } else {
+                walk(x1, y1, 2 * (p + 1) + 1);
+            }
+            if (j + 2 == lattice_ny) {
+                for (int x = x1 - 1; x >= x0; --x) walk(x, y1, upper_edge(x));
+            } else {
+                walk(x0, y1, 2 * (p + lattice_nx));
+            }
+            if (i == 0) {
+                for (int y = y1 - 1; y >= y0; --y) walk(x0, y, left_edge(y));
+            } else {
+                walk(x0, y0, 2 * p + 1);
+            }
+            corners.pop_back();
+            if (crossings.empty()) continue;
+
+            for (auto [x, y] : corners) {
+                contour.sign_changes.push_back({(subgrid.py + y) * row + subgrid.px + x, value(x, y)});
+            }
+            // Every segment cuts off a run of positive corners, from the crossing that enters the
+            // negative side to the one leaving it before the run, like the table for fine cells
+            for (size_t k = 0; k < crossings.size(); ++k) {
+                if (!crossings[k].second) continue;
+                contour.segments.push_back({crossings[(k + 1) % crossings.size()].first, crossings[k].first});
+            }
+        }
+    }
+}
+
+// Computes the crossings of the tile's grid edges and the contour segments of its cells. Grid
+// edges are indexed densely within the tile, the edge along x starting at local grid point p is
+// 2 * p and the one along y is 2 * p + 1. Grid points are placed like the VM samples them.
+static void contour_tile(VM& vm, const Tile& tile, const ContouringOptions& options, TileContour& contour) {
+    if (tile.stride > 1) {
+        contour_coarse_tile(vm, tile, options, contour);
+        return;
+    }
+    const float x_step = (vm.domain_x_max - vm.domain_x_min) / vm.grid_nx;
+    const float y_step = (vm.domain_y_max - vm.domain_y_min) / vm.grid_ny;
+    const int row = vm.grid_nx + 1;
+    std::vector<EdgeCrossing> tile_crossings;
+    // Crossing index of every local edge with a sign change, the others are never read
+    std::array<uint32_t, 2 * MAX_TILE_SIZE> crossing_of_edge;
+
+    const Subgrid& subgrid = tile.subgrid;
+    int start_x = subgrid.px;
+    int start_y = subgrid.py;
+    int nx = subgrid.nx;
+    int ny = subgrid.ny;
+    for (int local_y = 0; local_y <= ny; ++local_y) {
+        for (int local_x = 0; local_x <= nx; ++local_x) {
+            int x = start_x + local_x;
+            int y = start_y + local_y;
+            int p = local_y * (nx + 1) + local_x;
+            uint64_t i00 = static_cast<uint64_t>(y) * row + x;
+            float v00 = tile.values[p];
+            int s00 = get_sign(v00);
+            // Check right edge
+            if (local_x < nx) {
+                float v01 = tile.values[p + 1];
+                if (s00 * get_sign(v01) < 0) {
+                    float t = interpolate(v00, v01);
+                    assert(t >= 0.0f && t <= 1.0f);
+                    float world_y = vm.domain_y_min + y * y_step;
+                    uint32_t id = tile_crossings.size();
+                    tile_crossings.push_back({id, vm.domain_x_min + x * x_step, world_y, x_step, 0.0f, t});
+                    crossing_of_edge[2 * p] = id;
+                    // Edges on the lower or upper side are shared unless they are on the grid border
+                    if ((local_y == 0 || local_y == ny) && y != 0 && y != vm.grid_ny) contour.border.push_back({2 * i00, id});
+                }
+            }
+            // Check bottom edge
+            if (local_y < ny) {
+                float v10 = tile.values[p + nx + 1];
+                if (s00 * get_sign(v10) < 0) {
+                    float t = interpolate(v00, v10);
+                    assert(t >= 0.0f && t <= 1.0f);
+                    float world_x = vm.domain_x_min + x * x_step;
+                    uint32_t id = tile_crossings.size();
+                    tile_crossings.push_back({id, world_x, vm.domain_y_min + y * y_step, 0.0f, y_step, t});
+                    crossing_of_edge[2 * p + 1] = id;
+                    if ((local_x == 0 || local_x == nx) && x != 0 && x != vm.grid_nx) contour.border.push_back({2 * i00 + 1, id});
+                }
+            }
+        }
+    }
+
+    contour.vertices.resize(tile_crossings.size());
+    contour.normals.resize(tile_crossings.size());
+    refine_crossings(vm, tile.tape->registers, tile_crossings, options.newton_steps, contour.vertices, contour.normals);
+
+    for (int local_y = 0; local_y < ny; ++local_y) {
+        for (int local_x = 0; local_x < nx; ++local_x) {
+            int x = start_x + local_x;
+            int y = start_y + local_y;
+            int p = local_y * (nx + 1) + local_x;
+            int i00 = y * row + x;
+            int cell[4] = {i00, i00 + 1, i00 + row, i00 + row + 1};
+            int local_cell[4] = {p, p + 1, p + nx + 1, p + nx + 2};
+            float vs[4] = {
+                tile.values[local_cell[0]],
+                tile.values[local_cell[1]],
+                tile.values[local_cell[2]],
+                tile.values[local_cell[3]]
+            };
+            int config = 0;
+            if (vs[0] < 0) config |= 1;
+            if (vs[1] < 0) config |= 2;
+            if (vs[2] < 0) config |= 4;
+            if (vs[3] < 0) config |= 8;
+            if (config == 0 || config == 15) continue;
+
+            for (int k_vert = 0; k_vert < 4; ++k_vert) {
+                contour.sign_changes.push_back({cell[k_vert], vs[k_vert]});
+            }
+
+            // Corners two apart span an edge along y
+            auto crossing = [&](int i, int j) { return crossing_of_edge[2 * local_cell[i] + (j - i == 2)]; };
+            const auto& edges = marching_squares_table[config];
+            for (const EdgeIndices& edge : edges) {
+                if (edge.i1 == -1) continue;
+                contour.segments.push_back({crossing(edge.i1, edge.j1), crossing(edge.i2, edge.j2)});
+            }
+        }
+    }
+}
+
+// Joins the contours of tiles into one mesh. Crossings on a side shared by two tiles are added
+// by both, finish merges them into the one of the tile added first.
+struct ContourStitcher {
+    void add(const Tile& tile, const TileContour& contour);
+
+    // Like add, but merges the crossings on shared sides right away. Only the crossings whose
+    // other tile has not been added yet are kept, so the memory follows the frontier of added
+    // tiles instead of the grid.
+    void add_matched(const Tile& tile, const TileContour& contour);
+
+    // Adds the tape and the sign changes of a tile, add does this as well
+    void add_expressions(const Tile& tile, const TileContour& contour);
+
+    ContouringResult finish();
+
+    ContouringResult result;
+    // Edge keys and mesh vertices of the crossings on shared sides
+    std::vector<std::pair<uint64_t, uint32_t>> border_vertices;
+    // Edge keys and mesh vertices of the crossings add_matched has not matched yet
+    std::unordered_map<uint64_t, uint32_t> pending_vertices;
+    // Mesh vertex of every vertex of the tile being added
+    std::vector<uint32_t> tile_vertices;
+    std::unordered_map<uint32_t, int> expression_index_of_tape;
+};
+
+void ContourStitcher::add(const Tile& tile, const TileContour& contour) {
+    const uint32_t first = result.mesh.vertices.size();
+    result.mesh.vertices.insert(result.mesh.vertices.end(), contour.vertices.begin(), contour.vertices.end());
+    result.normals.insert(result.normals.end(), contour.normals.begin(), contour.normals.end());
+    for (auto [key, id] : contour.border) border_vertices.push_back({key, first + id});
+    for (auto [a, b] : contour.segments) result.mesh.edges.push_back({first + a, first + b});
+    add_expressions(tile, contour);
+}
+
+void ContourStitcher::add_matched(const Tile& tile, const TileContour& contour) {
+    constexpr uint32_t unmatched = UINT32_MAX;
+    tile_vertices.assign(contour.vertices.size(), unmatched);
+    for (auto [key, id] : contour.border) {
+        auto it = pending_vertices.find(key);
+        if (it == pending_vertices.end()) continue;
+        tile_vertices[id] = it->second;
+        pending_vertices.erase(it);
+    }
+    const uint32_t first = result.mesh.vertices.size();
+    for (size_t i = 0; i < contour.vertices.size(); ++i) {
+        if (tile_vertices[i] != unmatched) continue;
+        tile_vertices[i] = result.mesh.vertices.size();
+        result.mesh.vertices.push_back(contour.vertices[i]);
+        result.normals.push_back(contour.normals[i]);
+    }
+    // Crossings that found no partner wait for the tile on the other side
+    for (auto [key, id] : contour.border) {
+        if (tile_vertices[id] >= first) pending_vertices.emplace(key, tile_vertices[id]);
+    }
+    for (auto [a, b] : contour.segments) result.mesh.edges.push_back({tile_vertices[a], tile_vertices[b]});
+    add_expressions(tile, contour);
+}
+
+void ContourStitcher::add_expressions(const Tile& tile, const TileContour& contour) {
+    // Tiles with the same tape share one entry of the expression list
+    auto [it, inserted] = expression_index_of_tape.try_emplace(tile.tape->id, static_cast<int>(result.expressions_list.size()));
+    if (inserted) result.expressions_list.push_back(tile.tape);
+    for (auto [point, value] : contour.sign_changes) {
+        // Store the SDF value and the expression index for the global grid point
+        result.sign_change_data[point] = {value, it->second};
+    }
+}
+
+ContouringResult ContourStitcher::finish() {
+    // Sorting brings the two crossings of every shared edge next to each other, the vertices
+    // are in the order they were added to break the tie
+    std::sort(border_vertices.begin(), border_vertices.end());
+    std::vector<uint32_t> remap(result.mesh.vertices.size());
+    for (size_t i = 0; i < remap.size(); ++i) remap[i] = i;
+    for (size_t i = 1; i < border_vertices.size(); ++i) {
+        if (border_vertices[i].first == border_vertices[i - 1].first) remap[border_vertices[i].second] = remap[border_vertices[i - 1].second];
+    }
+    border_vertices.clear();
+    pending_vertices.clear();
+
+    // Compact the vertices, merged ones always map to an earlier vertex
+    uint32_t count = 0;
+    for (size_t i = 0; i < remap.size(); ++i) {
+        if (remap[i] == i) {
+            result.mesh.vertices[count] = result.mesh.vertices[i];
+            result.normals[count] = result.normals[i];
+            remap[i] = count++;
+        } else {
+            remap[i] = remap[remap[i]];
+        }
+    }
+    result.mesh.vertices.resize(count);
+    result.normals.resize(count);
+    for (auto& [a, b] : result.mesh.edges) {
+        a = remap[a];
+        b = remap[b];
+    }
+    return std::move(result);
+}
+
+// Joins the contours of the tiles into one mesh in tile order. Every tile is copied to the
+// range of the mesh given by the crossings and segments of the tiles before it, so the copies
+// can run in parallel and the mesh does not depend on the number of threads.
+static ContouringResult assemble_contours(const std::deque<Tile>& tiles, const std::vector<TileContour>& contours, bool parallel) {
+    assert(tiles.size() == contours.size());
+    const int num_tiles = tiles.size();
+    std::vector<uint32_t> first_vertex(num_tiles + 1, 0);
+    std::vector<size_t> first_edge(num_tiles + 1, 0);
+    std::vector<size_t> first_border(num_tiles + 1, 0);
+    for (int i = 0; i < num_tiles; ++i) {
+        first_vertex[i + 1] = first_vertex[i] + contours[i].vertices.size();
+        first_edge[i + 1] = first_edge[i] + contours[i].segments.size();
+        first_border[i + 1] = first_border[i] + contours[i].border.size();
+    }
+
+    ContourStitcher stitcher;
+    ContouringResult& result = stitcher.result;
+    result.mesh.vertices.resize(first_vertex[num_tiles]);
+    result.normals.resize(first_vertex[num_tiles]);
+    result.mesh.edges.resize(first_edge[num_tiles]);
+    stitcher.border_vertices.resize(first_border[num_tiles]);
+
+    #pragma omp parallel for schedule(static) num_threads(parallel ? omp_get_max_threads() : 1)
+    for (int i = 0; i < num_tiles; ++i) {
+        const TileContour& contour = contours[i];
+        const uint32_t first = first_vertex[i];
+        std::copy(contour.vertices.begin(), contour.vertices.end(), result.mesh.vertices.begin() + first);
+        std::copy(contour.normals.begin(), contour.normals.end(), result.normals.begin() + first);
+        for (size_t k = 0; k < contour.segments.size(); ++k) {
+            result.mesh.edges[first_edge[i] + k] = {first + contour.segments[k].first, first + contour.segments[k].second};
+        }
+        for (size_t k = 0; k < contour.border.size(); ++k) {
+            stitcher.border_vertices[first_border[i] + k] = {contour.border[k].first, first + contour.border[k].second};
+        }
+    }
+
+    // The expression list and the sign changes are keyed by tape and grid point, so the later
+    // tiles win and they are filled serially
+    for (int i = 0; i < num_tiles; ++i) stitcher.add_expressions(tiles[i], contours[i]);
+    return stitcher.finish();
+}
+
+// Contours the tiles, in parallel unless disabled
+static void contour_tiles(VM& vm, const std::deque<Tile>& tiles, std::vector<TileContour>& contours, const ContouringOptions& options) {
+    const int num_tiles = tiles.size();
+    contours.resize(num_tiles);
+    #pragma omp parallel for schedule(dynamic) num_threads(options.parallel ? omp_get_max_threads() : 1)
+    for (int i = 0; i < num_tiles; ++i) {
+        contour_tile(vm, tiles[i], options, contours[i]);
+    }
+}
+
+static void apply_options(VM& vm, const ContouringOptions& options) {
+    vm.jit = options.jit;
+    vm.parallel = options.parallel;
+    vm.adaptive_tiles = options.adaptive_tiles;
+    vm.lod_tolerance = options.lod_tolerance;
+    vm.set_domain(options.window);
+}
+
+std::pair<int, int> grid_cells(int resolution, const Bounds& window) {
+    const float width = window.x_max - window.x_min;
+    const float height = window.y_max - window.y_min;
+    assert(resolution >= 2 && width > 0.0f && height > 0.0f);
+    const int cells = resolution - 1;
+    if (width >= height) return {cells, std::max(1, static_cast<int>(std::lround(cells * height / width)))};
+    return {std::max(1, static_cast<int>(std::lround(cells * width / height))), cells};
+}
+
 // Convert an implicit SDF to a mesh using marching squares
-ContouringResult implicit_to_mesh(Scalar implicit, int resolution) {
+ContouringResult implicit_to_mesh(Scalar implicit, int resolution, const ContouringOptions& options) {
     VM vm(implicit);
+    apply_options(vm, options);
+    auto [cells_x, cells_y] = grid_cells(resolution, options.window);
     std::deque<Tile> tiles;
-    vm.evaluate(tiles, {0, 0, resolution - 1, resolution - 1});
-
-    // Collect sign-change data and unique expressions
-    std::unordered_map<int, std::pair<float, int>> local_sign_change_data; // Maps grid point index to {SDF value, expression_index}
-    std::vector<std::vector<Instruction>> mesh_expressions_list;           // Stores expression vectors (std::vector<Instruction>) from each tile
-
-    const float cell_size = 2.0f / (resolution - 1);
-    std::vector<std::pair<float, float>> intersections;
-    std::unordered_map<std::pair<uint32_t, uint32_t>, uint32_t, Hasher> edge_to_intersection;
-
-    // First pass: compute intersections
-    for (const Tile& tile : tiles) {
-        const Subgrid& subgrid = tile.subgrid;
-        int start_x = subgrid.px;
-        int start_y = subgrid.py;
-        int nx = subgrid.nx;
-        int ny = subgrid.ny;
-        for (int local_y = 0; local_y <= ny; ++local_y) {
-            for (int local_x = 0; local_x <= nx; ++local_x) {
-                int x = start_x + local_x;
-                int y = start_y + local_y;
-                int i00 = y * resolution + x;
-                int i01 = y * resolution + (x + 1);
-                int i10 = (y + 1) * resolution + x;
-                float v00 = tile.values[local_y * (nx + 1) + local_x];
-                int s00 = get_sign(v00);
-                // Check right edge
-                if (local_x < nx) {
-                    float v01 = tile.values[local_y * (nx + 1) + (local_x + 1)];
-                    if (s00 * get_sign(v01) < 0) {
-                        float t = interpolate(v00, v01);
-                        assert(t >= 0.0f && t <= 1.0f);
-                        float world_x = -1.0f + (x + t) * cell_size;
-                        float world_y = -1.0f + y * cell_size;
-                        uint32_t id = intersections.size();
-                        intersections.push_back({world_x, world_y});
-                        edge_to_intersection[{i00, i01}] = id;
-                    }
-                }
-                // Check bottom edge
-                if (local_y < ny) {
-                    float v10 = tile.values[(local_y + 1) * (nx + 1) + local_x];
-                    if (s00 * get_sign(v10) < 0) {
-                        float t = interpolate(v00, v10);
-                        assert(t >= 0.0f && t <= 1.0f);
-                        float world_x = -1.0f + x * cell_size;
-                        float world_y = -1.0f + (y + t) * cell_size;
-                        uint32_t id = intersections.size();
-                        intersections.push_back({world_x, world_y});
-                        edge_to_intersection[{i00, i10}] = id;
-                    }
-                }
+    vm.evaluate(tiles, {0, 0, cells_x, cells_y});
+
+    std::vector<TileContour> contours;
+    contour_tiles(vm, tiles, contours, options);
+    return assemble_contours(tiles, contours, options.parallel);
+}
+
+ContouringResult implicit_to_mesh_streaming(Scalar implicit, int resolution, const ContouringOptions& options) {
+    VM vm(implicit);
+    apply_options(vm, options);
+    auto [cells_x, cells_y] = grid_cells(resolution, options.window);
+    ContourStitcher stitcher;
+    std::mutex mutex;
+    vm.evaluate({0, 0, cells_x, cells_y}, [&](const Tile& tile) {
+        // The crossings are refined on the thread that solved the tile, only stitching is serial
+        TileContour contour;
+        contour_tile(vm, tile, options, contour);
+        std::lock_guard<std::mutex> lock(mutex);
+        stitcher.add_matched(tile, contour);
+    });
+    return stitcher.finish();
+}
+
+ContouringResult implicit_to_mesh_tiled(Scalar implicit, int resolution, int window_cells, const ContouringOptions& options) {
+    assert(window_cells > 0);
+    VM vm(implicit);
+    apply_options(vm, options);
+    auto [cells_x, cells_y] = grid_cells(resolution, options.window);
+    ContourStitcher stitcher;
+    std::deque<Tile> tiles;
+    std::vector<TileContour> contours;
+    for (int py = 0; py < cells_y; py += window_cells) {
+        for (int px = 0; px < cells_x; px += window_cells) {
+            const Subgrid window{px, py, std::min(window_cells, cells_x - px), std::min(window_cells, cells_y - py)};
+            vm.evaluate_window(tiles, window, cells_x, cells_y);
+            contour_tiles(vm, tiles, contours, options);
+            for (size_t i = 0; i < tiles.size(); ++i) stitcher.add(tiles[i], contours[i]);
+            tiles.clear();
+            contours.clear();
+        }
+    }
+    return stitcher.finish();
+}
+
+// Point minimizing the squared distances to the lines through the crossings along their normals.
+// Directions in which the lines barely constrain the point, e.g. along a flat contour, keep the
+// mean of the crossings, and the point is clamped to its cell.
+static std::pair<float, float> minimize_qef(std::span<const std::pair<float, float>> points, std::span<const std::pair<float, float>> normals,
+                                            float x_min, float y_min, float x_max, float y_max) {
+    float cx = 0.0f, cy = 0.0f;
+    for (auto [x, y] : points) {
+        cx += x;
+        cy += y;
+    }
+    cx /= points.size();
+    cy /= points.size();
+
+    // Normal equations A x = b around the mean
+    float a00 = 0.0f, a01 = 0.0f, a11 = 0.0f, b0 = 0.0f, b1 = 0.0f;
+    for (size_t i = 0; i < points.size(); ++i) {
+        auto [nx, ny] = normals[i];
+        const float d = nx * (points[i].first - cx) + ny * (points[i].second - cy);
+        a00 += nx * nx;
+        a01 += nx * ny;
+        a11 += ny * ny;
+        b0 += nx * d;
+        b1 += ny * d;
+    }
+
+    // Pseudo-inverse of the symmetric 2x2 matrix, dropping eigenvalues below a tenth of the largest
+    const float mean = 0.5f * (a00 + a11);
+    const float radius = std::hypot(0.5f * (a00 - a11), a01);
+    const float eigenvalues[2] = {mean + radius, mean - radius};
+    float vx = a01, vy = eigenvalues[0] - a00;
+    if (std::abs(vx) + std::abs(vy) < 1e-12f) {
+        vx = a00 >= a11 ? 1.0f : 0.0f;
+        vy = a00 >= a11 ? 0.0f : 1.0f;
+    }
+    const float length = std::hypot(vx, vy);
+    vx /= length;
+    vy /= length;
+    const float eigenvectors[2][2] = {{vx, vy}, {-vy, vx}};
+    float x = cx, y = cy;
+    for (int k = 0; k < 2; ++k) {
+        if (!(eigenvalues[k] > 0.1f * eigenvalues[0])) continue;
+        const float projection = (eigenvectors[k][0] * b0 + eigenvectors[k][1] * b1) / eigenvalues[k];
+        x += projection * eigenvectors[k][0];
+        y += projection * eigenvectors[k][1];
+    }
+    return {std::clamp(x, x_min, x_max), std::clamp(y, y_min, y_max)};
+}
+
+// Dual contour of a tile. Every piece of the contour marching squares puts in a cell becomes a
+// vertex placed by minimize_qef with the crossings and normals of its two edges, and every grid
+// edge with a crossing connects the vertices on both sides of it. Where the grid ends the
+// crossing itself is the vertex on the outer side.
+struct DualTileContour : TileContour {
+    // Grid edges on shared sides of the tile, as their key, the vertex of the cell in this tile,
+    // and whether the segment over the edge starts at it
+    std::vector<std::tuple<uint64_t, uint32_t, bool>> sides;
+};
+
+static void contour_dual_tile(VM& vm, const Tile& tile, const ContouringOptions& options, DualTileContour& contour) {
+    assert(tile.stride == 1);
+    const float x_step = (vm.domain_x_max - vm.domain_x_min) / vm.grid_nx;
+    const float y_step = (vm.domain_y_max - vm.domain_y_min) / vm.grid_ny;
+    const int row = vm.grid_nx + 1;
+    const Subgrid& subgrid = tile.subgrid;
+    const int nx = subgrid.nx;
+    const int ny = subgrid.ny;
+
+    // Crossings of all edges of the tile, indexed like in contour_tile, and the direction along
+    // the edge in which the SDF increases
+    std::vector<EdgeCrossing> tile_crossings;
+    std::vector<float> ascent;
+    std::array<uint32_t, 2 * MAX_TILE_SIZE> crossing_of_edge;
+    for (int local_y = 0; local_y <= ny; ++local_y) {
+        for (int local_x = 0; local_x <= nx; ++local_x) {
+            const int p = local_y * (nx + 1) + local_x;
+            const float x = vm.domain_x_min + (subgrid.px + local_x) * x_step;
+            const float y = vm.domain_y_min + (subgrid.py + local_y) * y_step;
+            const float v00 = tile.values[p];
+            if (local_x < nx && get_sign(v00) != get_sign(tile.values[p + 1])) {
+                crossing_of_edge[2 * p] = tile_crossings.size();
+                tile_crossings.push_back({static_cast<uint32_t>(tile_crossings.size()), x, y, x_step, 0.0f, interpolate(v00, tile.values[p + 1])});
+                ascent.push_back(v00 < 0 ? 1.0f : -1.0f);
+            }
+            if (local_y < ny && get_sign(v00) != get_sign(tile.values[p + nx + 1])) {
+                crossing_of_edge[2 * p + 1] = tile_crossings.size();
+                tile_crossings.push_back({static_cast<uint32_t>(tile_crossings.size()), x, y, 0.0f, y_step, interpolate(v00, tile.values[p + nx + 1])});
+                ascent.push_back(v00 < 0 ? 1.0f : -1.0f);
             }
         }
     }
+    std::vector<std::pair<float, float>> points(tile_crossings.size());
+    std::vector<std::pair<float, float>> normals(tile_crossings.size());
+    refine_crossings(vm, tile.tape->registers, tile_crossings, options.newton_steps, points, normals);
 
-    // Second pass: connect intersections into edges
-    Mesh mesh;
-    mesh.vertices = intersections;
-
-    for (const Tile& tile : tiles) {
-        // Add the tile's expression to the list and get its index.
-        // Assumes Tile struct has 'instructions' (std::vector<Instruction>).
-        mesh_expressions_list.push_back(tile.instructions);
-        int current_expression_index = mesh_expressions_list.size() - 1;
-
-        const Subgrid& subgrid = tile.subgrid;
-        int start_x = subgrid.px;
-        int start_y = subgrid.py;
-        int nx = subgrid.nx;
-        int ny = subgrid.ny;
-        for (int local_y = 0; local_y < ny; ++local_y) {
-            for (int local_x = 0; local_x < nx; ++local_x) {
-                int x = start_x + local_x;
-                int y = start_y + local_y;
-                int i00 = y * resolution + x;
-                int i01 = y * resolution + (x + 1);
-                int i10 = (y + 1) * resolution + x;
-                int i11 = (y + 1) * resolution + (x + 1);
-                int cell[4] = {i00, i01, i10, i11};
-                float vs[4] = {
-                    tile.values[local_y * (nx + 1) + local_x],
-                    tile.values[local_y * (nx + 1) + (local_x + 1)],
-                    tile.values[(local_y + 1) * (nx + 1) + local_x],
-                    tile.values[(local_y + 1) * (nx + 1) + (local_x + 1)]
-                };
-                int config = 0;
-                if (vs[0] < 0) config |= 1;
-                if (vs[1] < 0) config |= 2;
-                if (vs[2] < 0) config |= 4;
-                if (vs[3] < 0) config |= 8;
-                if (config == 0 || config == 15) continue;
-                
-                int grid_point_global_indices[4] = {i00, i01, i10, i11};
-
-                for (int k_vert = 0; k_vert < 4; ++k_vert) {
-                    // Store the SDF value (vs[k_vert]) and the expression index for the global grid point.
-                    // The expression_index is common for all points processed from the current tile.
-                    local_sign_change_data[grid_point_global_indices[k_vert]] = {vs[k_vert], current_expression_index};
+    // Exactly on the level set the gradient can vanish, e.g. on the sides of a rectangle where
+    // the distance outside is the square root of zero. It is taken a hundredth of the edge
+    // towards the positive side instead.
+    std::vector<uint32_t> flat;
+    for (const EdgeCrossing& c : tile_crossings) {
+        if (normals[c.id] == std::make_pair(0.0f, 0.0f)) flat.push_back(c.id);
+    }
+    std::array<float, MAX_TILE_SIZE> xs;
+    std::array<float, MAX_TILE_SIZE> ys;
+    for (size_t begin = 0; begin < flat.size(); begin += MAX_TILE_SIZE) {
+        const size_t count = std::min(flat.size() - begin, static_cast<size_t>(MAX_TILE_SIZE));
+        for (size_t k = 0; k < count; ++k) {
+            const EdgeCrossing& c = tile_crossings[flat[begin + k]];
+            xs[k] = points[c.id].first + 0.01f * ascent[c.id] * c.ex;
+            ys[k] = points[c.id].second + 0.01f * ascent[c.id] * c.ey;
+        }
+        BatchGradient g = vm.evaluate_batch_gradient(tile.tape->registers, {xs.data(), count}, {ys.data(), count});
+        for (size_t k = 0; k < count; ++k) {
+            const float length = std::hypot(g.dx[k], g.dy[k]);
+            if (length > 0.0f) normals[flat[begin + k]] = {g.dx[k] / length, g.dy[k] / length};
+        }
+    }
+
+    // Vertex of the cell below or left of every local edge and of the cell above or right of it
+    std::array<uint32_t, 2 * MAX_TILE_SIZE> lower_vertex;
+    std::array<uint32_t, 2 * MAX_TILE_SIZE> upper_vertex;
+    for (int local_y = 0; local_y < ny; ++local_y) {
+        for (int local_x = 0; local_x < nx; ++local_x) {
+            const int p = local_y * (nx + 1) + local_x;
+            const int local_cell[4] = {p, p + 1, p + nx + 1, p + nx + 2};
+            int config = 0;
+            for (int k = 0; k < 4; ++k) {
+                if (tile.values[local_cell[k]] < 0) config |= 1 << k;
+            }
+            if (config == 0 || config == 15) continue;
+
+            const int i00 = (subgrid.py + local_y) * row + subgrid.px + local_x;
+            const int cell[4] = {i00, i00 + 1, i00 + row, i00 + row + 1};
+            for (int k = 0; k < 4; ++k) contour.sign_changes.push_back({cell[k], tile.values[local_cell[k]]});
+
+            const float x0 = vm.domain_x_min + (subgrid.px + local_x) * x_step;
+            const float y0 = vm.domain_y_min + (subgrid.py + local_y) * y_step;
+            // The cell is above the edges on its lower side, right of the ones on its left side,
+            // and below or left of the others
+            auto edge = [&](int i, int j) { return 2 * local_cell[i] + (j - i == 2); };
+            auto vertex_slot = [&](int i, int j) -> uint32_t& { return i == 0 ? upper_vertex[edge(i, j)] : lower_vertex[edge(i, j)]; };
+            for (const EdgeIndices& piece : marching_squares_table[config]) {
+                if (piece.i1 == -1) continue;
+                const uint32_t a = crossing_of_edge[edge(piece.i1, piece.j1)];
+                const uint32_t b = crossing_of_edge[edge(piece.i2, piece.j2)];
+                const std::pair<float, float> piece_points[2] = {points[a], points[b]};
+                const std::pair<float, float> piece_normals[2] = {normals[a], normals[b]};
+                const uint32_t id = contour.vertices.size();
+                contour.vertices.push_back(minimize_qef(piece_points, piece_normals, x0, y0, x0 + x_step, y0 + y_step));
+                // The gradient is not defined at a sharp corner, the vertex gets the mean normal
+                const float sx = normals[a].first + normals[b].first;
+                const float sy = normals[a].second + normals[b].second;
+                const float length = std::hypot(sx, sy);
+                contour.normals.push_back(length > 0.0f ? std::make_pair(sx / length, sy / length) : normals[a]);
+                vertex_slot(piece.i1, piece.j1) = id;
+                vertex_slot(piece.i2, piece.j2) = id;
+            }
+        }
+    }
+
+    // The contour keeps the negative side on its right like the one of marching squares: over
+    // an edge along x from the lower to the upper cell if its right end is negative, over an
+    // edge along y from the left to the right cell if its lower end is negative
+    auto connect = [&](int p, int axis, int local_x, int local_y) {
+        const int e = 2 * p + axis;
+        const uint32_t crossing = crossing_of_edge[e];
+        const bool lower_first = tile.values[axis == 0 ? p + 1 : p] < 0;
+        const bool has_lower = axis == 0 ? local_y > 0 : local_x > 0;
+        const bool has_upper = axis == 0 ? local_y < ny : local_x < nx;
+        if (has_lower && has_upper) {
+            contour.segments.push_back(lower_first ? std::make_pair(lower_vertex[e], upper_vertex[e]) : std::make_pair(upper_vertex[e], lower_vertex[e]));
+            return;
+        }
+        const uint32_t inner = has_lower ? lower_vertex[e] : upper_vertex[e];
+        const int gx = subgrid.px + local_x;
+        const int gy = subgrid.py + local_y;
+        const bool grid_border = axis == 0 ? (gy == 0 || gy == vm.grid_ny) : (gx == 0 || gx == vm.grid_nx);
+        if (grid_border) {
+            const uint32_t outer = contour.vertices.size();
+            contour.vertices.push_back(points[crossing]);
+            contour.normals.push_back(normals[crossing]);
+            contour.segments.push_back(lower_first == has_lower ? std::make_pair(inner, outer) : std::make_pair(outer, inner));
+        } else {
+            contour.sides.push_back({2 * (static_cast<uint64_t>(gy) * row + gx) + axis, inner, lower_first == has_lower});
+        }
+    };
+    for (int local_y = 0; local_y <= ny; ++local_y) {
+        for (int local_x = 0; local_x <= nx; ++local_x) {
+            const int p = local_y * (nx + 1) + local_x;
+            if (local_x < nx && get_sign(tile.values[p]) != get_sign(tile.values[p + 1])) connect(p, 0, local_x, local_y);
+            if (local_y < ny && get_sign(tile.values[p]) != get_sign(tile.values[p + nx + 1])) connect(p, 1, local_x, local_y);
+        }
+    }
+}
+
+ContouringResult implicit_to_mesh_dual(Scalar implicit, int resolution, const ContouringOptions& options) {
+    VM vm(implicit);
+    apply_options(vm, options);
+    vm.lod_tolerance = 0.0f;
+    auto [cells_x, cells_y] = grid_cells(resolution, options.window);
+    std::deque<Tile> tiles;
+    vm.evaluate(tiles, {0, 0, cells_x, cells_y});
+
+    const int num_tiles = tiles.size();
+    std::vector<DualTileContour> contours(num_tiles);
+    #pragma omp parallel for schedule(dynamic) num_threads(options.parallel ? omp_get_max_threads() : 1)
+    for (int i = 0; i < num_tiles; ++i) {
+        contour_dual_tile(vm, tiles[i], options, contours[i]);
+    }
+
+    // The two tiles of a shared edge both add it, sorting brings them next to each other
+    ContourStitcher stitcher;
+    std::vector<std::tuple<uint64_t, uint32_t, bool>> sides;
+    for (int i = 0; i < num_tiles; ++i) {
+        const uint32_t first = stitcher.result.mesh.vertices.size();
+        stitcher.add(tiles[i], contours[i]);
+        for (auto [key, vertex, starts] : contours[i].sides) sides.push_back({key, first + vertex, starts});
+    }
+    std::sort(sides.begin(), sides.end());
+    for (size_t i = 0; i + 1 < sides.size(); ++i) {
+        auto [key, vertex, starts] = sides[i];
+        auto [next_key, next_vertex, next_starts] = sides[i + 1];
+        if (key != next_key) continue;
+        stitcher.result.mesh.edges.push_back(starts ? std::make_pair(vertex, next_vertex) : std::make_pair(next_vertex, vertex));
+        ++i;
+    }
+    return stitcher.finish();
+}
+
+// Boolean expression of polygons with the same inside as the pruned tape of a tile
+struct PolygonExpression {
+    // A leaf refers to the polygon of a shape, the other nodes are the union (Min), the
+    // intersection (Max) or the complement (Neg) of earlier nodes. The root is the last node.
+    struct Node {
+        OpCode op;
+        int input0, input1;
+        int polygon;
+    };
+    std::vector<Node> nodes;
+    std::vector<std::vector<std::pair<float, float>>> polygons;
+
+    // Whether the point is inside, with polygon `forced` taken as containing it or not. `values`
+    // is scratch for the values of the nodes, reused between calls.
+    bool inside(float x, float y, int forced, bool forced_inside, std::vector<char>& values) const;
+};
+
+static bool point_in_polygon(const std::vector<std::pair<float, float>>& polygon, float x, float y) {
+    bool inside = false;
+    for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+        auto [xi, yi] = polygon[i];
+        auto [xj, yj] = polygon[j];
+        if ((yi > y) != (yj > y) && x < (xj - xi) * (y - yi) / (yj - yi) + xi) inside = !inside;
+    }
+    return inside;
+}
+
+bool PolygonExpression::inside(float x, float y, int forced, bool forced_inside, std::vector<char>& values) const {
+    values.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const Node& node = nodes[i];
+        if (node.polygon >= 0) {
+            values[i] = node.polygon == forced ? forced_inside : point_in_polygon(polygons[node.polygon], x, y);
+        } else if (node.op == OpCode::Min) {
+            values[i] = values[node.input0] || values[node.input1];
+        } else if (node.op == OpCode::Max) {
+            values[i] = values[node.input0] && values[node.input1];
+        } else {
+            values[i] = !values[node.input0];
+        }
+    }
+    return values.back();
+}
+
+// Builds the expression of a tape that only combines polygonal shapes with Min, Max and Neg.
+// Returns false for any other tape, e.g. one with a smooth union or a curved shape.
+static bool polygon_expression(const Tape& tape, PolygonExpression& expression) {
+    const std::vector<Instruction>& instructions = tape.instructions;
+    if (instructions.empty()) return false;
+    // Instructions the root depends on, walking down from it. The instruction of a shape stands
+    // for the whole shape, whatever it was pruned to, so the ones below it are not needed.
+    std::vector<char> needed(instructions.size(), 0);
+    needed.back() = 1;
+    for (size_t i = instructions.size(); i-- > 0;) {
+        const Instruction& inst = instructions[i];
+        if (!needed[i] || inst.shape) continue;
+        if (inst.op == OpCode::Min || inst.op == OpCode::Max) {
+            needed[inst.input0] = needed[inst.input1] = 1;
+        } else if (inst.op == OpCode::Neg) {
+            needed[inst.input0] = 1;
+        } else {
+            return false;
+        }
+    }
+
+    // Inputs come before the instructions using them, so the nodes do as well
+    std::vector<int> node_of(instructions.size(), -1);
+    std::unordered_map<const IShape*, int> polygon_of;
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        if (!needed[i]) continue;
+        const Instruction& inst = instructions[i];
+        PolygonExpression::Node node{inst.op, -1, -1, -1};
+        if (inst.shape) {
+            auto [it, inserted] = polygon_of.try_emplace(inst.shape, static_cast<int>(expression.polygons.size()));
+            if (inserted) {
+                expression.polygons.emplace_back();
+                if (!inst.shape->get_polygon(expression.polygons.back()) || expression.polygons.back().size() < 3) return false;
+            }
+            node.polygon = it->second;
+        } else {
+            node.input0 = node_of[inst.input0];
+            if (inst.op != OpCode::Neg) node.input1 = node_of[inst.input1];
+        }
+        node_of[i] = expression.nodes.size();
+        expression.nodes.push_back(node);
+    }
+    return true;
+}
+
+// Contours a tile of polygons exactly: every polygon edge is clipped to the tile and split
+// where it crosses the edges of the other polygons, and the pieces on the boundary of the
+// expression are kept. The vertices on the sides of the tile are keyed by the grid edge or grid
+// point they lie on, so they are merged with the ones of neighbouring tiles like the crossings
+// of marching squares.
+static void contour_explicit_tile(VM& vm, const Tile& tile, const PolygonExpression& expression, TileContour& contour) {
+    using Point = std::pair<float, float>;
+    const float x_step = (vm.domain_x_max - vm.domain_x_min) / vm.grid_nx;
+    const float y_step = (vm.domain_y_max - vm.domain_y_min) / vm.grid_ny;
+    const int row = vm.grid_nx + 1;
+    const Subgrid& subgrid = tile.subgrid;
+    const float x_min = vm.domain_x_min + subgrid.px * x_step;
+    const float x_max = vm.domain_x_min + (subgrid.px + subgrid.nx) * x_step;
+    const float y_min = vm.domain_y_min + subgrid.py * y_step;
+    const float y_max = vm.domain_y_min + (subgrid.py + subgrid.ny) * y_step;
+
+    // Vertices are welded by their exact coordinates, the crossing of two edges is computed the
+    // same way for both of them
+    std::map<Point, uint32_t> vertex_of;
+    auto vertex = [&](Point p) {
+        auto [it, inserted] = vertex_of.try_emplace(p, static_cast<uint32_t>(contour.vertices.size()));
+        if (inserted) {
+            contour.vertices.push_back(p);
+            contour.normals.push_back({0.0f, 0.0f});
+        }
+        return it->second;
+    };
+    // Keys of a vertex on a side of the tile. They only depend on the point, so the tiles on
+    // both sides agree whichever side or corner of theirs it lies on. A point on a vertical and
+    // a horizontal grid line is keyed by the grid point, after the keys of the grid edges.
+    auto add_border = [&](uint32_t id, Point p) {
+        if (p.first != x_min && p.first != x_max && p.second != y_min && p.second != y_max) return;
+        const float u = (p.first - vm.domain_x_min) / x_step;
+        const float v = (p.second - vm.domain_y_min) / y_step;
+        const int line_x = static_cast<int>(std::lround(u));
+        const int line_y = static_cast<int>(std::lround(v));
+        const bool on_line_x = p.first == vm.domain_x_min + line_x * x_step;
+        const bool on_line_y = p.second == vm.domain_y_min + line_y * y_step;
+        if (on_line_x && on_line_y) {
+            contour.border.push_back({2 * static_cast<uint64_t>(row) * (vm.grid_ny + 1) + static_cast<uint64_t>(line_y) * row + line_x, id});
+        } else if (on_line_y) {
+            if (line_y == 0 || line_y == vm.grid_ny) return;
+            const int gx = static_cast<int>(std::floor(u));
+            contour.border.push_back({2 * (static_cast<uint64_t>(line_y) * row + gx), id});
+        } else if (on_line_x) {
+            if (line_x == 0 || line_x == vm.grid_nx) return;
+            const int gy = static_cast<int>(std::floor(v));
+            contour.border.push_back({2 * (static_cast<uint64_t>(gy) * row + line_x) + 1, id});
+        }
+    };
+
+    const auto& polygons = expression.polygons;
+    std::vector<char> values;
+    for (int i = 0; i < static_cast<int>(polygons.size()); ++i) {
+        const auto& polygon = polygons[i];
+        for (size_t k = 0; k < polygon.size(); ++k) {
+            const Point a = polygon[k];
+            const Point b = polygon[(k + 1) % polygon.size()];
+            const float dx = b.first - a.first;
+            const float dy = b.second - a.second;
+
+            // Liang-Barsky clipping to the tile, remembering the side each clipped end lies on
+            float t0 = 0.0f, t1 = 1.0f;
+            int side0 = -1, side1 = -1;
+            const float ps[4] = {-dy, dy, -dx, dx};
+            const float qs[4] = {a.second - y_min, y_max - a.second, a.first - x_min, x_max - a.first};
+            bool outside = false;
+            for (int side = 0; side < 4 && !outside; ++side) {
+                if (ps[side] == 0.0f) {
+                    // Tiles are half open, an edge along a side belongs to the tile above or right of it
+                    outside = side % 2 ? qs[side] <= 0.0f : qs[side] < 0.0f;
+                    continue;
                 }
+                const float r = qs[side] / ps[side];
+                if (ps[side] < 0.0f) {
+                    if (r > t1) outside = true;
+                    else if (r > t0) { t0 = r; side0 = side; }
+                } else {
+                    if (r < t0) outside = true;
+                    else if (r < t1) { t1 = r; side1 = side; }
+                }
+            }
+            if (outside || !(t0 < t1)) continue;
+            auto clipped = [&](float t, int side) -> Point {
+                Point p{a.first + t * dx, a.second + t * dy};
+                if (side == 0) p.second = y_min;
+                if (side == 1) p.second = y_max;
+                if (side == 2) p.first = x_min;
+                if (side == 3) p.first = x_max;
+                return p;
+            };
 
-                const auto& edges = marching_squares_table[config];
-                for (const EdgeIndices& edge : edges) {
-                    if (edge.i1 == -1) continue;
-                    assert(cell[edge.j1] > cell[edge.i1]);
-                    assert(cell[edge.j2] > cell[edge.i2]);
-                    auto it1 = edge_to_intersection.find({cell[edge.i1], cell[edge.j1]});
-                    auto it2 = edge_to_intersection.find({cell[edge.i2], cell[edge.j2]});
-                    assert(it1 != edge_to_intersection.end() && it2 != edge_to_intersection.end());
-                    mesh.edges.push_back({it1->second, it2->second});
+            // Points along the clipped edge, split where it crosses the edges of other polygons
+            std::vector<std::pair<float, Point>> points;
+            points.push_back({t0, side0 < 0 ? a : clipped(t0, side0)});
+            points.push_back({t1, side1 < 0 ? b : clipped(t1, side1)});
+            for (int j = 0; j < static_cast<int>(polygons.size()); ++j) {
+                if (j == i) continue;
+                for (size_t m = 0; m < polygons[j].size(); ++m) {
+                    const Point c = polygons[j][m];
+                    const Point e = polygons[j][(m + 1) % polygons[j].size()];
+                    // The edge of the polygon with the lower index is the base of the computation
+                    const bool first = i < j;
+                    const Point p0 = first ? a : c, p1 = first ? b : e;
+                    const Point q0 = first ? c : a, q1 = first ? e : b;
+                    const float ux = p1.first - p0.first, uy = p1.second - p0.second;
+                    const float vx = q1.first - q0.first, vy = q1.second - q0.second;
+                    const float denominator = ux * vy - uy * vx;
+                    if (denominator == 0.0f) continue;
+                    const float wx = q0.first - p0.first, wy = q0.second - p0.second;
+                    const float s = (wx * vy - wy * vx) / denominator;
+                    const float u = (wx * uy - wy * ux) / denominator;
+                    if (s < 0.0f || s > 1.0f || u < 0.0f || u > 1.0f) continue;
+                    const float t = first ? s : u;
+                    if (t <= t0 || t >= t1) continue;
+                    points.push_back({t, {p0.first + s * ux, p0.second + s * uy}});
                 }
             }
+            std::sort(points.begin(), points.end());
+
+            // A piece is on the boundary if the inside changes with the polygon, the inside of
+            // the polygon is left of its edges and the contour keeps the inside on its right
+            for (size_t n = 0; n + 1 < points.size(); ++n) {
+                const Point p = points[n].second;
+                const Point q = points[n + 1].second;
+                if (p == q) continue;
+                const float mx = 0.5f * (p.first + q.first);
+                const float my = 0.5f * (p.second + q.second);
+                const bool with = expression.inside(mx, my, i, true, values);
+                if (with == expression.inside(mx, my, i, false, values)) continue;
+                const uint32_t vp = vertex(p);
+                const uint32_t vq = vertex(q);
+                contour.segments.push_back(with ? std::make_pair(vq, vp) : std::make_pair(vp, vq));
+            }
         }
     }
+    for (uint32_t id = 0; id < contour.vertices.size(); ++id) add_border(id, contour.vertices[id]);
 
-    // Create ContouringResult with mesh and additional data
-    ContouringResult result;
-    result.mesh = mesh;
-    result.sign_change_data = std::move(local_sign_change_data);
-    result.expressions_list = std::move(mesh_expressions_list);
-    return result;
-} 
\ No newline at end of file
+    // The normal of a vertex is the mean of the outward normals of its segments
+    for (auto [a, b] : contour.segments) {
+        const float dx = contour.vertices[b].first - contour.vertices[a].first;
+        const float dy = contour.vertices[b].second - contour.vertices[a].second;
+        const float length = std::hypot(dx, dy);
+        for (uint32_t v : {a, b}) {
+            contour.normals[v].first -= dy / length;
+            contour.normals[v].second += dx / length;
+        }
+    }
+    for (auto& [nx, ny] : contour.normals) {
+        const float length = std::hypot(nx, ny);
+        if (length > 0.0f) {
+            nx /= length;
+            ny /= length;
+        }
+    }
+}
+
+ContouringResult implicit_to_mesh_hybrid(Scalar implicit, int resolution, const ContouringOptions& options) {
+    VM vm(implicit);
+    apply_options(vm, options);
+    vm.lod_tolerance = 0.0f;
+    // Expressions by tape id, built once per interned tape on the thread that reaches it first.
+    // Tapes that are not explicit map to nullptr.
+    std::unordered_map<uint32_t, std::unique_ptr<PolygonExpression>> expressions;
+    std::mutex mutex;
+    vm.skip_sampling = [&](const Tape& tape) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = expressions.find(tape.id);
+            if (it != expressions.end()) return it->second != nullptr;
+        }
+        auto expression = std::make_unique<PolygonExpression>();
+        if (!polygon_expression(tape, *expression)) expression = nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        return expressions.try_emplace(tape.id, std::move(expression)).first->second != nullptr;
+    };
+    auto [cells_x, cells_y] = grid_cells(resolution, options.window);
+    std::deque<Tile> tiles;
+    vm.evaluate(tiles, {0, 0, cells_x, cells_y});
+
+    // Tiles without values are the explicit ones
+    const int num_tiles = tiles.size();
+    std::vector<TileContour> contours(num_tiles);
+    #pragma omp parallel for schedule(dynamic) num_threads(options.parallel ? omp_get_max_threads() : 1)
+    for (int i = 0; i < num_tiles; ++i) {
+        if (tiles[i].values.size() == 0) {
+            contour_explicit_tile(vm, tiles[i], *expressions.at(tiles[i].tape->id), contours[i]);
+        } else {
+            contour_tile(vm, tiles[i], options, contours[i]);
+        }
+    }
+    return assemble_contours(tiles, contours, options.parallel);
+}
+
+IncrementalContouring::IncrementalContouring(int resolution, const ContouringOptions& options)
+    : resolution(resolution), options(options) {}
+
+const ContouringResult& IncrementalContouring::rebuild(Scalar implicit) {
+    tiles.clear();
+    contours.clear();
+    // A full rebuild has no tiles worth keeping, the tapes are shared with the new ones
+    return update(implicit, nullptr, options.window);
+}
+
+const ContouringResult& IncrementalContouring::update(Scalar implicit, const IShape* shape, Bounds region) {
+    vm = std::make_unique<VM>(implicit);
+    apply_options(*vm, options);
+    vm->tapes = tapes;
+    return solve(shape, region);
+}
+
+const ContouringResult& IncrementalContouring::update(std::span<const float> parameters, const IShape* shape, Bounds region) {
+    assert(vm);
+    vm->set_parameters(parameters);
+    return solve(shape, region);
+}
+
+const ContouringResult& IncrementalContouring::solve(const IShape* shape, Bounds region) {
+
+    // Cells of the grid that have to be solved again, as a summed area table so that the
+    // regions of the quadtree can be tested in constant time
+    const Bounds& window = options.window;
+    const auto [cells_x, cells_y] = grid_cells(resolution, window);
+    const float x_step = (window.x_max - window.x_min) / cells_x;
+    const float y_step = (window.y_max - window.y_min) / cells_y;
+    std::vector<uint8_t> dirty(cells_x * cells_y, 0);
+    auto mark = [&](int x0, int y0, int x1, int y1) {
+        for (int y = std::max(y0, 0); y < std::min(y1, cells_y); ++y) {
+            for (int x = std::max(x0, 0); x < std::min(x1, cells_x); ++x) dirty[y * cells_x + x] = 1;
+        }
+    };
+    // Cells touching the region, grown by two cells. Outside of that the shape is more than a
+    // cell diagonal away, so it cannot change the values at the corners of cells with a sign change.
+    const int rx0 = static_cast<int>(std::floor((region.x_min - window.x_min) / x_step)) - 2;
+    const int ry0 = static_cast<int>(std::floor((region.y_min - window.y_min) / y_step)) - 2;
+    const int rx1 = static_cast<int>(std::ceil((region.x_max - window.x_min) / x_step)) + 2;
+    const int ry1 = static_cast<int>(std::ceil((region.y_max - window.y_min) / y_step)) + 2;
+    mark(rx0, ry0, rx1, ry1);
+
+    // Tiles inside the region or whose tape references the shape are dropped and their cells
+    // solved again. Tapes are shared, so every tape is only searched for the shape once.
+    std::unordered_map<uint32_t, bool> references_shape;
+    std::deque<Tile> kept_tiles;
+    std::vector<TileContour> kept_contours;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const Subgrid& sg = tiles[i].subgrid;
+        bool drop = sg.px < rx1 && rx0 < sg.px + sg.nx && sg.py < ry1 && ry0 < sg.py + sg.ny;
+        if (!drop && shape) {
+            const Tape& tape = *tiles[i].tape;
+            auto [it, inserted] = references_shape.try_emplace(tape.id, false);
+            if (inserted) {
+                it->second = std::any_of(tape.instructions.begin(), tape.instructions.end(), [&](const Instruction& inst) { return inst.shape == shape; });
+            }
+            drop = it->second;
+        }
+        if (drop) {
+            mark(sg.px, sg.py, sg.px + sg.nx, sg.py + sg.ny);
+        } else {
+            kept_tiles.push_back(std::move(tiles[i]));
+            kept_contours.push_back(std::move(contours[i]));
+        }
+    }
+
+    const int row = cells_x + 1;
+    std::vector<uint32_t> table(row * (cells_y + 1), 0);
+    for (int y = 0; y < cells_y; ++y) {
+        for (int x = 0; x < cells_x; ++x) {
+            table[(y + 1) * row + x + 1] = dirty[y * cells_x + x] + table[y * row + x + 1] + table[(y + 1) * row + x] - table[y * row + x];
+        }
+    }
+    auto is_dirty = [&](const Subgrid& sg) {
+        const int x0 = sg.px, y0 = sg.py, x1 = sg.px + sg.nx, y1 = sg.py + sg.ny;
+        return table[y1 * row + x1] - table[y0 * row + x1] - table[y1 * row + x0] + table[y0 * row + x0] > 0;
+    };
+
+    std::deque<Tile> new_tiles;
+    vm->evaluate(new_tiles, {0, 0, cells_x, cells_y}, is_dirty);
+    solved_tiles = new_tiles.size();
+    std::vector<TileContour> new_contours;
+    contour_tiles(*vm, new_tiles, new_contours, options);
+
+    // Leaf sizes depend on the tapes, so a new tile may cover kept tiles the last evaluation
+    // split further. Regions of the quadtree are nested or disjoint, a kept tile overlapping a
+    // new one lies inside of it.
+    std::vector<uint8_t> covered(cells_x * cells_y, 0);
+    for (const Tile& tile : new_tiles) {
+        const Subgrid& sg = tile.subgrid;
+        for (int y = sg.py; y < sg.py + sg.ny; ++y) {
+            std::fill_n(covered.begin() + y * cells_x + sg.px, sg.nx, 1);
+        }
+    }
+    size_t num_kept = 0;
+    for (size_t i = 0; i < kept_tiles.size(); ++i) {
+        const Subgrid& sg = kept_tiles[i].subgrid;
+        if (covered[sg.py * cells_x + sg.px]) continue;
+        if (num_kept != i) {
+            kept_tiles[num_kept] = std::move(kept_tiles[i]);
+            kept_contours[num_kept] = std::move(kept_contours[i]);
+        }
+        num_kept++;
+    }
+    kept_tiles.erase(kept_tiles.begin() + num_kept, kept_tiles.end());
+    kept_contours.erase(kept_contours.begin() + num_kept, kept_contours.end());
+
+    // Merge the new tiles into the kept ones in the order of a full evaluation
+    tiles.clear();
+    contours.clear();
+    auto before = [](const Subgrid& a, const Subgrid& b) { return a.py != b.py ? a.py < b.py : a.px < b.px; };
+    size_t k = 0;
+    for (size_t i = 0; i < new_tiles.size(); ++i) {
+        while (k < kept_tiles.size() && before(kept_tiles[k].subgrid, new_tiles[i].subgrid)) {
+            tiles.push_back(std::move(kept_tiles[k]));
+            contours.push_back(std::move(kept_contours[k]));
+            ++k;
+        }
+        tiles.push_back(std::move(new_tiles[i]));
+        contours.push_back(std::move(new_contours[i]));
+    }
+    for (; k < kept_tiles.size(); ++k) {
+        tiles.push_back(std::move(kept_tiles[k]));
+        contours.push_back(std::move(kept_contours[k]));
+    }
+
+    contour_result = assemble_contours(tiles, contours, options.parallel);
+    tapes->collect();
+    return contour_result;
+}
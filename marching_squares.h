@@ -3,19 +3,128 @@
 #include <vector>
 #include <cassert>
 #include <unordered_map>
+#include <memory>
+#include <deque>
 
 #include "node.h"
 #include "vm.h"
 #include "shapes.h"
 
+struct ContouringOptions {
+    // Newton steps along the grid edge applied to every crossing after linear interpolation
+    int newton_steps = 2;
+    // Compiled tapes to evaluate the tiles with, none uses the interpreter
+    std::shared_ptr<JitCache> jit;
+    // Solve the quadtree and contour the tiles on all OpenMP threads. The mesh is the same for
+    // any number of threads, except for the streaming contouring.
+    bool parallel = true;
+    // Choose the size of every leaf tile from the cost of sampling it, see VM::adaptive_tiles
+    bool adaptive_tiles = false;
+    // Largest distance of the contour from the chords of coarse tiles, zero samples every tile
+    // at every grid point, see VM::lod_tolerance
+    float lod_tolerance = 0.0f;
+    // Region of the plane the grid spans, see grid_cells
+    Bounds window = {-1.0f, -1.0f, 1.0f, 1.0f};
+};
+
 struct ContouringResult {
     Mesh mesh;
+    // Unit gradient of the SDF at every mesh vertex
+    std::vector<std::pair<float, float>> normals;
     // Sign-change vertices, their SDF values, and the index of the expression list used
     std::unordered_map<int, std::pair<float, int>> sign_change_data;
-    // List of instruction vectors (expressions) used for SDF evaluation
-    std::vector<std::vector<Instruction>> expressions_list;
+    // Distinct pruned tapes of the tiles in tile order, shared with the tiles themselves
+    std::vector<TapeRef> expressions_list;
+};
+
+// Crossings and contour segments of a single tile. Crossings are numbered in the order of
+// their grid edges within the tile.
+struct TileContour {
+    // Crossing on each of the edges and the unit gradient there
+    std::vector<std::pair<float, float>> vertices;
+    std::vector<std::pair<float, float>> normals;
+    // Crossings on sides the tile shares with other tiles, as the key of their grid edge (the
+    // index of its first grid point times two, plus one for edges along y) and crossing index
+    std::vector<std::pair<uint64_t, uint32_t>> border;
+    // Segments of the contour as pairs of crossings
+    std::vector<std::pair<uint32_t, uint32_t>> segments;
+    // Grid points of the cells with a sign change and their SDF values
+    std::vector<std::pair<int, float>> sign_changes;
 };
 
 ContouringResult create_disk_mesh(float radius, int segments);
 
-ContouringResult implicit_to_mesh(Scalar implicit, int resolution);
+// Number of cells along x and y of the grid over a window. The longer side has resolution - 1
+// cells and the shorter one as many as keep the cells closest to square. Grid points are
+// numbered row by row, e.g. the keys of sign_change_data are y * (cells along x + 1) + x.
+std::pair<int, int> grid_cells(int resolution, const Bounds& window);
+
+ContouringResult implicit_to_mesh(Scalar implicit, int resolution, const ContouringOptions& options = {});
+
+// Contours every tile as soon as the quadtree produces it instead of collecting all tiles first.
+// Crossings on a side shared by two tiles are merged as soon as the second tile arrives, so apart
+// from the result the memory grows with the frontier of solved tiles, not the grid. The
+// mesh has the same vertices and edges as the one of implicit_to_mesh, but with parallel
+// evaluation their order depends on the order the tiles are solved in.
+ContouringResult implicit_to_mesh_streaming(Scalar implicit, int resolution, const ContouringOptions& options = {});
+
+// Contours the grid in windows of at most window_cells x window_cells cells, one after another.
+// Every window is solved and contoured on its own, so only the tiles of one window are kept at
+// a time, and the crossings on the sides of neighbouring windows are merged like the ones on
+// the sides of neighbouring tiles. The windows sample the points of the whole grid, so the mesh
+// has the crossings of implicit_to_mesh, only the order of its vertices and edges differs.
+ContouringResult implicit_to_mesh_tiled(Scalar implicit, int resolution, int window_cells, const ContouringOptions& options = {});
+
+// Dual contouring: every piece of the contour in a cell is a single vertex placed where the
+// tangent lines at the crossings on its edges meet, using the gradients of the pruned tape of
+// the tile. Sharp corners such as the ones of rectangles are kept at any resolution instead of
+// being cut off by the segments between crossings. Every cell with a sign change has one or
+// two vertices, and the pieces in neighbouring cells are connected across their shared edge.
+// The level of detail tolerance is ignored.
+ContouringResult implicit_to_mesh_dual(Scalar implicit, int resolution, const ContouringOptions& options = {});
+
+// Hybrid contouring: leaf tiles whose pruned tape only combines polygonal shapes (see
+// IShape::get_polygon) with Min, Max and Neg are not sampled. Their contour is cut exactly from
+// the polygons, clipped to the tile. All other tiles, e.g. the ones of smooth unions or curved
+// shapes, are contoured with marching squares. The ends of the explicit pieces on the sides of
+// a tile are merged with the crossings of the neighbouring tiles like crossings of marching
+// squares, so regions of hard booleans give a few exact edges with sharp corners, and the
+// contour stays closed across the two kinds of tiles. Explicit tiles add no sign changes.
+ContouringResult implicit_to_mesh_hybrid(Scalar implicit, int resolution, const ContouringOptions& options = {});
+
+// Contouring that keeps its tiles between updates, so that changing a single shape only
+// solves the tiles around it again instead of the whole quadtree
+class IncrementalContouring {
+public:
+    explicit IncrementalContouring(int resolution, const ContouringOptions& options = {});
+
+    // Contours the whole grid
+    const ContouringResult& rebuild(Scalar implicit);
+
+    // Solves the tiles whose tapes reference `shape` and the ones overlapping `region` again
+    // and takes everything else from the last result. Only `shape` may have changed and the
+    // region has to contain its old and new bounds, grown by the width of any smooth union it
+    // takes part in, e.g. inigo_smin_width(r) = r / (1 - sqrt(0.5)), about 3.41 r, for inigo_smin.
+    const ContouringResult& update(Scalar implicit, const IShape* shape, Bounds region);
+
+    // Same as above, but only the parameter values of the last contoured SDF changed. The
+    // compiled program is reused with the new values, see VM::set_parameters.
+    const ContouringResult& update(std::span<const float> parameters, const IShape* shape, Bounds region);
+
+    const ContouringResult& result() const { return contour_result; }
+
+    // Number of tiles solved by the last update
+    size_t solved_tiles = 0;
+
+private:
+    const ContouringResult& solve(const IShape* shape, Bounds region);
+
+    int resolution;
+    ContouringOptions options;
+    // VM of the last contoured SDF
+    std::unique_ptr<VM> vm;
+    std::shared_ptr<TapeInterner> tapes = std::make_shared<TapeInterner>();
+    std::deque<Tile> tiles;
+    std::vector<TileContour> contours;
+    ContouringResult contour_result;
+};
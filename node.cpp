@@ -1,23 +1,89 @@
 #include "node.h"
 #include <vector>
 #include <assert.h>
+#include <string.h>
 #include <cmath>
+#include <algorithm>
 
 
+size_t NodeKeyHash::operator()(const NodeKey& key) const {
+    uint64_t hash = static_cast<uint64_t>(key.type) | static_cast<uint64_t>(key.value_bits) << 32;
+    hash = hash * 0xff51afd7ed558ccdull ^ (static_cast<uint32_t>(key.left_child) | static_cast<uint64_t>(static_cast<uint32_t>(key.right_child)) << 32);
+    hash = hash * 0xc4ceb9fe1a85ec53ull ^ static_cast<uint32_t>(key.parameter) ^ reinterpret_cast<uintptr_t>(key.shape);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
 NodeManager& NodeManager::get() {
     static NodeManager instance;
     return instance;
 }
 
 NodeManager::NodeManager() {
-    node_data[VAR_X] = {NodeType::X, -1, -1, 1, 0};
-    node_data[VAR_Y] = {NodeType::Y, -1, -1, 1, 0};
+    // The variables hold a handle themselves, so they are never released
+    node_data.push_back({NodeType::X, -1, -1, 1, 0, 0.0f, nullptr, -1, 1.0f});
+    node_data.push_back({NodeType::Y, -1, -1, 1, 0, 0.0f, nullptr, -1, 1.0f});
 }
 
-int NodeManager::create_node(NodeType type, int left_child, int right_child) {
-    static int next_index = VAR_Y + 1;
-    int index = next_index++;
-    node_data[index] = {type, left_child, right_child, 1, 0};
+int NodeManager::create_node(NodeType type, int left_child, int right_child, float value, int parameter, const IShape* shape) {
+    uint32_t value_bits;
+    memcpy(&value_bits, &value, sizeof(value_bits));
+    auto [it, inserted] = unique_nodes.try_emplace({type, left_child, right_child, value_bits, parameter, shape}, -1);
+    if (!inserted) {
+        ++node_data[it->second].handle_count;
+        return it->second;
+    }
+
+    int index;
+    if (free_nodes.empty()) {
+        index = node_data.size();
+        node_data.emplace_back();
+    } else {
+        index = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    node_data[index] = {type, left_child, right_child, 1, 0, value, shape, parameter};
+    it->second = index;
+
+    auto child_lipschitz = [&](int child) { return node_data[child].lipschitz; };
+    auto constant = [&](int child) { return node_data[child].type == NodeType::Constant; };
+    Node& node = node_data[index];
+    switch (type) {
+        case NodeType::X:
+        case NodeType::Y:
+        case NodeType::Z:
+            node.lipschitz = 1.0f;
+            break;
+        case NodeType::Constant:
+        case NodeType::Parameter:
+            node.lipschitz = 0.0f;
+            break;
+        case NodeType::Add:
+        case NodeType::Sub:
+            node.lipschitz = child_lipschitz(left_child) + child_lipschitz(right_child);
+            break;
+        case NodeType::Mul:
+            if (constant(right_child)) node.lipschitz = std::abs(node_data[right_child].value) * child_lipschitz(left_child);
+            if (constant(left_child)) node.lipschitz = std::abs(node_data[left_child].value) * child_lipschitz(right_child);
+            break;
+        case NodeType::Div:
+            if (constant(right_child)) node.lipschitz = child_lipschitz(left_child) / std::abs(node_data[right_child].value);
+            break;
+        case NodeType::Max:
+        case NodeType::Min:
+            node.lipschitz = std::max(child_lipschitz(left_child), child_lipschitz(right_child));
+            break;
+        case NodeType::Neg:
+        case NodeType::Abs:
+            node.lipschitz = child_lipschitz(left_child);
+            break;
+        case NodeType::Square:
+        case NodeType::Sqrt:
+            // Depend on the values, the VM bounds them per region
+            break;
+    }
     
     if (left_child != -1) {
         node_data[left_child].ref_count++;
@@ -29,24 +95,7 @@ int NodeManager::create_node(NodeType type, int left_child, int right_child) {
     return index;
 }
 
-Scalar::Scalar(float value) {
-    index = NodeManager::get().create_node(NodeType::Constant);
-    NodeManager::get().node_data[index].value = value;
-}
-
-Scalar::Scalar(NodeType type, int left_child, int right_child) {
-    index = NodeManager::get().create_node(type, left_child, right_child);
-}
-
-Scalar::~Scalar() {
-    if (index == -1) return;
-    
-    NodeManager& forest = NodeManager::get();
-    Node& data = forest.node_data[index];
-    
-    if (--data.handle_count != 0) return;
-    if (data.ref_count != 0) return;
-    
+void NodeManager::release_node(int index) {
     std::vector<int> stack;
     stack.push_back(index);
     
@@ -54,12 +103,12 @@ Scalar::~Scalar() {
         int current = stack.back();
         stack.pop_back();
         
-        Node& current_data = forest.node_data[current];
-        assert(current_data.type != NodeType::X && current_data.type != NodeType::Y);
+        const Node& current_data = node_data[current];
+        assert(current != VAR_X && current != VAR_Y);
         
         // Push children onto stack if they exist
         if (current_data.left_child != -1) {
-            Node& left_data = forest.node_data[current_data.left_child];
+            Node& left_data = node_data[current_data.left_child];
             left_data.ref_count--;
             if (left_data.handle_count == 0 && left_data.ref_count == 0) {
                 stack.push_back(current_data.left_child);
@@ -67,18 +116,47 @@ Scalar::~Scalar() {
         }
         
         if (current_data.right_child != -1) {
-            Node& right_data = forest.node_data[current_data.right_child];
+            Node& right_data = node_data[current_data.right_child];
             right_data.ref_count--;
             if (right_data.handle_count == 0 && right_data.ref_count == 0) {
                 stack.push_back(current_data.right_child);
             }
         }
         
-        // Delete the current node
-        forest.node_data.erase(current);
+        // Free the slot of the current node
+        uint32_t value_bits;
+        memcpy(&value_bits, &current_data.value, sizeof(value_bits));
+        unique_nodes.erase({current_data.type, current_data.left_child, current_data.right_child, value_bits, current_data.parameter, current_data.shape});
+        free_nodes.push_back(current);
     }
 }
 
+Scalar::Scalar(float value) {
+    index = NodeManager::get().create_node(NodeType::Constant, -1, -1, value);
+}
+
+Scalar parameter(int index, float value) {
+    Scalar result;
+    result.index = NodeManager::get().create_node(NodeType::Parameter, -1, -1, value, index);
+    return result;
+}
+
+Scalar::Scalar(NodeType type, int left_child, int right_child) {
+    index = NodeManager::get().create_node(type, left_child, right_child);
+}
+
+Scalar::~Scalar() {
+    if (index == -1) return;
+    
+    NodeManager& forest = NodeManager::get();
+    Node& data = forest.node_data[index];
+    
+    if (--data.handle_count != 0) return;
+    if (data.ref_count != 0) return;
+    
+    forest.release_node(index);
+}
+
 void swap(Scalar& first, Scalar& second) noexcept {
     std::swap(first.index, second.index);
 }
@@ -158,10 +236,18 @@ Scalar varY() {
     return result;
 }
 
+Scalar varZ() {
+    // Not kept alive like X and Y, 2D programs do not need it. Hash-consing still makes all
+    // uses share one node.
+    return Scalar(NodeType::Z);
+}
+
 Scalar disk(const Scalar& centerX, const Scalar& centerY, const Scalar& radius) {
     Scalar dx = varX() - centerX;
     Scalar dy = varY() - centerY;
-    return (dx.square() + dy.square()).sqrt() - radius;
+    Scalar distance = (dx.square() + dy.square()).sqrt() - radius;
+    distance.bound_lipschitz(1.0f);
+    return distance;
 }
 
 Scalar rectangle(const Scalar& centerX, const Scalar& centerY, const Scalar& width, const Scalar& height) {
@@ -173,7 +259,18 @@ Scalar rectangle(const Scalar& centerX, const Scalar& centerY, const Scalar& wid
 
     Scalar dist_inside = min(max(dx, dy), 0.0f);
     
-    return dist_outside + dist_inside;
+    Scalar distance = dist_outside + dist_inside;
+    distance.bound_lipschitz(1.0f);
+    return distance;
+}
+
+Scalar sphere(const Scalar& centerX, const Scalar& centerY, const Scalar& centerZ, const Scalar& radius) {
+    Scalar dx = varX() - centerX;
+    Scalar dy = varY() - centerY;
+    Scalar dz = varZ() - centerZ;
+    Scalar distance = (dx.square() + dy.square() + dz.square()).sqrt() - radius;
+    distance.bound_lipschitz(1.0f);
+    return distance;
 }
 
 // max(r, min(a, b)) - sqrt(max(r-a, 0)^2 + max(r-b, 0)^2)
@@ -185,7 +282,11 @@ Scalar smooth_union(const Scalar& a, const Scalar& b, const Scalar& r) {
     Scalar u_y = max(val_b, zero);
     Scalar length_u_sq = u_x.square() + u_y.square();
     Scalar length_u = length_u_sq.sqrt();
-    return max(r, min(a, b)) - length_u;
+    // Where both a and b are below r the gradient is a sum of theirs with weights
+    // (r - a) / |u| and (r - b) / |u|, elsewhere it is the gradient of a or b
+    Scalar result = max(r, min(a, b)) - length_u;
+    result.bound_lipschitz(std::sqrt(2.0f) * std::max(a.lipschitz(), b.lipschitz()));
+    return result;
 }
 
 // circular
@@ -195,13 +296,36 @@ Scalar smooth_union(const Scalar& a, const Scalar& b, const Scalar& r) {
 //    float h = max( k-abs(a-b), 0.0 )/k;
 //    return min(a,b) - k*0.5*(1.0+h-sqrt(1.0-h*(h-2.0)));
 //}
+float inigo_smin_width(float r) {
+    return r / (1.0f - std::sqrt(0.5f));
+}
+
 Scalar inigo_smin(const Scalar& a, const Scalar& b, const Scalar& r) {
-    Scalar k = r * (1.0f / (1.0f - std::sqrt(0.5f)));
+    Scalar k = r * inigo_smin_width(1.0f);
     Scalar h = max(k - abs(a - b), 0.0f) / k;
     Scalar h2 = h * (h - 2.0f);
-    return min(a, b) - k * 0.5f * (Scalar(1.0f) + h - (Scalar(1.0f) - h2).sqrt());
+    Scalar result = min(a, b) - k * 0.5f * (Scalar(1.0f) + h - (Scalar(1.0f) - h2).sqrt());
+    // The gradient is a convex combination of the gradients of a and b
+    result.bound_lipschitz(std::max(a.lipschitz(), b.lipschitz()));
+    return result;
 }
 
 void Scalar::set_shape(const IShape* shape) {
-    NodeManager::get().node_data[index].shape = shape;
-}
\ No newline at end of file
+    NodeManager& manager = NodeManager::get();
+    const Node data = manager.node_data[index];
+    if (data.shape == shape) return;
+    Scalar tagged;
+    tagged.index = manager.create_node(data.type, data.left_child, data.right_child, data.value, data.parameter, shape);
+    tagged.bound_lipschitz(data.lipschitz);
+    // The untagged node is released with `tagged` if nothing else refers to it
+    swap(*this, tagged);
+}
+
+float Scalar::lipschitz() const {
+    return NodeManager::get().node_data[index].lipschitz;
+}
+
+void Scalar::bound_lipschitz(float bound) {
+    float& lipschitz = NodeManager::get().node_data[index].lipschitz;
+    lipschitz = std::min(lipschitz, bound);
+}
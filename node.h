@@ -1,10 +1,15 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <vector>
 #include <unordered_map>
 
 struct IShape;
 
-enum class NodeType { Add, Sub, Mul, Div, Max, Min, Neg, Abs, Square, Sqrt, X, Y, Constant };
+enum class NodeType { Add, Sub, Mul, Div, Max, Min, Neg, Abs, Square, Sqrt, X, Y, Z, Constant, Parameter };
 
 struct Node {
     NodeType type;
@@ -14,6 +19,24 @@ struct Node {
     int ref_count = 0;      // Number of other nodes referring to this node
     float value = 0.0f; 
     const IShape* shape = nullptr;
+    int parameter = -1;     // Slot in the parameter buffer of Parameter nodes
+    float lipschitz = INFINITY; // Bound on the Lipschitz constant, see Scalar::bound_lipschitz
+};
+
+// Everything that makes two nodes the same, the value is compared bitwise
+struct NodeKey {
+    NodeType type;
+    int left_child;
+    int right_child;
+    uint32_t value_bits;
+    int parameter;
+    const IShape* shape;
+
+    bool operator==(const NodeKey&) const = default;
+};
+
+struct NodeKeyHash {
+    size_t operator()(const NodeKey& key) const;
 };
 
 class NodeManager {
@@ -23,12 +46,26 @@ public:
 
     static NodeManager& get();
 
-    std::unordered_map<int, Node> node_data;
+    // Slab of nodes indexed by Scalar::index. The slots of released nodes are reused, so
+    // references into it do not survive create_node.
+    std::vector<Node> node_data;
 
-    int create_node(NodeType type, int left_child = -1, int right_child = -1);
+    // Returns the node with this structure with one more handle, creating it if there is
+    // none yet. Structurally identical subexpressions therefore share their nodes.
+    int create_node(NodeType type, int left_child = -1, int right_child = -1, float value = 0.0f, int parameter = -1, const IShape* shape = nullptr);
+
+    // Called once neither handles nor other nodes refer to the node anymore, releases it and
+    // the children that become unreferenced
+    void release_node(int index);
+
+    // Number of live nodes
+    size_t size() const { return node_data.size() - free_nodes.size(); }
 
 private:
     NodeManager();
+
+    std::vector<int> free_nodes;
+    std::unordered_map<NodeKey, int, NodeKeyHash> unique_nodes;
 };
 
 struct Scalar {
@@ -59,18 +96,39 @@ struct Scalar {
     Scalar square() const;
     Scalar sqrt() const;
 
+    // Makes this handle refer to a node tagged with `shape`. Shapes are part of the identity
+    // of a node, so other handles to the untagged node are not affected.
     void set_shape(const IShape* shape);
+
+    // Bound on the Lipschitz constant of the expression over the whole plane. Nodes derive it
+    // from their children where that is possible without knowing the values, e.g. for sums
+    // and min/max, and are infinite otherwise.
+    float lipschitz() const;
+
+    // Records a bound the expression is known to satisfy, e.g. 1 for an exact distance. The
+    // bound is a property of the function, so it holds for all handles of the node.
+    void bound_lipschitz(float bound);
 };
 
 Scalar max(const Scalar& a, const Scalar& b);
 Scalar min(const Scalar& a, const Scalar& b);
 Scalar abs(const Scalar& a);
 
+// Reads slot `index` of the parameter buffer. `value` is used until the VM is given other
+// parameter values, see VM::set_parameters.
+Scalar parameter(int index, float value);
+
 Scalar varX();
 Scalar varY();
+// Only 3D evaluation gives it a range, 2D evaluation is the slice z = 0
+Scalar varZ();
 
 Scalar disk(const Scalar& centerX, const Scalar& centerY, const Scalar& radius);
 Scalar rectangle(const Scalar& centerX, const Scalar& centerY, const Scalar& width, const Scalar& height);
+Scalar sphere(const Scalar& centerX, const Scalar& centerY, const Scalar& centerZ, const Scalar& radius);
 
 Scalar mercury_smin(const Scalar& a, const Scalar& b, const Scalar& r);
 Scalar inigo_smin(const Scalar& a, const Scalar& b, const Scalar& r);
+// Width of the blend of inigo_smin with radius r: the result is min(a, b) wherever the operands
+// differ by more than this
+float inigo_smin_width(float r);
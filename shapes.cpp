@@ -90,4 +90,68 @@ Scalar Disk::get_sdf() const {
     Scalar sdf = disk(Scalar(pos_x), Scalar(pos_y), Scalar(radius));
     sdf.set_shape(this);
     return sdf;
-} 
\ No newline at end of file
+}
+
+Bounds Rect::get_bounds() const {
+    return {pos_x - width * 0.5f, pos_y - height * 0.5f, pos_x + width * 0.5f, pos_y + height * 0.5f};
+}
+
+Bounds Disk::get_bounds() const {
+    return {pos_x - radius, pos_y - radius, pos_x + radius, pos_y + radius};
+}
+
+
+Scalar IShape::get_parametric_sdf(std::vector<float>&) const {
+    return get_sdf();
+}
+
+void IShape::get_parameters(std::vector<float>&) const {}
+
+bool IShape::get_polygon(std::vector<std::pair<float, float>>&) const {
+    return false;
+}
+
+bool IShape::exact_distance() const {
+    return false;
+}
+
+bool Rect::exact_distance() const {
+    return true;
+}
+
+bool Disk::exact_distance() const {
+    return true;
+}
+
+Scalar Rect::get_parametric_sdf(std::vector<float>& parameters) const {
+    const int first = parameters.size();
+    get_parameters(parameters);
+    Scalar sdf = rectangle(parameter(first, pos_x), parameter(first + 1, pos_y), parameter(first + 2, width), parameter(first + 3, height));
+    sdf.set_shape(this);
+    return sdf;
+}
+
+void Rect::get_parameters(std::vector<float>& parameters) const {
+    parameters.insert(parameters.end(), {pos_x, pos_y, width, height});
+}
+
+Scalar Disk::get_parametric_sdf(std::vector<float>& parameters) const {
+    const int first = parameters.size();
+    get_parameters(parameters);
+    Scalar sdf = disk(parameter(first, pos_x), parameter(first + 1, pos_y), parameter(first + 2, radius));
+    sdf.set_shape(this);
+    return sdf;
+}
+
+void Disk::get_parameters(std::vector<float>& parameters) const {
+    parameters.insert(parameters.end(), {pos_x, pos_y, radius});
+}
+
+bool Rect::get_polygon(std::vector<std::pair<float, float>>& polygon) const {
+    // Same corners as the rectangle() SDF, so the crossings of the sides agree with it
+    const float half_width = width * 0.5f;
+    const float half_height = height * 0.5f;
+    polygon = {{pos_x - half_width, pos_y - half_height}, {pos_x + half_width, pos_y - half_height},
+               {pos_x + half_width, pos_y + half_height}, {pos_x - half_width, pos_y + half_height}};
+    return true;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <algorithm>
 #include <vector>
 #include "node.h"
 
@@ -9,6 +10,17 @@ struct Mesh {
     std::vector<std::pair<uint32_t, uint32_t>> edges;
 };
 
+// Axis aligned bounding box
+struct Bounds {
+    float x_min, y_min, x_max, y_max;
+
+    Bounds expanded(float margin) const { return {x_min - margin, y_min - margin, x_max + margin, y_max + margin}; }
+
+    Bounds merged(const Bounds& other) const {
+        return {std::min(x_min, other.x_min), std::min(y_min, other.y_min), std::max(x_max, other.x_max), std::max(y_max, other.y_max)};
+    }
+};
+
 struct IShape {
     std::string name;
 
@@ -16,6 +28,21 @@ struct IShape {
     virtual Mesh get_mesh() = 0;
     virtual bool render_ui_properties() = 0; // Returns true if any property was changed
     virtual Scalar get_sdf() const = 0; // Returns the SDF representation of the shape
+    virtual Bounds get_bounds() const = 0; // Returns the region in which the SDF is negative
+
+    // The SDF with the properties of the shape read from the parameter buffer, starting at slot
+    // parameters.size(). Appends the current property values to `parameters`. Shapes without
+    // parameters return get_sdf().
+    virtual Scalar get_parametric_sdf(std::vector<float>& parameters) const;
+    // Appends the current property values in the order get_parametric_sdf reads them
+    virtual void get_parameters(std::vector<float>& parameters) const;
+    // The exact boundary as a counterclockwise polygon, for shapes whose boundary is one.
+    // Returns false for curved shapes.
+    virtual bool get_polygon(std::vector<std::pair<float, float>>& polygon) const;
+    // Whether the SDF is the exact distance to the boundary, negative inside, and the center of
+    // get_bounds lies inside the shape. The VM skips such shapes of a union in regions that are
+    // closer to another one, see VM::union_culling.
+    virtual bool exact_distance() const;
 };
 
 struct Rect : IShape {
@@ -36,6 +63,11 @@ struct Rect : IShape {
     Mesh get_mesh() override;
     bool render_ui_properties() override;
     Scalar get_sdf() const override;
+    Bounds get_bounds() const override;
+    Scalar get_parametric_sdf(std::vector<float>& parameters) const override;
+    void get_parameters(std::vector<float>& parameters) const override;
+    bool get_polygon(std::vector<std::pair<float, float>>& polygon) const override;
+    bool exact_distance() const override;
 };
 
 struct Disk : IShape {
@@ -54,4 +86,8 @@ struct Disk : IShape {
     Mesh get_mesh() override;
     bool render_ui_properties() override;
     Scalar get_sdf() const override;
+    Bounds get_bounds() const override;
+    Scalar get_parametric_sdf(std::vector<float>& parameters) const override;
+    void get_parameters(std::vector<float>& parameters) const override;
+    bool exact_distance() const override;
 };
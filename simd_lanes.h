@@ -0,0 +1,133 @@
+#pragma once
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Lane operations the interval and batch kernels are written against. Every struct wraps one
+// vector type; `width` is the number of floats it holds.
+//
+// Everything lives in an anonymous namespace on purpose: the vm_avx*.cpp files are compiled
+// with wider instruction sets enabled and must not hand their instantiations to the linker
+// for use by the generic code.
+
+namespace {
+
+struct ScalarLanes
+{
+    using V = float;
+    static constexpr int width = 1;
+
+    static V load(const float* p) { return *p; }
+    static V loadu(const float* p) { return *p; }
+    static void store(float* p, V v) { *p = v; }
+    static void storeu(float* p, V v) { *p = v; }
+    static V set1(float x) { return x; }
+    static V add(V a, V b) { return a + b; }
+    static V sub(V a, V b) { return a - b; }
+    static V mul(V a, V b) { return a * b; }
+    static V div(V a, V b) { return a / b; }
+    static V min(V a, V b) { return a < b ? a : b; }
+    static V max(V a, V b) { return a > b ? a : b; }
+    static V neg(V a) { return -a; }
+    static V abs(V a) { return fabsf(a); }
+    static V sqrt(V a) { return sqrtf(a); }
+    static bool less(V a, V b) { return a < b; }
+    static bool greater(V a, V b) { return a > b; }
+    // Returns a where the mask is set and b elsewhere
+    static V select(bool mask, V a, V b) { return mask ? a : b; }
+    static bool straddles_zero(V lower, V upper) { return lower <= 0.0f && upper >= 0.0f; }
+};
+
+#if defined(__SSE2__)
+struct SseLanes
+{
+    using V = __m128;
+    static constexpr int width = 4;
+
+    static V load(const float* p) { return _mm_load_ps(p); }
+    static V loadu(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, V v) { _mm_store_ps(p, v); }
+    static void storeu(float* p, V v) { _mm_storeu_ps(p, v); }
+    static V set1(float x) { return _mm_set1_ps(x); }
+    static V add(V a, V b) { return _mm_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+    static V div(V a, V b) { return _mm_div_ps(a, b); }
+    // min/max have the same (a < b ? a : b) semantics as the scalar helpers
+    static V min(V a, V b) { return _mm_min_ps(a, b); }
+    static V max(V a, V b) { return _mm_max_ps(a, b); }
+    static V neg(V a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+    static V abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static V sqrt(V a) { return _mm_sqrt_ps(a); }
+    static V less(V a, V b) { return _mm_cmplt_ps(a, b); }
+    static V greater(V a, V b) { return _mm_cmpgt_ps(a, b); }
+    static V select(V mask, V a, V b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static V straddles_zero(V lower, V upper) {
+        return _mm_and_ps(_mm_cmple_ps(lower, _mm_setzero_ps()), _mm_cmpge_ps(upper, _mm_setzero_ps()));
+    }
+};
+#endif
+
+#if defined(__AVX2__)
+struct AvxLanes
+{
+    using V = __m256;
+    static constexpr int width = 8;
+
+    static V load(const float* p) { return _mm256_load_ps(p); }
+    static V loadu(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, V v) { _mm256_store_ps(p, v); }
+    static void storeu(float* p, V v) { _mm256_storeu_ps(p, v); }
+    static V set1(float x) { return _mm256_set1_ps(x); }
+    static V add(V a, V b) { return _mm256_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+    static V div(V a, V b) { return _mm256_div_ps(a, b); }
+    static V min(V a, V b) { return _mm256_min_ps(a, b); }
+    static V max(V a, V b) { return _mm256_max_ps(a, b); }
+    static V neg(V a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+    static V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+    static V less(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static V greater(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static V select(V mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+    static V straddles_zero(V lower, V upper) {
+        return _mm256_and_ps(_mm256_cmp_ps(lower, _mm256_setzero_ps(), _CMP_LE_OQ),
+                             _mm256_cmp_ps(upper, _mm256_setzero_ps(), _CMP_GE_OQ));
+    }
+};
+#endif
+
+#if defined(__AVX512F__)
+struct Avx512Lanes
+{
+    using V = __m512;
+    static constexpr int width = 16;
+
+    static V load(const float* p) { return _mm512_load_ps(p); }
+    static V loadu(const float* p) { return _mm512_loadu_ps(p); }
+    static void store(float* p, V v) { _mm512_store_ps(p, v); }
+    static void storeu(float* p, V v) { _mm512_storeu_ps(p, v); }
+    static V set1(float x) { return _mm512_set1_ps(x); }
+    static V add(V a, V b) { return _mm512_add_ps(a, b); }
+    static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+    static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+    static V div(V a, V b) { return _mm512_div_ps(a, b); }
+    static V min(V a, V b) { return _mm512_min_ps(a, b); }
+    static V max(V a, V b) { return _mm512_max_ps(a, b); }
+    static V neg(V a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x80000000))); }
+    static V abs(V a) { return _mm512_abs_ps(a); }
+    static V sqrt(V a) { return _mm512_sqrt_ps(a); }
+};
+#endif
+
+#if defined(__SSE2__)
+using DefaultLanes = SseLanes;
+#else
+using DefaultLanes = ScalarLanes;
+#endif
+
+} // namespace
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "tape.h"
+
+namespace {
+
+uint64_t hash_instructions(const std::vector<Instruction>& instructions) {
+    // Same scheme as the tape hash of the JIT, the multiplications are off the serial chain
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ instructions.size();
+    for (const Instruction& inst : instructions) {
+        uint32_t constant;
+        memcpy(&constant, &inst.constant, sizeof(constant));
+        const uint64_t a = static_cast<uint32_t>(inst.input0) | static_cast<uint64_t>(static_cast<uint32_t>(inst.input1)) << 32;
+        const uint64_t b = constant | static_cast<uint64_t>(inst.op) << 32;
+        const uint64_t c = reinterpret_cast<uintptr_t>(inst.shape);
+        hash = ((hash << 5) | (hash >> 59)) ^ (a * 0xff51afd7ed558ccdull + b * 0xc4ceb9fe1a85ec53ull + c);
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool same_instructions(const std::vector<Instruction>& a, const std::vector<Instruction>& b) {
+    // Constants are compared bitwise, like the JIT cache does
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const Instruction& x, const Instruction& y) {
+        return x.op == y.op && x.input0 == y.input0 && x.input1 == y.input1 && x.shape == y.shape &&
+               x.parameter == y.parameter &&
+               memcmp(&x.constant, &y.constant, sizeof(float)) == 0;
+    });
+}
+
+std::vector<TapeRef>::const_iterator find_tape(const std::vector<TapeRef>& bucket, const std::vector<Instruction>& instructions) {
+    return std::find_if(bucket.begin(), bucket.end(), [&](const TapeRef& t) { return same_instructions(t->instructions, instructions); });
+}
+
+} // namespace
+
+TapeRef TapeInterner::intern(std::vector<Instruction> instructions) {
+    const uint64_t hash = hash_instructions(instructions);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = tapes.find(hash);
+        if (it != tapes.end()) {
+            auto found = find_tape(it->second, instructions);
+            if (found != it->second.end()) return *found;
+        }
+    }
+
+    // Registers are allocated without holding the lock, another thread may intern the same
+    // instructions in the meantime
+    auto tape = std::make_shared<Tape>();
+    allocate_registers(instructions, tape->registers);
+    tape->instructions = std::move(instructions);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<TapeRef>& bucket = tapes[hash];
+    auto found = find_tape(bucket, tape->instructions);
+    if (found != bucket.end()) return *found;
+    tape->id = next_id++;
+    bucket.push_back(tape);
+    return tape;
+}
+
+size_t TapeInterner::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t count = 0;
+    for (const auto& [hash, bucket] : tapes) count += bucket.size();
+    return count;
+}
+
+void TapeInterner::collect() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = tapes.begin(); it != tapes.end();) {
+        std::erase_if(it->second, [](const TapeRef& tape) { return tape.use_count() == 1; });
+        it = it->second.empty() ? tapes.erase(it) : std::next(it);
+    }
+}
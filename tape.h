@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+
+#include "compiler.h"
+
+// A pruned instruction list together with its register allocation. Tapes are interned, so
+// all tiles that ended up with the same instructions point to the same tape.
+struct Tape
+{
+    // Unique among the tapes of one interner, in the order they were first interned
+    uint32_t id;
+    std::vector<Instruction> instructions;
+    RegisterTape registers;
+};
+
+using TapeRef = std::shared_ptr<const Tape>;
+
+// Hash-consing of instruction lists. Lists are looked up by their hash and compared in full,
+// including the shapes the instructions belong to. Safe to use from several threads.
+class TapeInterner
+{
+public:
+    // Returns the tape holding these instructions, creating it if there is none yet
+    TapeRef intern(std::vector<Instruction> instructions);
+
+    // Number of distinct tapes
+    size_t size() const;
+
+    // Releases the tapes that are not referenced outside of the interner
+    void collect();
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, std::vector<TapeRef>> tapes;
+    uint32_t next_id = 0;
+};
@@ -1,10 +1,16 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <map>
 
 #include "node.h"
 #include "vm.h"
 #include "shapes.h"
+#include "marching_squares.h"
+#include "marching_cubes.h"
 
 using namespace doctest;
 
@@ -15,7 +21,7 @@ TEST_CASE("Disk primitive") {
         Scalar disk_node = disk(0.0f, 0.0f, 1.0f);
         program = compile(disk_node);
     }
-    CHECK(NodeManager::get().node_data.size() == 2); // Only X and Y nodes should remain
+    CHECK(NodeManager::get().size() == 2); // Only X and Y nodes should remain
     VM vm(program);
 
     // Test points inside the disk
@@ -35,7 +41,7 @@ TEST_CASE("Rectangle primitive") {
         Scalar rect_node = rectangle(0.0f, 0.0f, 2.0f, 1.0f);
         program = compile(rect_node);
     }
-    CHECK(NodeManager::get().node_data.size() == 2); // Only X and Y nodes should remain
+    CHECK(NodeManager::get().size() == 2); // Only X and Y nodes should remain
     VM vm(program);
 
     // Test points inside the rectangle
@@ -56,7 +62,7 @@ TEST_CASE("Translated disk") {
         Scalar disk_node = disk(1.0f, 1.0f, 0.5f);
         program = compile(disk_node);
     }
-    CHECK(NodeManager::get().node_data.size() == 2); // Only X and Y nodes should remain
+    CHECK(NodeManager::get().size() == 2); // Only X and Y nodes should remain
     VM vm(program);
 
     // Test points inside the translated disk
@@ -76,7 +82,7 @@ TEST_CASE("Translated rectangle") {
         Scalar rect_node = rectangle(2.0f, 2.0f, 1.0f, 0.5f);
         program = compile(rect_node);
     }
-    CHECK(NodeManager::get().node_data.size() == 2); // Only X and Y nodes should remain
+    CHECK(NodeManager::get().size() == 2); // Only X and Y nodes should remain
     VM vm(program);
 
     // Test points inside the translated rectangle
@@ -92,19 +98,44 @@ TEST_CASE("Translated rectangle") {
 
 TEST_CASE("Assignment") {
     Scalar rect_node = rectangle(2.0f, 2.0f, 1.0f, 0.5f);
-    int n = NodeManager::get().node_data.size();
+    int n = NodeManager::get().size();
     rect_node = rectangle(2.0f, 2.0f, 1.0f, 0.5f);
-    CHECK(NodeManager::get().node_data.size() == n);
+    CHECK(NodeManager::get().size() == n);
     rect_node = rectangle(2.0f, 2.0f, 1.0f, 0.5f);
-    CHECK(NodeManager::get().node_data.size() == n);
+    CHECK(NodeManager::get().size() == n);
 } 
 
 struct TestShape : public IShape {
     Mesh get_mesh() override { return Mesh{}; }
     bool render_ui_properties() override { return false; }
     Scalar get_sdf() const override { return Scalar(1.0f); }
+    Bounds get_bounds() const override { return {0.0f, 0.0f, 0.0f, 0.0f}; }
 };
 
+TEST_CASE("Identical subexpressions share nodes") {
+    NodeManager& manager = NodeManager::get();
+    {
+        Scalar a = disk(0.1f, 0.2f, 0.3f);
+        const size_t n = manager.size();
+        Scalar b = disk(0.1f, 0.2f, 0.3f);
+        CHECK(a.index == b.index);
+        CHECK(manager.size() == n);
+
+        // Only the node with the shape is new, the untagged one is still used by b
+        TestShape shape;
+        a.set_shape(&shape);
+        CHECK(a.index != b.index);
+        CHECK(manager.size() == n + 1);
+        CHECK(compile(a).size() == compile(b).size());
+    }
+    CHECK(manager.size() == 2);
+
+    // Released slots are reused
+    const size_t slab = manager.node_data.size();
+    Scalar c = disk(0.4f, 0.5f, 0.6f);
+    CHECK(manager.node_data.size() == slab);
+}
+
 TEST_CASE("Shape pointer propagation") {
     Scalar a = varX() - 0.1f;
     auto shape = std::make_unique<TestShape>();
@@ -119,7 +150,7 @@ TEST_CASE("Shape pointer propagation") {
     CHECK_EQ(tiles.size(), 2);
 
     for(const auto& tile : tiles) {
-       CHECK_EQ(tile.instructions.back().shape, shape.get());
+       CHECK_EQ(tile.tape->instructions.back().shape, shape.get());
     }
 }
 
@@ -162,14 +193,14 @@ TEST_CASE("Shape pointer propagation with min") {
     CHECK(top_left_tile != tiles.end());
     CHECK(bottom_right_tile != tiles.end());
 
-    CHECK_EQ(top_left_tile->instructions.back().shape, shape_a.get());
-    CHECK_EQ(bottom_right_tile->instructions.back().shape, shape_b.get());
+    CHECK_EQ(top_left_tile->tape->instructions.back().shape, shape_a.get());
+    CHECK_EQ(bottom_right_tile->tape->instructions.back().shape, shape_b.get());
 
     auto bottom_left_tile = find_tile(neg, neg);
 
     CHECK(bottom_left_tile != tiles.end());
-    CHECK_EQ(bottom_left_tile->instructions.back().op, OpCode::Min);
-    CHECK(!bottom_left_tile->instructions.back().shape);
+    CHECK_EQ(bottom_left_tile->tape->instructions.back().op, OpCode::Min);
+    CHECK(!bottom_left_tile->tape->instructions.back().shape);
 }
 
 TEST_CASE("Shape pointer propagation with smooth min") {
@@ -192,6 +223,882 @@ TEST_CASE("Shape pointer propagation with smooth min") {
     vm.evaluate(tiles, Subgrid(0, 0, 16, 16));
 }
 
+TEST_CASE("Parallel evaluation matches serial evaluation") {
+    Scalar a = disk(-0.3f, 0.1f, 0.4f);
+    Scalar b = rectangle(0.4f, -0.2f, 0.5f, 0.7f);
+    Scalar c = inigo_smin(a, b, 0.1f);
+
+    VM vm(c);
+
+    std::deque<Tile> serial_tiles;
+    vm.parallel = false;
+    vm.evaluate(serial_tiles, Subgrid(0, 0, 255, 255));
+
+    std::deque<Tile> parallel_tiles;
+    vm.parallel = true;
+    vm.evaluate(parallel_tiles, Subgrid(0, 0, 255, 255));
+
+    REQUIRE(serial_tiles.size() == parallel_tiles.size());
+    for (size_t i = 0; i < serial_tiles.size(); ++i) {
+        const Tile& s = serial_tiles[i];
+        const Tile& p = parallel_tiles[i];
+        CHECK(s.subgrid.px == p.subgrid.px);
+        CHECK(s.subgrid.py == p.subgrid.py);
+        CHECK(s.tape->instructions.size() == p.tape->instructions.size());
+        const int num_values = (s.subgrid.nx + 1) * (s.subgrid.ny + 1);
+        CHECK(memcmp(s.values.data(), p.values.data(), num_values * sizeof(float)) == 0);
+    }
+}
+
+TEST_CASE("Tiles with the same pruned instructions share one tape") {
+    Scalar a = disk(-0.3f, 0.1f, 0.4f);
+    Scalar b = rectangle(0.4f, -0.2f, 0.5f, 0.7f);
+    VM vm(min(a, b));
+
+    std::deque<Tile> tiles;
+    vm.evaluate(tiles, Subgrid(0, 0, 255, 255));
+    REQUIRE(vm.tapes->size() < tiles.size());
+    auto same = [](const Instruction& a, const Instruction& b) {
+        return a.op == b.op && a.input0 == b.input0 && a.input1 == b.input1 && a.constant == b.constant && a.shape == b.shape;
+    };
+    for (const Tile& x : tiles) {
+        for (const Tile& y : tiles) {
+            CHECK((x.tape == y.tape) == std::equal(x.tape->instructions.begin(), x.tape->instructions.end(),
+                                                   y.tape->instructions.begin(), y.tape->instructions.end(), same));
+        }
+    }
+
+    // A second evaluation reuses the tapes of the first one
+    std::deque<Tile> again;
+    vm.evaluate(again, Subgrid(0, 0, 255, 255));
+    REQUIRE(again.size() == tiles.size());
+    for (size_t i = 0; i < tiles.size(); ++i) CHECK(again[i].tape == tiles[i].tape);
+
+    ContouringResult result = implicit_to_mesh(min(a, b), 256);
+    for (size_t i = 0; i < result.expressions_list.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) CHECK(result.expressions_list[i] != result.expressions_list[j]);
+    }
+}
+
+// Cells of an n x n grid whose corner values differ in sign, sorted by index
+static std::vector<int> sign_change_cells(const std::deque<Tile>& tiles, int n) {
+    std::vector<int> cells;
+    for (const Tile& tile : tiles) {
+        const int nx = tile.subgrid.nx;
+        for (int y = 0; y < tile.subgrid.ny; ++y) {
+            for (int x = 0; x < nx; ++x) {
+                float v0 = tile.values[y * (nx + 1) + x];
+                float v1 = tile.values[y * (nx + 1) + x + 1];
+                float v2 = tile.values[(y + 1) * (nx + 1) + x];
+                float v3 = tile.values[(y + 1) * (nx + 1) + x + 1];
+                bool any_negative = v0 < 0 || v1 < 0 || v2 < 0 || v3 < 0;
+                bool any_positive = v0 >= 0 || v1 >= 0 || v2 >= 0 || v3 >= 0;
+                if (any_negative && any_positive) {
+                    cells.push_back((tile.subgrid.py + y) * n + tile.subgrid.px + x);
+                }
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    return cells;
+}
+
+// Whether every vertex ends two edges, as on closed contours without duplicated vertices
+static bool every_vertex_has_two_edges(const Mesh& mesh) {
+    std::vector<int> degree(mesh.vertices.size(), 0);
+    for (auto [a, b] : mesh.edges) {
+        degree[a]++;
+        degree[b]++;
+    }
+    return std::all_of(degree.begin(), degree.end(), [](int d) { return d == 2; });
+}
+
+// Distance from (x, y) to the closest vertex of the mesh
+static float distance_to_closest(const Mesh& mesh, float x, float y) {
+    float closest = INFINITY;
+    for (auto [vx, vy] : mesh.vertices) closest = std::min(closest, std::hypot(vx - x, vy - y));
+    return closest;
+}
+
+// Whether the SDF decreases to the right of every edge, the orientation of marching squares.
+// Edges too short for a direction are skipped.
+static bool sdf_decreases_to_the_right(VM& vm, const Mesh& mesh) {
+    for (auto [a, b] : mesh.edges) {
+        auto [ax, ay] = mesh.vertices[a];
+        auto [bx, by] = mesh.vertices[b];
+        const float mx = 0.5f * (ax + bx), my = 0.5f * (ay + by);
+        const float length = std::hypot(bx - ax, by - ay);
+        if (length < 1e-4f) continue;
+        const float rx = (by - ay) / length * 1e-3f, ry = -(bx - ax) / length * 1e-3f;
+        if (!(vm.evaluate(mx + rx, my + ry) < vm.evaluate(mx - rx, my - ry))) return false;
+    }
+    return true;
+}
+
+TEST_CASE("Eight-way subdivision finds the same sign changes as quadrants") {
+    Scalar a = disk(-0.3f, 0.1f, 0.4f);
+    Scalar b = rectangle(0.4f, -0.2f, 0.5f, 0.7f);
+    Scalar c = inigo_smin(a, b, 0.1f);
+
+    VM vm(c);
+    const int n = 200;
+
+    auto cells = [&](bool split8) {
+        vm.split8 = split8;
+        std::deque<Tile> tiles;
+        vm.evaluate(tiles, Subgrid(0, 0, n, n));
+        return sign_change_cells(tiles, n);
+    };
+
+    std::vector<int> quadrant_cells = cells(false);
+    std::vector<int> split8_cells = cells(true);
+    CHECK(!quadrant_cells.empty());
+    CHECK(quadrant_cells == split8_cells);
+}
+
+// A chain of smooth unions, where the intervals through the blend terms are loose
+static Scalar smooth_union_chain() {
+    Scalar scene = rectangle(-0.6f, -0.5f, 0.3f, 0.2f);
+    for (int i = 0; i < 8; ++i) {
+        Scalar shape = i % 2 ? rectangle(-0.5f + 0.15f * i, 0.3f * std::sin(1.3f * i), 0.12f, 0.2f)
+                             : disk(-0.5f + 0.15f * i, 0.3f * std::cos(0.9f * i), 0.1f);
+        scene = inigo_smin(scene, shape, 0.05f);
+    }
+    return max(scene, -disk(0.2f, 0.1f, 0.15f));
+}
+
+TEST_CASE("Lipschitz culling keeps every sign change") {
+    VM vm(smooth_union_chain());
+    const int n = 256;
+
+    for (bool split8 : {false, true}) {
+        vm.split8 = split8;
+        std::deque<Tile> interval_tiles, lipschitz_tiles;
+        vm.evaluate(interval_tiles, Subgrid(0, 0, n, n));
+        vm.lipschitz_culling = true;
+        vm.evaluate(lipschitz_tiles, Subgrid(0, 0, n, n));
+        vm.lipschitz_culling = false;
+
+        std::vector<int> interval_cells = sign_change_cells(interval_tiles, n);
+        CHECK(!interval_cells.empty());
+        CHECK(interval_cells == sign_change_cells(lipschitz_tiles, n));
+        CHECK(lipschitz_tiles.size() < interval_tiles.size());
+    }
+}
+
+TEST_CASE("Leaf culling only skips tiles without sign changes") {
+    VM vm(smooth_union_chain());
+    const int n = 256;
+
+    for (bool lipschitz : {false, true}) {
+        vm.lipschitz_culling = lipschitz;
+        std::deque<Tile> all_tiles, culled_tiles;
+        vm.leaf_culling = false;
+        vm.evaluate(all_tiles, Subgrid(0, 0, n, n));
+        CHECK(vm.skipped_tiles == 0);
+        vm.leaf_culling = true;
+        vm.evaluate(culled_tiles, Subgrid(0, 0, n, n));
+
+        CHECK(vm.skipped_tiles > 0);
+        CHECK(culled_tiles.size() + vm.skipped_tiles == all_tiles.size());
+        CHECK(sign_change_cells(all_tiles, n) == sign_change_cells(culled_tiles, n));
+    }
+}
+
+TEST_CASE("Adaptive tiles keep every sign change with less work") {
+    Scalar scene;
+    for (int i = 0; i < 48; ++i) {
+        Scalar d = disk(-0.9f + 0.038f * i, 0.6f * std::sin(0.5f * i), 0.03f + 0.02f * (i % 3));
+        scene = i == 0 ? d : min(scene, d);
+    }
+    VM vm(scene);
+    const int n = 512;
+
+    auto work = [](const std::deque<Tile>& tiles) {
+        size_t total = 0;
+        for (const Tile& tile : tiles) total += (tile.subgrid.nx + 1) * (tile.subgrid.ny + 1) * tile.tape->instructions.size();
+        return total;
+    };
+
+    std::deque<Tile> fixed_tiles, adaptive_tiles;
+    vm.evaluate(fixed_tiles, Subgrid(0, 0, n, n));
+    vm.adaptive_tiles = true;
+    vm.evaluate(adaptive_tiles, Subgrid(0, 0, n, n));
+
+    std::vector<int> fixed_cells = sign_change_cells(fixed_tiles, n);
+    CHECK(!fixed_cells.empty());
+    CHECK(fixed_cells == sign_change_cells(adaptive_tiles, n));
+    CHECK(work(adaptive_tiles) < work(fixed_tiles));
+    for (const Tile& tile : adaptive_tiles) {
+        CHECK((tile.subgrid.nx + 1) * (tile.subgrid.ny + 1) <= MAX_TILE_SIZE);
+        CHECK(tile.values.size() == static_cast<size_t>((tile.subgrid.nx + 1) * (tile.subgrid.ny + 1)));
+    }
+}
+
+TEST_CASE("Affine bounds visit fewer tiles with shorter tapes") {
+    VM vm(smooth_union_chain());
+    const int n = 256;
+
+    auto instructions_per_tile = [](const std::deque<Tile>& tiles) {
+        size_t total = 0;
+        for (const Tile& tile : tiles) total += tile.tape->instructions.size();
+        return static_cast<double>(total) / tiles.size();
+    };
+
+    for (bool split8 : {false, true}) {
+        vm.split8 = split8;
+        std::deque<Tile> interval_tiles, affine_tiles;
+        vm.evaluate(interval_tiles, Subgrid(0, 0, n, n));
+        vm.affine = true;
+        vm.evaluate(affine_tiles, Subgrid(0, 0, n, n));
+        vm.affine = false;
+
+        std::vector<int> interval_cells = sign_change_cells(interval_tiles, n);
+        CHECK(!interval_cells.empty());
+        CHECK(interval_cells == sign_change_cells(affine_tiles, n));
+        CHECK(affine_tiles.size() < interval_tiles.size());
+        CHECK(instructions_per_tile(affine_tiles) < instructions_per_tile(interval_tiles));
+
+        // Pruning with the affine bounds only drops operands that do not change the values
+        for (const Tile& tile : affine_tiles) {
+            const float step = 2.0f / n;
+            std::vector<float> xs, ys;
+            for (int dy = 0; dy <= tile.subgrid.ny; ++dy) {
+                for (int dx = 0; dx <= tile.subgrid.nx; ++dx) {
+                    xs.push_back(-1.0f + (tile.subgrid.px + dx) * step);
+                    ys.push_back(-1.0f + (tile.subgrid.py + dy) * step);
+                }
+            }
+            std::span<float> values = vm.evaluate_batch(vm.original_tape, xs, ys);
+            for (size_t i = 0; i < xs.size(); ++i) {
+                CHECK(tile.values[i] == values[i]);
+            }
+        }
+    }
+}
+
+TEST_CASE("Min chains are rebuilt as balanced trees") {
+    std::vector<std::unique_ptr<Disk>> disks;
+    Scalar scene;
+    for (int i = 0; i < 32; ++i) {
+        auto d = std::make_unique<Disk>();
+        d->pos_x = -0.8f + 0.05f * i;
+        d->pos_y = 0.4f * std::sin(0.7f * i);
+        d->radius = 0.05f;
+        scene = i == 0 ? d->get_sdf() : min(scene, d->get_sdf());
+        disks.push_back(std::move(d));
+    }
+    std::vector<Instruction> chain = compile(scene);
+    std::vector<Instruction> balanced = chain;
+    balance_min_max(balanced);
+
+    // Longest path from an input to the result
+    auto depth = [](const std::vector<Instruction>& instructions) {
+        std::vector<int> d(instructions.size(), 0);
+        for (size_t i = 0; i < instructions.size(); ++i) {
+            if (instructions[i].input0 != -1) d[i] = std::max(d[i], d[instructions[i].input0] + 1);
+            if (instructions[i].input1 != -1) d[i] = std::max(d[i], d[instructions[i].input1] + 1);
+        }
+        return d.back();
+    };
+    CHECK(balanced.size() == chain.size());
+    CHECK(depth(balanced) < depth(chain) - 16);
+    auto shapes = [](const std::vector<Instruction>& instructions) {
+        return std::count_if(instructions.begin(), instructions.end(), [](const Instruction& inst) { return inst.shape != nullptr; });
+    };
+    CHECK(shapes(balanced) == shapes(chain));
+
+    // Min is associative and commutative, so the values do not change at all
+    VM vm(scene);
+    std::vector<float> xs, ys;
+    for (int i = 0; i < 100; ++i) {
+        xs.push_back(-0.9f + 0.18f * (i % 10));
+        ys.push_back(-0.9f + 0.18f * (i / 10));
+    }
+    std::vector<float> expected;
+    for (float v : vm.evaluate_batch(chain, xs, ys)) expected.push_back(v);
+    std::span<float> values = vm.evaluate_batch(balanced, xs, ys);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        CHECK(values[i] == expected[i]);
+    }
+}
+
+TEST_CASE("Pruned tiles match the unpruned program") {
+    // Far away disks only lose against shapes that are not their siblings in the balanced tree
+    std::vector<std::unique_ptr<Disk>> disks;
+    Scalar scene;
+    for (int i = 0; i < 48; ++i) {
+        auto d = std::make_unique<Disk>();
+        d->pos_x = -0.9f + 0.037f * i;
+        d->pos_y = 0.6f * std::cos(0.4f * i);
+        d->radius = 0.03f + 0.02f * (i % 3);
+        scene = i == 0 ? d->get_sdf() : min(scene, d->get_sdf());
+        disks.push_back(std::move(d));
+    }
+    Scalar sdf = max(scene, -disk(0.0f, 0.0f, 0.3f));
+    VM vm(sdf);
+
+    std::deque<Tile> tiles;
+    vm.evaluate(tiles, Subgrid(0, 0, 255, 255));
+    REQUIRE(!tiles.empty());
+    for (const Tile& tile : tiles) {
+        const float step = 2.0f / 255;
+        std::vector<float> xs, ys;
+        for (int dy = 0; dy <= tile.subgrid.ny; ++dy) {
+            for (int dx = 0; dx <= tile.subgrid.nx; ++dx) {
+                xs.push_back(-1.0f + (tile.subgrid.px + dx) * step);
+                ys.push_back(-1.0f + (tile.subgrid.py + dy) * step);
+            }
+        }
+        std::span<float> values = vm.evaluate_batch(vm.original_tape, xs, ys);
+        for (size_t i = 0; i < xs.size(); ++i) {
+            CHECK(tile.values[i] == values[i]);
+        }
+    }
+}
+
+TEST_CASE("Union culling keeps the values of windows") {
+    // Enough shapes for the tapes of windows to be culled, and a smooth union that is always kept
+    std::vector<std::unique_ptr<IShape>> shapes;
+    std::vector<float> parameters;
+    Scalar scene;
+    for (int i = 0; i < 1024; ++i) {
+        const float x = -0.95f + 0.06f * (i % 32) + 0.01f * (i % 3);
+        const float y = -0.95f + 0.06f * (i / 32) + 0.01f * (i % 5);
+        if (i % 2) {
+            auto rect = std::make_unique<Rect>();
+            rect->pos_x = x;
+            rect->pos_y = y;
+            rect->width = 0.04f;
+            rect->height = 0.02f + 0.005f * (i % 4);
+            shapes.push_back(std::move(rect));
+        } else {
+            auto circle = std::make_unique<Disk>();
+            circle->pos_x = x;
+            circle->pos_y = y;
+            circle->radius = 0.01f + 0.005f * (i % 3);
+            shapes.push_back(std::move(circle));
+        }
+        Scalar shape = shapes.back()->get_parametric_sdf(parameters);
+        scene = i == 0 ? shape : min(scene, shape);
+    }
+    scene = min(scene, inigo_smin(disk(0.2f, 0.1f, 0.05f), disk(0.3f, 0.1f, 0.05f), 0.02f));
+    VM vm(scene);
+
+    auto check_windows = [&]() {
+        for (int px = 0; px < 256; px += 32) {
+            for (int py = 0; py < 256; py += 32) {
+                std::deque<Tile> tiles, expected;
+                vm.union_culling = true;
+                vm.evaluate_window(tiles, {px, py, 32, 32}, 256, 256);
+                vm.union_culling = false;
+                vm.evaluate_window(expected, {px, py, 32, 32}, 256, 256);
+                REQUIRE(tiles.size() == expected.size());
+                for (size_t i = 0; i < tiles.size(); ++i) {
+                    REQUIRE(tiles[i].values.size() == expected[i].values.size());
+                    for (size_t j = 0; j < tiles[i].values.size(); ++j) {
+                        CHECK(tiles[i].values[j] == expected[i].values[j]);
+                    }
+                }
+            }
+        }
+    };
+    check_windows();
+
+    // The bounds follow the shapes when parameters are bound again
+    for (size_t i = 0; i < shapes.size(); i += 7) {
+        if (Disk* circle = dynamic_cast<Disk*>(shapes[i].get())) {
+            circle->pos_x += 0.1f;
+            circle->radius *= 2.0f;
+        }
+    }
+    parameters.clear();
+    for (const auto& shape : shapes) shape->get_parameters(parameters);
+    vm.set_parameters(parameters);
+    check_windows();
+}
+
+TEST_CASE("Register allocation reuses slots") {
+    std::vector<Instruction> program;
+    {
+        Scalar scene = disk(0.0f, 0.0f, 0.1f);
+        for (int i = 1; i < 50; ++i) {
+            scene = min(scene, disk(0.03f * i, -0.02f * i, 0.1f));
+        }
+        program = compile(scene);
+    }
+
+    RegisterTape tape;
+    allocate_registers(program, tape);
+    CHECK(tape.instructions.size() < program.size());
+    CHECK(tape.num_slots < 10);
+
+    VM vm(program);
+    for (float x : {-0.5f, 0.0f, 0.4f, 1.2f}) {
+        float expected = std::numeric_limits<float>::max();
+        for (int i = 0; i < 50; ++i) {
+            float dx = x - 0.03f * i, dy = 0.25f + 0.02f * i;
+            expected = std::min(expected, std::sqrt(dx * dx + dy * dy) - 0.1f);
+        }
+        CHECK(vm.evaluate(x, 0.25f) == Approx(expected));
+    }
+}
+
+TEST_CASE("Vectorized batch evaluation matches the scalar kernel") {
+    Scalar a = disk(-0.3f, 0.1f, 0.4f);
+    Scalar b = rectangle(0.4f, -0.2f, 0.5f, 0.7f);
+    Scalar c = inigo_smin(a, b, 0.1f) / Scalar(2.0f);
+    VM vm(c);
+
+    // 37 points leave a tail for every vector width
+    std::vector<float> xs, ys;
+    for (int i = 0; i < 37; ++i) {
+        xs.push_back(-1.0f + 0.05f * i);
+        ys.push_back(0.8f - 0.04f * i);
+    }
+
+    vm.use_simd = false;
+    std::vector<float> scalar_values;
+    for (float v : vm.evaluate_batch(vm.original_instructions, xs, ys)) scalar_values.push_back(v);
+
+    vm.use_simd = true;
+    std::span<float> simd_values = vm.evaluate_batch(vm.original_instructions, xs, ys);
+    REQUIRE(simd_values.size() == scalar_values.size());
+    for (size_t i = 0; i < scalar_values.size(); ++i) {
+        CHECK(simd_values[i] == scalar_values[i]);
+    }
+}
+
+TEST_CASE("Gradient evaluation and Newton refined contour vertices") {
+    Scalar shape = disk(0.1f, -0.2f, 0.5f);
+    VM vm(shape);
+
+    // Analytic gradient of the disk is the unit vector from its center
+    std::array<float, 3> g = vm.evaluate_gradient(0.4f, 0.2f);
+    CHECK(g[0] == Approx(0.0f).epsilon(1e-5));
+    CHECK(g[1] == Approx(0.6f));
+    CHECK(g[2] == Approx(0.8f));
+
+    auto max_error = [&](const ContouringResult& result) {
+        float error = 0.0f;
+        for (auto [x, y] : result.mesh.vertices) error = std::max(error, std::abs(vm.evaluate(x, y)));
+        return error;
+    };
+    ContouringOptions linear_options;
+    linear_options.newton_steps = 0;
+    ContouringResult linear = implicit_to_mesh(shape, 32, linear_options);
+    ContouringResult refined = implicit_to_mesh(shape, 32);
+    REQUIRE(refined.mesh.vertices.size() == linear.mesh.vertices.size());
+    REQUIRE(refined.normals.size() == refined.mesh.vertices.size());
+    CHECK(max_error(refined) < 1e-5f);
+    CHECK(max_error(refined) < 0.1f * max_error(linear));
+
+    for (size_t i = 0; i < refined.normals.size(); ++i) {
+        auto [x, y] = refined.mesh.vertices[i];
+        auto [nx, ny] = refined.normals[i];
+        CHECK(nx * (x - 0.1f) + ny * (y + 0.2f) == Approx(0.5f).epsilon(1e-3));
+    }
+}
+
+TEST_CASE("Incremental contouring matches a full rebuild") {
+    for (bool adaptive : {false, true}) {
+        std::vector<std::unique_ptr<Disk>> disks;
+        for (int i = 0; i < 6; ++i) {
+            auto d = std::make_unique<Disk>();
+            d->pos_x = -0.7f + 0.28f * i;
+            d->pos_y = 0.3f * ((i % 3) - 1);
+            d->radius = 0.12f;
+            disks.push_back(std::move(d));
+        }
+        auto scene = [&] {
+            Scalar sdf = disks[0]->get_sdf();
+            for (size_t i = 1; i < disks.size(); ++i) sdf = min(sdf, disks[i]->get_sdf());
+            return sdf;
+        };
+
+        // With adaptive tiles a tile solved again may cover several kept ones
+        ContouringOptions options;
+        options.adaptive_tiles = adaptive;
+        IncrementalContouring contouring(128, options);
+        contouring.rebuild(scene());
+        const size_t all_tiles = contouring.solved_tiles;
+
+        Disk& moved = *disks[2];
+        Bounds old_bounds = moved.get_bounds();
+        moved.pos_x += 0.05f;
+        moved.radius = 0.15f;
+        const ContouringResult& updated = contouring.update(scene(), &moved, old_bounds.merged(moved.get_bounds()));
+        CHECK(contouring.solved_tiles < all_tiles);
+
+        ContouringResult full = implicit_to_mesh(scene(), 128, options);
+        REQUIRE(updated.mesh.vertices.size() == full.mesh.vertices.size());
+        REQUIRE(updated.mesh.edges.size() == full.mesh.edges.size());
+        for (size_t i = 0; i < full.mesh.vertices.size(); ++i) {
+            CHECK(updated.mesh.vertices[i].first == Approx(full.mesh.vertices[i].first).epsilon(1e-6));
+            CHECK(updated.mesh.vertices[i].second == Approx(full.mesh.vertices[i].second).epsilon(1e-6));
+        }
+        for (size_t i = 0; i < full.mesh.edges.size(); ++i) {
+            CHECK(updated.mesh.edges[i] == full.mesh.edges[i]);
+        }
+        CHECK(updated.sign_change_data.size() == full.sign_change_data.size());
+    }
+
+    // A smooth union reaches its blend width beyond the shapes, here a disk moves into the blend
+    // with its neighbour
+    Disk fixed, moved;
+    fixed.radius = moved.radius = 0.2f;
+    moved.pos_x = 0.5f;
+    const float union_radius = 0.1f;
+    auto scene = [&] {
+        std::vector<float> parameters;
+        Scalar fixed_sdf = fixed.get_parametric_sdf(parameters);
+        return inigo_smin(fixed_sdf, moved.get_parametric_sdf(parameters), Scalar(union_radius));
+    };
+    IncrementalContouring contouring(128);
+    contouring.rebuild(scene());
+    Bounds old_bounds = moved.get_bounds();
+    moved.pos_x = 0.25f;
+    std::vector<float> parameters;
+    fixed.get_parameters(parameters);
+    moved.get_parameters(parameters);
+    const ContouringResult& updated = contouring.update(parameters, &moved, old_bounds.merged(moved.get_bounds()).expanded(inigo_smin_width(union_radius)));
+    ContouringResult full = implicit_to_mesh(scene(), 128);
+    REQUIRE(updated.mesh.vertices.size() == full.mesh.vertices.size());
+    REQUIRE(updated.mesh.edges.size() == full.mesh.edges.size());
+    for (size_t i = 0; i < full.mesh.vertices.size(); ++i) {
+        CHECK(updated.mesh.vertices[i].first == Approx(full.mesh.vertices[i].first).epsilon(1e-6));
+        CHECK(updated.mesh.vertices[i].second == Approx(full.mesh.vertices[i].second).epsilon(1e-6));
+    }
+}
+
+TEST_CASE("Crossings on tile borders are merged") {
+    Scalar scene = min(disk(-0.3f, 0.1f, 0.35f), rectangle(0.2f, -0.4f, 0.5f, 0.3f));
+    ContouringResult result = implicit_to_mesh(scene, 300);
+    REQUIRE(result.normals.size() == result.mesh.vertices.size());
+
+    // The contour is closed, so without duplicated crossings every vertex ends two edges
+    CHECK(every_vertex_has_two_edges(result.mesh));
+    CHECK(result.mesh.vertices.size() == result.mesh.edges.size());
+}
+
+TEST_CASE("Parallel contouring is deterministic") {
+    Scalar scene = min(inigo_smin(disk(-0.3f, 0.1f, 0.35f), rectangle(0.2f, 0.0f, 0.5f, 0.3f), 0.05f), disk(0.5f, -0.6f, 0.2f));
+    ContouringOptions serial_options;
+    serial_options.parallel = false;
+    ContouringResult serial = implicit_to_mesh(scene, 400, serial_options);
+    ContouringResult parallel = implicit_to_mesh(scene, 400);
+
+    // The meshes have to be bit-identical, not just close
+    REQUIRE(parallel.mesh.vertices.size() == serial.mesh.vertices.size());
+    REQUIRE(parallel.mesh.edges.size() == serial.mesh.edges.size());
+    CHECK(std::memcmp(parallel.mesh.vertices.data(), serial.mesh.vertices.data(), serial.mesh.vertices.size() * sizeof(serial.mesh.vertices[0])) == 0);
+    CHECK(std::memcmp(parallel.normals.data(), serial.normals.data(), serial.normals.size() * sizeof(serial.normals[0])) == 0);
+    CHECK(parallel.mesh.edges == serial.mesh.edges);
+    CHECK(parallel.sign_change_data == serial.sign_change_data);
+}
+
+TEST_CASE("Streaming contouring stitches the tiles like a full contouring") {
+    Scalar scene = min(inigo_smin(disk(-0.3f, 0.1f, 0.35f), rectangle(0.2f, 0.0f, 0.5f, 0.3f), 0.05f), disk(0.5f, -0.6f, 0.2f));
+    ContouringResult full = implicit_to_mesh(scene, 200);
+    ContouringResult streamed = implicit_to_mesh_streaming(scene, 200);
+
+    // The full contouring keeps both copies of crossings on tile borders, only the referenced
+    // ones are part of the contour
+    std::vector<uint32_t> referenced;
+    for (auto [a, b] : full.mesh.edges) {
+        referenced.push_back(a);
+        referenced.push_back(b);
+    }
+    std::sort(referenced.begin(), referenced.end());
+    referenced.erase(std::unique(referenced.begin(), referenced.end()), referenced.end());
+    CHECK(streamed.mesh.vertices.size() == referenced.size());
+    CHECK(streamed.mesh.edges.size() == full.mesh.edges.size());
+    CHECK(streamed.normals.size() == streamed.mesh.vertices.size());
+    CHECK(streamed.sign_change_data.size() == full.sign_change_data.size());
+    CHECK(streamed.expressions_list.size() == full.expressions_list.size());
+
+    // The contours are closed, so every stitched vertex ends two edges
+    CHECK(every_vertex_has_two_edges(streamed.mesh));
+
+    auto sorted_vertices = [](const ContouringResult& result, const std::vector<uint32_t>& ids) {
+        std::vector<std::pair<float, float>> vertices;
+        for (uint32_t id : ids) vertices.push_back(result.mesh.vertices[id]);
+        std::sort(vertices.begin(), vertices.end());
+        return vertices;
+    };
+    std::vector<uint32_t> all(streamed.mesh.vertices.size());
+    for (size_t i = 0; i < all.size(); ++i) all[i] = i;
+    std::vector<std::pair<float, float>> expected = sorted_vertices(full, referenced);
+    std::vector<std::pair<float, float>> actual = sorted_vertices(streamed, all);
+    REQUIRE(expected.size() == actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        CHECK(actual[i].first == Approx(expected[i].first).epsilon(1e-5));
+        CHECK(actual[i].second == Approx(expected[i].second).epsilon(1e-5));
+    }
+}
+
+TEST_CASE("Tiled export of a non-square window matches a single contouring") {
+    // Half of the shapes lie outside of the default domain
+    Scalar scene = min(inigo_smin(disk(-1.3f, 0.1f, 0.45f), rectangle(-0.9f, -0.3f, 0.8f, 0.4f), 0.05f), disk(1.6f, -0.5f, 0.3f));
+    ContouringOptions options;
+    options.window = {-2.0f, -1.0f, 2.0f, 1.0f};
+    CHECK(grid_cells(301, options.window) == std::make_pair(300, 150));
+
+    ContouringResult single = implicit_to_mesh(scene, 301, options);
+    // Windows that do not divide the grid, so some of them are narrow
+    ContouringResult tiled = implicit_to_mesh_tiled(scene, 301, 37, options);
+    REQUIRE(tiled.mesh.vertices.size() == single.mesh.vertices.size());
+    CHECK(tiled.mesh.edges.size() == single.mesh.edges.size());
+    CHECK(tiled.normals.size() == tiled.mesh.vertices.size());
+    CHECK(tiled.sign_change_data.size() == single.sign_change_data.size());
+
+    // Without a seam the contours stay closed across the sides of the windows
+    CHECK(every_vertex_has_two_edges(tiled.mesh));
+
+    std::vector<std::pair<float, float>> expected = single.mesh.vertices;
+    std::vector<std::pair<float, float>> actual = tiled.mesh.vertices;
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        CHECK(actual[i].first == Approx(expected[i].first).epsilon(1e-5));
+        CHECK(actual[i].second == Approx(expected[i].second).epsilon(1e-5));
+    }
+
+    // The disk outside of the default domain is contoured where it is
+    size_t on_disk = 0;
+    for (auto [x, y] : tiled.mesh.vertices) {
+        if (x > 1.0f) {
+            CHECK(std::hypot(x - 1.6f, y + 0.5f) == Approx(0.3f).epsilon(1e-3));
+            on_disk++;
+        }
+    }
+    CHECK(on_disk > 0);
+}
+
+TEST_CASE("Level of detail contouring has no cracks and fewer vertices") {
+    // The small disk is narrower than a cell of the coarsest lattice
+    Scalar scene = min(inigo_smin(disk(-0.3f, 0.1f, 0.45f), rectangle(0.1f, -0.5f, 0.5f, 0.4f), 0.05f), disk(0.6f, 0.6f, 0.01f));
+    const int resolution = 1024;
+    const float cell = 2.0f / (resolution - 1);
+    ContouringResult fine = implicit_to_mesh(scene, resolution);
+    ContouringOptions options;
+    options.lod_tolerance = 0.5f * cell;
+    ContouringResult coarse = implicit_to_mesh(scene, resolution, options);
+
+    // Crossings on the sides of tiles of different strides are merged, so the contour is closed
+    CHECK(every_vertex_has_two_edges(coarse.mesh));
+    CHECK(coarse.mesh.vertices.size() * 5 < fine.mesh.vertices.size());
+
+    // Every vertex of the fine contour, including the ones of the small disk, is within the
+    // tolerance of a segment of the coarse one
+    auto distance_to_segment = [](std::pair<float, float> p, std::pair<float, float> a, std::pair<float, float> b) {
+        const float dx = b.first - a.first, dy = b.second - a.second;
+        const float length2 = dx * dx + dy * dy;
+        const float t = length2 > 0.0f ? std::clamp(((p.first - a.first) * dx + (p.second - a.second) * dy) / length2, 0.0f, 1.0f) : 0.0f;
+        return std::hypot(p.first - a.first - t * dx, p.second - a.second - t * dy);
+    };
+    float max_distance = 0.0f;
+    for (auto v : fine.mesh.vertices) {
+        float closest = INFINITY;
+        for (auto [a, b] : coarse.mesh.edges) closest = std::min(closest, distance_to_segment(v, coarse.mesh.vertices[a], coarse.mesh.vertices[b]));
+        max_distance = std::max(max_distance, closest);
+    }
+    CHECK(max_distance < options.lod_tolerance);
+}
+
+TEST_CASE("Dual contouring keeps the corners of rectangles") {
+    // Corners at (-0.53, -0.24), (0.27, -0.24), (-0.53, 0.36), (0.27, 0.36), none on a grid line
+    Scalar scene = min(rectangle(-0.13f, 0.06f, 0.8f, 0.6f), disk(0.55f, -0.5f, 0.3f));
+    const int resolution = 24;
+    ContouringResult dual = implicit_to_mesh_dual(scene, resolution);
+    ContouringResult marched = implicit_to_mesh(scene, resolution);
+    REQUIRE(dual.normals.size() == dual.mesh.vertices.size());
+
+    // The pieces of neighbouring cells and tiles are connected into closed contours
+    CHECK(every_vertex_has_two_edges(dual.mesh));
+
+    const float cell = 2.0f / (resolution - 1);
+    for (float x : {-0.53f, 0.27f}) {
+        for (float y : {-0.24f, 0.36f}) {
+            CHECK(distance_to_closest(dual.mesh, x, y) < 1e-3f);
+            CHECK(distance_to_closest(marched.mesh, x, y) > 0.05f * cell);
+        }
+    }
+
+    // Orientation matches marching squares, the SDF decreases to the right of every edge
+    VM vm(scene);
+    CHECK(sdf_decreases_to_the_right(vm, dual.mesh));
+
+    // Away from the corners the vertices lie on the disk
+    for (auto [x, y] : dual.mesh.vertices) {
+        if (x > 0.3f) CHECK(std::hypot(x - 0.55f, y + 0.5f) == Approx(0.3f).epsilon(1e-2));
+    }
+}
+
+TEST_CASE("Hybrid contouring meshes hard unions of rectangles exactly") {
+    // Spans x -0.6..0 and y -0.1..0.3, the other one x -0.25..0.25 and y -0.35..0.15
+    Rect first, second, blended;
+    first.pos_x = -0.3f;
+    first.pos_y = 0.1f;
+    first.width = 0.6f;
+    first.height = 0.4f;
+    second.pos_y = -0.1f;
+    second.width = 0.5f;
+    second.height = 0.5f;
+    blended.pos_x = 0.6f;
+    blended.pos_y = 0.5f;
+    blended.width = 0.3f;
+    blended.height = 0.2f;
+    Disk circle;
+    circle.pos_x = 0.5f;
+    circle.pos_y = 0.65f;
+    circle.radius = 0.15f;
+    Scalar rectangles = min(first.get_sdf(), second.get_sdf());
+    Scalar scene = min(rectangles, inigo_smin(blended.get_sdf(), circle.get_sdf(), Scalar(0.05f)));
+
+    const int resolution = 64;
+
+    // Tiles of the rectangles alone are not sampled, their contour is the exact outline
+    ContouringResult exact = implicit_to_mesh_hybrid(rectangles, resolution);
+    REQUIRE(exact.normals.size() == exact.mesh.vertices.size());
+    CHECK(exact.sign_change_data.empty());
+    CHECK(every_vertex_has_two_edges(exact.mesh));
+    CHECK(exact.mesh.vertices.size() < implicit_to_mesh(rectangles, resolution).mesh.vertices.size() / 2);
+    // Corners of the union and crossings of the two rectangles
+    const std::pair<float, float> corners[] = {{-0.6f, -0.1f}, {-0.6f, 0.3f}, {0.0f, 0.3f}, {-0.25f, -0.35f},
+                                               {0.25f, -0.35f}, {0.25f, 0.15f}, {-0.25f, -0.1f}, {0.0f, 0.15f}};
+    for (auto [x, y] : corners) CHECK(distance_to_closest(exact.mesh, x, y) < 1e-6f);
+    VM vm(rectangles);
+    for (auto [x, y] : exact.mesh.vertices) CHECK(std::abs(vm.evaluate(x, y)) < 1e-6f);
+    CHECK(sdf_decreases_to_the_right(vm, exact.mesh));
+
+    // With the smooth union the tiles around it are sampled, and connected to the exact ones
+    ContouringResult hybrid = implicit_to_mesh_hybrid(scene, resolution);
+    CHECK(!hybrid.sign_change_data.empty());
+    CHECK(every_vertex_has_two_edges(hybrid.mesh));
+    CHECK(hybrid.mesh.vertices.size() < implicit_to_mesh(scene, resolution).mesh.vertices.size());
+    for (auto [x, y] : {corners[0], corners[1], corners[3], corners[6]}) CHECK(distance_to_closest(hybrid.mesh, x, y) < 1e-6f);
+
+    // Sides and corners on tile lines, which are round at resolutions of 2^k + 1. Spans x -0.5..0.5
+    // and y 0..0.5, the other one x -0.05..0.25 and y -0.5..0.1.
+    Rect aligned, crossing;
+    aligned.width = 1.0f;
+    aligned.height = 0.5f;
+    aligned.pos_y = 0.25f;
+    crossing.pos_x = 0.1f;
+    crossing.pos_y = -0.2f;
+    crossing.width = 0.3f;
+    crossing.height = 0.6f;
+    Scalar on_lines = min(aligned.get_sdf(), crossing.get_sdf());
+    VM on_lines_vm(on_lines);
+    for (int aligned_resolution : {33, 65, 129}) {
+        ContouringResult result = implicit_to_mesh_hybrid(on_lines, aligned_resolution);
+        CHECK(result.sign_change_data.empty());
+        CHECK(every_vertex_has_two_edges(result.mesh));
+        for (auto [x, y] : result.mesh.vertices) CHECK(std::abs(on_lines_vm.evaluate(x, y)) < 1e-6f);
+        const std::pair<float, float> aligned_corners[] = {{-0.5f, 0.0f}, {-0.5f, 0.5f}, {0.5f, 0.5f}, {0.5f, 0.0f},
+                                                           {-0.05f, -0.5f}, {0.25f, -0.5f}, {-0.05f, 0.0f}, {0.25f, 0.0f}};
+        for (auto [x, y] : aligned_corners) CHECK(distance_to_closest(result.mesh, x, y) < 1e-6f);
+    }
+}
+
+TEST_CASE("Rebound parameters match a freshly compiled SDF") {
+    Rect rect;
+    rect.pos_x = 0.3f;
+    Disk circle;
+    circle.pos_x = -0.4f;
+    std::vector<float> parameters;
+    // Separate statements, the parameters are numbered in the order of the calls
+    Scalar rect_sdf = rect.get_parametric_sdf(parameters);
+    Scalar sdf = min(rect_sdf, circle.get_parametric_sdf(parameters));
+    REQUIRE(parameters.size() == 7);
+
+    VM vm(sdf);
+    REQUIRE(vm.num_parameters() == 7);
+    // The half extents of the rectangle only depend on parameters and are folded
+    CHECK(vm.original_instructions.size() < compile(sdf).size());
+
+    rect.width = 0.6f;
+    circle.pos_y = 0.25f;
+    circle.radius = 0.3f;
+    parameters.clear();
+    rect.get_parameters(parameters);
+    circle.get_parameters(parameters);
+    vm.set_parameters(parameters);
+
+    VM fresh(min(rect.get_sdf(), circle.get_sdf()));
+    std::vector<float> xs, ys;
+    for (int i = 0; i < 64; ++i) {
+        xs.push_back(-1.0f + 2.0f * (i % 8) / 7.0f);
+        ys.push_back(-1.0f + 2.0f * (i / 8) / 7.0f);
+    }
+    std::vector<float> expected;
+    for (float v : fresh.evaluate_batch(fresh.original_tape, xs, ys)) expected.push_back(v);
+    std::span<float> values = vm.evaluate_batch(vm.original_tape, xs, ys);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        CHECK(values[i] == Approx(expected[i]).epsilon(1e-6));
+    }
+
+    // Pruning sees the bound values
+    std::deque<Tile> tiles, fresh_tiles;
+    vm.evaluate(tiles, Subgrid(0, 0, 127, 127));
+    fresh.evaluate(fresh_tiles, Subgrid(0, 0, 127, 127));
+    CHECK(tiles.size() == fresh_tiles.size());
+}
+
+TEST_CASE("Compiled tapes match the interpreter") {
+    Scalar a = disk(-0.3f, 0.1f, 0.4f);
+    Scalar b = rectangle(0.4f, -0.2f, 0.5f, 0.7f);
+    Scalar c = abs(inigo_smin(a, b, 0.1f) / Scalar(2.0f)) - Scalar(0.05f);
+    VM vm(c);
+
+    std::vector<float> xs, ys;
+    for (int i = 0; i < 37; ++i) {
+        xs.push_back(-1.0f + 0.05f * i);
+        ys.push_back(0.8f - 0.04f * i);
+    }
+    std::vector<float> expected;
+    for (float v : vm.evaluate_batch(vm.original_tape, xs, ys)) expected.push_back(v);
+
+    vm.jit = std::make_shared<JitCache>();
+    vm.jit->compile_threshold = 1;
+    std::span<float> values = vm.evaluate_batch(vm.original_tape, xs, ys);
+    if (!jit_supported()) return;
+    REQUIRE(vm.jit->compiled() == 1);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        CHECK(values[i] == Approx(expected[i]).epsilon(1e-6));
+    }
+
+    // Tiles with the same pruned tape share the compiled function
+    std::deque<Tile> tiles;
+    vm.jit->compile_threshold = 2;
+    vm.evaluate(tiles, {0, 0, 255, 255});
+    CHECK(vm.jit->size() < tiles.size());
+    CHECK(vm.jit->compiled() > 1);
+    for (const Tile& tile : tiles) {
+        CHECK(tile.values[0] == Approx(vm.evaluate(vm.get_x_interval(tile.subgrid).lower, vm.get_y_interval(tile.subgrid).lower)).epsilon(1e-5));
+    }
+
+    // Beyond the bound the least recently used functions are released, a held one stays valid
+    std::shared_ptr<const JitFunction> held = vm.jit->get(vm.original_tape);
+    REQUIRE(held);
+    vm.jit->clear();
+    vm.jit->max_compiled = 16;
+    vm.jit->compile_threshold = 1;
+    tiles.clear();
+    vm.evaluate(tiles, {0, 0, 255, 255});
+    CHECK(vm.jit->compiled() <= 16);
+    for (const Tile& tile : tiles) {
+        CHECK(tile.values[0] == Approx(vm.evaluate(vm.get_x_interval(tile.subgrid).lower, vm.get_y_interval(tile.subgrid).lower)).epsilon(1e-5));
+    }
+    // Compiled functions evaluate multiples of 16 points
+    std::vector<float> out(48), slots(4 * vm.original_tape.num_slots);
+    xs.resize(48, 0.0f);
+    ys.resize(48, 0.0f);
+    (*held)(xs.data(), ys.data(), out.data(), slots.data(), 48);
+    for (size_t i = 0; i < expected.size(); ++i) CHECK(out[i] == Approx(expected[i]).epsilon(1e-6));
+}
+
 TEST_CASE("Constant propagation - pure constants") {
     // Create an expression with constants: (2.0 + 3.0) * 4.0
     // This should be optimized to just 20.0
@@ -305,4 +1212,103 @@ TEST_CASE("Constant propagation - no optimization needed") {
     CHECK(found_var_x);
     CHECK(found_var_y);
     CHECK(found_add);
-}
\ No newline at end of file
+}
+TEST_CASE("Common subexpressions and identities are eliminated") {
+    // Both halves compute |x - 0.5| in a different way, so only one copy remains
+    Scalar x = varX();
+    Scalar a = abs(abs(x - Scalar(0.5f)) * Scalar(1.0f));
+    Scalar b = ((x - Scalar(0.5f)).square()).sqrt() + Scalar(0.0f);
+    Scalar result = max(a, b) - max(-(-x), Scalar(0.0f));
+
+    std::vector<Instruction> instructions = compile(result);
+    optimize_instructions(instructions);
+
+    // VarX, Const(0.5), Sub, Abs, Const(0), Max, Sub
+    CHECK(instructions.size() == 7);
+    CHECK(std::count_if(instructions.begin(), instructions.end(), [](const Instruction& inst) { return inst.op == OpCode::Abs; }) == 1);
+    CHECK(std::none_of(instructions.begin(), instructions.end(), [](const Instruction& inst) { return inst.op == OpCode::Sqrt || inst.op == OpCode::Neg; }));
+
+    VM vm(instructions);
+    for (float px : {-0.9f, -0.2f, 0.3f, 0.5f, 0.8f}) {
+        CHECK(vm.evaluate(px, 0.0f) == Approx(std::abs(px - 0.5f) - std::max(px, 0.0f)));
+    }
+}
+
+TEST_CASE("Simplification keeps the instructions of shapes") {
+    auto shape = std::make_unique<TestShape>();
+    Scalar a = varX() * Scalar(1.0f);
+    a.set_shape(shape.get());
+
+    std::vector<Instruction> instructions = compile(a);
+    optimize_instructions(instructions);
+    CHECK(instructions.back().shape == shape.get());
+}
+
+TEST_CASE("Octree tiles match direct evaluation") {
+    Scalar shape = min(sphere(-0.3f, 0.1f, 0.2f, 0.4f), sphere(0.35f, -0.2f, -0.1f, 0.3f) + varZ() * Scalar(0.5f));
+    VM vm(shape);
+    const int cells = 40;
+    std::deque<Tile3> tiles;
+    vm.evaluate(tiles, {0, 0, 0, cells, cells, cells});
+    REQUIRE(!tiles.empty());
+
+    // Children that cannot reach the surface are culled, so the tiles do not cover the grid
+    size_t covered = 0;
+    const float step = 2.0f / cells;
+    for (const Tile3& tile : tiles) {
+        const Subgrid3& s = tile.subgrid;
+        CHECK((s.nx + 1) * (s.ny + 1) * (s.nz + 1) <= FIXED_TILE_SIZE);
+        covered += static_cast<size_t>(s.nx) * s.ny * s.nz;
+
+        std::vector<float> xs, ys, zs;
+        for (int z = 0; z <= s.nz; ++z) {
+            for (int y = 0; y <= s.ny; ++y) {
+                for (int x = 0; x <= s.nx; ++x) {
+                    xs.push_back(-1.0f + (s.px + x) * step);
+                    ys.push_back(-1.0f + (s.py + y) * step);
+                    zs.push_back(-1.0f + (s.pz + z) * step);
+                }
+            }
+        }
+        std::span<float> expected = vm.evaluate_batch(vm.original_tape, xs, ys, zs);
+        for (size_t i = 0; i < xs.size(); ++i) {
+            CHECK(tile.values[i] == Approx(expected[i]).epsilon(1e-4));
+        }
+    }
+    CHECK(covered < static_cast<size_t>(cells) * cells * cells);
+}
+
+TEST_CASE("Sphere mesh is closed and lies on the sphere") {
+    const float radius = 0.6f;
+    TriangleMesh mesh = implicit_to_mesh3(sphere(0.05f, -0.1f, 0.0f, radius), 48);
+    REQUIRE(!mesh.triangles.empty());
+
+    for (const auto& v : mesh.vertices) {
+        const float r = std::sqrt((v[0] - 0.05f) * (v[0] - 0.05f) + (v[1] + 0.1f) * (v[1] + 0.1f) + v[2] * v[2]);
+        CHECK(r == Approx(radius).epsilon(0.01));
+    }
+
+    // Every directed edge appears once and its reverse once, so the surface is closed and
+    // consistently oriented. The Euler characteristic of a sphere is 2.
+    std::map<std::pair<uint32_t, uint32_t>, int> directed;
+    for (const auto& t : mesh.triangles) {
+        for (int k = 0; k < 3; ++k) directed[{t[k], t[(k + 1) % 3]}]++;
+    }
+    bool manifold = true;
+    for (const auto& [edge, count] : directed) {
+        manifold = manifold && count == 1 && directed.count({edge.second, edge.first}) == 1;
+    }
+    CHECK(manifold);
+    const long euler = static_cast<long>(mesh.vertices.size()) - static_cast<long>(directed.size() / 2) + static_cast<long>(mesh.triangles.size());
+    CHECK(euler == 2);
+
+    // Counterclockwise from outside, the normals point away from the center
+    double volume = 0.0;
+    for (const auto& t : mesh.triangles) {
+        const auto& a = mesh.vertices[t[0]];
+        const auto& b = mesh.vertices[t[1]];
+        const auto& c = mesh.vertices[t[2]];
+        volume += (a[0] * (b[1] * c[2] - b[2] * c[1]) - a[1] * (b[0] * c[2] - b[2] * c[0]) + a[2] * (b[0] * c[1] - b[1] * c[0])) / 6.0;
+    }
+    CHECK(volume == Approx(4.0 / 3.0 * M_PI * radius * radius * radius).epsilon(0.03));
+}
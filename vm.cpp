@@ -6,257 +6,521 @@
 
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <type_traits>
+#include <bit>
+
+#include <omp.h>
 
 #include "vm.h"
+#include "interval_kernels.h"
+#include "affine_kernels.h"
+#include "batch_kernels.h"
+
+#if defined(HYBRID_MODELING_X86_SIMD)
+// The kernels in vm_avx2.cpp and vm_avx512.cpp are only used if the host supports them
+static bool host_has_avx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
 
-//#pragma omp threadprivate(thread_batch_vars, thread_interval4_vars, thread_remap4)
+static bool host_has_avx512() {
+    static const bool supported = __builtin_cpu_supports("avx512f");
+    return supported;
+}
+#endif
 
-VM::VM(const std::vector<Instruction>& instructions) 
-    : original_instructions(instructions) {
+// Blocks of the tile value pool hold 2^k floats, from 2^MIN_BLOCK_SHIFT up to MAX_TILE_SIZE
+constexpr int MIN_BLOCK_SHIFT = 4;
+constexpr int NUM_BLOCK_CLASSES = std::bit_width(static_cast<unsigned>(MAX_TILE_SIZE - 1)) - MIN_BLOCK_SHIFT + 1;
+// Freed blocks a thread keeps per class, beyond that they are deleted
+constexpr size_t MAX_FREE_BLOCKS = 4096;
 
-    //#pragma omp parallel
-    {
-        set_batch_size(MAX_TILE_SIZE);
-        interval_vars.resize(instructions.size());
-        remap.resize(instructions.size());
+struct TileValuePool {
+    std::array<std::vector<float*>, NUM_BLOCK_CLASSES> free_blocks;
+
+    ~TileValuePool() {
+        for (std::vector<float*>& blocks : free_blocks) {
+            for (float* block : blocks) delete[] block;
+        }
     }
+};
+
+// Blocks are freed into the pool of the thread that frees them, which is not necessarily the
+// one that allocated them
+static thread_local TileValuePool tile_value_pool;
+
+static int block_class(size_t count) {
+    return std::max(static_cast<int>(std::bit_width(count - 1)) - MIN_BLOCK_SHIFT, 0);
+}
+
+TileValues::TileValues(std::span<const float> values) : count(values.size()) {
+    if (values.empty()) return;
+    assert(values.size() <= static_cast<size_t>(MAX_TILE_SIZE));
+    std::vector<float*>& blocks = tile_value_pool.free_blocks[block_class(count)];
+    if (blocks.empty()) {
+        block = new float[size_t(1) << (block_class(count) + MIN_BLOCK_SHIFT)];
+    } else {
+        block = blocks.back();
+        blocks.pop_back();
+    }
+    std::copy(values.begin(), values.end(), block);
+}
+
+TileValues::~TileValues() {
+    if (!block) return;
+    std::vector<float*>& blocks = tile_value_pool.free_blocks[block_class(count)];
+    if (blocks.size() < MAX_FREE_BLOCKS) {
+        blocks.push_back(block);
+    } else {
+        delete[] block;
+    }
+}
+
+VM::VM(const std::vector<Instruction>& instructions) {
+    for (const Instruction& inst : instructions) {
+        if (inst.op != OpCode::Param) continue;
+        if (inst.parameter >= static_cast<int>(parameters.size())) parameters.resize(inst.parameter + 1);
+        parameters[inst.parameter] = inst.constant;
+    }
+    if (parameters.empty()) {
+        original_instructions = instructions;
+        balance_min_max(original_instructions);
+        optimize_instructions(original_instructions);
+        allocate_registers(original_instructions, original_tape);
+        build_union_hierarchy();
+    } else {
+        parametric_instructions = instructions;
+        balance_min_max(parametric_instructions);
+        bind_parameters();
+    }
+    // The buffers themselves are allocated lazily by the threads that use them
+    scratch.resize(omp_get_max_threads());
+    set_batch_size(MAX_TILE_SIZE);
 }
 
 VM::VM(const Scalar& implicit) 
     : VM(compile(implicit)) {}
 
+void VM::set_parameters(std::span<const float> values) {
+    assert(values.size() == parameters.size());
+    std::copy(values.begin(), values.end(), parameters.begin());
+    bind_parameters();
+}
+
+void VM::bind_parameters() {
+    original_instructions = parametric_instructions;
+    for (Instruction& inst : original_instructions) {
+        if (inst.op != OpCode::Param) continue;
+        inst.op = OpCode::Const;
+        inst.constant = parameters[inst.parameter];
+        inst.parameter = -1;
+    }
+    // Folding sees the bound values, so identities such as x - 0 or x * 1 fold away for some
+    // bindings and not for others, and the number of instructions can change between bindings.
+    // Nothing relies on their layout: the scratch buffers grow on demand, and tiles are matched
+    // to shapes through the shape of their instructions. The intervals of the pruning pass only
+    // ever see the bound constants.
+    optimize_instructions(original_instructions);
+    allocate_registers(original_instructions, original_tape);
+    build_union_hierarchy();
+}
+
+// Builds the node of the hierarchy over `count` shapes starting at `first`, splitting them at
+// the median center along the longer side of their bounds. Returns the index of the node.
+int VM::build_union_node(std::vector<UnionShape>& shapes, std::vector<UnionNode>& nodes, int first, int count) {
+    Bounds bounds = shapes[first].bounds;
+    for (int i = first + 1; i < first + count; ++i) bounds = bounds.merged(shapes[i].bounds);
+    const int node = nodes.size();
+    nodes.push_back({bounds, first, count});
+    if (count == 1) return node;
+
+    const bool split_x = bounds.x_max - bounds.x_min >= bounds.y_max - bounds.y_min;
+    const int half = count / 2;
+    std::nth_element(shapes.begin() + first, shapes.begin() + first + half, shapes.begin() + first + count,
+        [split_x](const UnionShape& a, const UnionShape& b) {
+            return split_x ? a.bounds.x_min + a.bounds.x_max < b.bounds.x_min + b.bounds.x_max
+                           : a.bounds.y_min + a.bounds.y_max < b.bounds.y_min + b.bounds.y_max;
+        });
+    const int left = build_union_node(shapes, nodes, first, half);
+    const int right = build_union_node(shapes, nodes, first + half, count - half);
+    nodes[node].left = left;
+    nodes[node].right = right;
+    return node;
+}
+
+void VM::build_union_hierarchy() {
+    union_shapes.clear();
+    union_nodes.clear();
+    union_others.clear();
+    if (original_instructions.empty()) return;
+
+    // The operands of the top-level union are the first instructions below the root that are
+    // not min instructions, or that are the min of a shape
+    std::vector<int> stack = {static_cast<int>(original_instructions.size()) - 1};
+    while (!stack.empty()) {
+        const int i = stack.back();
+        stack.pop_back();
+        const Instruction& inst = original_instructions[i];
+        if (inst.op == OpCode::Min && !inst.shape) {
+            stack.push_back(inst.input1);
+            stack.push_back(inst.input0);
+        } else if (inst.shape && inst.shape->exact_distance()) {
+            union_shapes.push_back({i, inst.shape->get_bounds()});
+        } else {
+            union_others.push_back(i);
+        }
+    }
+    if (union_shapes.size() < 2) {
+        union_shapes.clear();
+        union_others.clear();
+        return;
+    }
+    build_union_node(union_shapes, union_nodes, 0, union_shapes.size());
+}
+
+bool VM::cull_union(const Subgrid& subgrid, std::vector<Instruction>& instructions) {
+    const Interval ix = get_x_interval(subgrid);
+    const Interval iy = get_y_interval(subgrid);
+    const float cx = 0.5f * (ix.lower + ix.upper);
+    const float cy = 0.5f * (iy.lower + iy.upper);
+    const auto distance_to_region = [&](const Bounds& b) {
+        const float dx = std::max({b.x_min - ix.upper, ix.lower - b.x_max, 0.0f});
+        const float dy = std::max({b.y_min - iy.upper, iy.lower - b.y_max, 0.0f});
+        return std::sqrt(dx * dx + dy * dy);
+    };
+    Scratch& s = local_scratch();
+
+    // Bound the union from above on the whole region by the value of a shape at the corner
+    // farthest from its center. The disk inscribed in its bounds lies inside the shape, so the
+    // value is at most the distance to the center minus the radius of that disk. The disk of a
+    // node whose bounds are farther from the center of the region than the best bound so far
+    // cannot give a lower one, no disk is larger than the bounds.
+    float upper = INFINITY;
+    s.union_stack.assign(1, 0);
+    while (!s.union_stack.empty()) {
+        const UnionNode& node = union_nodes[s.union_stack.back()];
+        s.union_stack.pop_back();
+        const float dx = std::max({node.bounds.x_min - cx, cx - node.bounds.x_max, 0.0f});
+        const float dy = std::max({node.bounds.y_min - cy, cy - node.bounds.y_max, 0.0f});
+        const float radius = 0.5f * std::min(node.bounds.x_max - node.bounds.x_min, node.bounds.y_max - node.bounds.y_min);
+        if (std::sqrt(dx * dx + dy * dy) - radius >= upper) continue;
+        if (node.left >= 0) {
+            s.union_stack.push_back(node.right);
+            s.union_stack.push_back(node.left);
+            continue;
+        }
+        const Bounds& b = union_shapes[node.first].bounds;
+        const float bx = 0.5f * (b.x_min + b.x_max);
+        const float by = 0.5f * (b.y_min + b.y_max);
+        const float far_x = std::max(std::abs(bx - ix.lower), std::abs(bx - ix.upper));
+        const float far_y = std::max(std::abs(by - iy.lower), std::abs(by - iy.upper));
+        const float inner = 0.5f * std::min(b.x_max - b.x_min, b.y_max - b.y_min);
+        upper = std::min(upper, std::sqrt(far_x * far_x + far_y * far_y) - inner);
+    }
+
+    // A shape is at least as far from a point outside its bounds as the bounds are, shapes
+    // whose bounds overlap the region are kept. The margin keeps shapes whose value may only be
+    // lower than the bound through rounding.
+    const float cut = std::max(upper + 1e-5f * std::abs(upper) + 1e-6f, 0.0f);
+    s.union_roots.clear();
+    s.union_stack.assign(1, 0);
+    while (!s.union_stack.empty()) {
+        const UnionNode& node = union_nodes[s.union_stack.back()];
+        s.union_stack.pop_back();
+        if (distance_to_region(node.bounds) > cut) continue;
+        if (node.left >= 0) {
+            s.union_stack.push_back(node.right);
+            s.union_stack.push_back(node.left);
+        } else {
+            s.union_roots.push_back(union_shapes[node.first].root);
+        }
+    }
+    if (s.union_roots.empty() || s.union_roots.size() == union_shapes.size()) return false;
+    s.union_roots.insert(s.union_roots.end(), union_others.begin(), union_others.end());
+
+    // Collect the instructions the kept operands depend on, in the order of the program
+    if (++s.union_generation == 0) {
+        std::fill(s.union_marks.begin(), s.union_marks.end(), 0);
+        s.union_generation = 1;
+    }
+    s.union_order.clear();
+    s.union_stack = s.union_roots;
+    while (!s.union_stack.empty()) {
+        const int i = s.union_stack.back();
+        s.union_stack.pop_back();
+        if (i < 0 || s.union_marks[i] == s.union_generation) continue;
+        s.union_marks[i] = s.union_generation;
+        s.union_order.push_back(i);
+        s.union_stack.push_back(original_instructions[i].input0);
+        s.union_stack.push_back(original_instructions[i].input1);
+    }
+    if (s.union_order.size() + s.union_roots.size() - 1 >= instructions.size()) return false;
+    std::sort(s.union_order.begin(), s.union_order.end());
+
+    std::vector<Instruction> culled;
+    culled.reserve(s.union_order.size() + s.union_roots.size() - 1);
+    for (int i : s.union_order) {
+        Instruction inst = original_instructions[i];
+        if (inst.input0 >= 0) inst.input0 = s.union_remap[inst.input0];
+        if (inst.input1 >= 0) inst.input1 = s.union_remap[inst.input1];
+        s.union_remap[i] = culled.size();
+        culled.push_back(inst);
+    }
+
+    // Join the kept operands with a balanced min tree that ends the tape
+    size_t count = s.union_roots.size();
+    for (size_t i = 0; i < count; ++i) s.union_roots[i] = s.union_remap[s.union_roots[i]];
+    while (count > 1) {
+        size_t joined = 0;
+        for (size_t i = 0; i + 1 < count; i += 2) {
+            const int a = s.union_roots[i];
+            const int b = s.union_roots[i + 1];
+            culled.push_back({0.0f, a, b, OpCode::Min, nullptr, -1, std::max(culled[a].lipschitz, culled[b].lipschitz)});
+            s.union_roots[joined++] = culled.size() - 1;
+        }
+        if (count % 2) s.union_roots[joined++] = s.union_roots[count - 1];
+        count = joined;
+    }
+    instructions = std::move(culled);
+    return true;
+}
+
+Scratch& VM::local_scratch() {
+    const size_t thread = omp_get_thread_num();
+    assert(thread < scratch.size());
+    Scratch& s = scratch[thread];
+    if (s.interval_vars.size() < original_instructions.size()) {
+        s.interval_vars.resize(original_instructions.size());
+        s.remap.resize(original_instructions.size());
+        s.interval8_vars.resize(original_instructions.size());
+        s.remap8.resize(original_instructions.size());
+        s.affine_vars.resize(original_instructions.size());
+        s.affine8_vars.resize(original_instructions.size());
+        s.union_marks.resize(original_instructions.size());
+        s.union_remap.resize(original_instructions.size());
+    }
+    return s;
+}
+
 std::span<float> VM::evaluate_batch(const std::vector<Instruction>& instructions, std::span<float> x_coords, std::span<float> y_coords) {
+    RegisterTape& tape = local_scratch().tape;
+    allocate_registers(instructions, tape);
+    return evaluate_batch(tape, x_coords, y_coords);
+}
+
+std::span<float> VM::evaluate_batch(const RegisterTape& tape, std::span<float> x_coords, std::span<float> y_coords) {
+    return evaluate_batch(tape, x_coords, y_coords, {});
+}
+
+std::span<float> VM::evaluate_batch(const RegisterTape& tape, std::span<float> x_coords, std::span<float> y_coords, std::span<float> z_coords) {
+    std::vector<float>& batch_vars = local_scratch().batch_vars;
 
     assert(x_coords.size() == y_coords.size() && x_coords.size() <= static_cast<size_t>(batch_capacity));
-    const size_t num_instructions = instructions.size();
+    assert(z_coords.empty() || z_coords.size() == x_coords.size());
     const size_t n = x_coords.size();
-    // Each instruction result block has size batch_capacity
+    // Each slot has size batch_capacity, the kernels run over the padded number of points
     const size_t stride = batch_capacity;
+    const size_t padded_n = (n + SIMD_BATCH_ALIGNMENT - 1) / SIMD_BATCH_ALIGNMENT * SIMD_BATCH_ALIGNMENT;
+    if (batch_vars.size() < (tape.num_slots + 3) * stride) {
+        batch_vars.resize((tape.num_slots + 3) * stride);
+    }
 
-#define LOOP(expr) for(size_t j = 0; j < n; j++) { batch_vars[i * stride + j] = expr; }
+    float* x_row = batch_vars.data() + tape.num_slots * stride;
+    float* y_row = x_row + stride;
+    float* z_row = y_row + stride;
+    std::copy(x_coords.begin(), x_coords.end(), x_row);
+    std::copy(y_coords.begin(), y_coords.end(), y_row);
+    std::copy(z_coords.begin(), z_coords.end(), z_row);
+    std::fill(x_row + n, x_row + padded_n, 0.0f);
+    std::fill(y_row + n, y_row + padded_n, 0.0f);
+    std::fill(z_row + z_coords.size(), z_row + padded_n, 0.0f);
 
-    for(size_t i = 0; i < num_instructions; i++) {
-        const Instruction& inst = instructions[i];
-        switch(inst.op) {
-            case OpCode::VarX:
-                LOOP(x_coords[j]);
-                break;
-            case OpCode::VarY:
-                LOOP(y_coords[j]);
-                break;
-            case OpCode::Const:
-                LOOP(inst.constant);
-                break;
-            case OpCode::Add:
-                LOOP(batch_vars[inst.input0 * stride + j] + batch_vars[inst.input1 * stride + j]);
-                break;
-            case OpCode::Sub:
-                LOOP(batch_vars[inst.input0 * stride + j] - batch_vars[inst.input1 * stride + j]);
-                break;
-            case OpCode::Mul:
-                LOOP(batch_vars[inst.input0 * stride + j] * batch_vars[inst.input1 * stride + j]);
-                break;
-            case OpCode::Div:
-                LOOP(batch_vars[inst.input0 * stride + j] / batch_vars[inst.input1 * stride + j]);
-                break;
-            case OpCode::Max:
-                LOOP(fmax(batch_vars[inst.input0 * stride + j], batch_vars[inst.input1 * stride + j]));
-                break;
-            case OpCode::Min:
-                LOOP(fmin(batch_vars[inst.input0 * stride + j], batch_vars[inst.input1 * stride + j]));
-                break;
-            case OpCode::Neg:
-                LOOP(-batch_vars[inst.input0 * stride + j]);
-                break;
-            case OpCode::Abs:
-                LOOP(fabsf(batch_vars[inst.input0 * stride + j]));
-                break;
-            case OpCode::Square:
-                LOOP(batch_vars[inst.input0 * stride + j] * batch_vars[inst.input0 * stride + j]);
-                break;
-            case OpCode::Sqrt:
-                LOOP(sqrt(batch_vars[inst.input0 * stride + j]));
-                break;
+    float* result = batch_vars.data() + tape.instructions.back().output * stride;
+    if (std::shared_ptr<const JitFunction> function = jit ? jit->get(tape) : nullptr) {
+        // The compiled code keeps the slots of a few points at a time and only writes the result row
+        std::vector<float>& jit_slots = local_scratch().jit_slots;
+        if (jit_slots.size() < 4 * static_cast<size_t>(tape.num_slots)) {
+            jit_slots.resize(4 * tape.num_slots);
         }
+        (*function)(x_row, y_row, result, jit_slots.data(), padded_n);
+    } else if (!use_simd) {
+        evaluate_batch_lanes<ScalarLanes>(tape, batch_vars.data(), stride, padded_n);
+    }
+#if defined(HYBRID_MODELING_X86_SIMD)
+    else if (host_has_avx512()) {
+        evaluate_batch_avx512(tape, batch_vars.data(), stride, padded_n);
+    } else if (host_has_avx2()) {
+        evaluate_batch_avx2(tape, batch_vars.data(), stride, padded_n);
+    }
+#endif
+    else {
+        evaluate_batch_lanes<DefaultLanes>(tape, batch_vars.data(), stride, padded_n);
     }
-#undef LOOP
 
-    return std::span<float>(batch_vars.data() + (num_instructions - 1) * stride, n);
+    return std::span<float>(result, n);
 }
 
-float min2(float a, float b) { return a < b ? a : b; }
-float min4(float a, float b, float c, float d) { return min2(min2(a, b), min2(c, d)); }
-float max2(float a, float b) { return a > b ? a : b; }
-float max4(float a, float b, float c, float d) { return max2(max2(a, b), max2(c, d)); }
+BatchGradient VM::evaluate_batch_gradient(const std::vector<Instruction>& instructions, std::span<float> x_coords, std::span<float> y_coords) {
+    RegisterTape& tape = local_scratch().tape;
+    allocate_registers(instructions, tape);
+    return evaluate_batch_gradient(tape, x_coords, y_coords);
+}
 
-Interval4 VM::evaluate_interval4(const std::vector<Instruction>& instructions, const Interval4& x, const Interval4& y) {
-    const size_t num_instructions = instructions.size();
-    assert(interval_vars.size() >= num_instructions);
+BatchGradient VM::evaluate_batch_gradient(const RegisterTape& tape, std::span<float> x_coords, std::span<float> y_coords) {
+    std::vector<float>& gradient_vars = local_scratch().gradient_vars;
 
-    for(size_t i = 0; i < num_instructions; ++i) {
-        const Instruction& inst = instructions[i];
-        switch(inst.op) {
-            case OpCode::VarX: 
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = x.lower[j];
-                    interval_vars[i].upper[j] = x.upper[j];
-                }
-                break;
-            case OpCode::VarY: 
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = y.lower[j];
-                    interval_vars[i].upper[j] = y.upper[j];
-                }
-                break;
-            case OpCode::Const: 
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = inst.constant;
-                    interval_vars[i].upper[j] = inst.constant;
-                }
-                break;
-            case OpCode::Add:
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = interval_vars[inst.input0].lower[j] + interval_vars[inst.input1].lower[j];
-                    interval_vars[i].upper[j] = interval_vars[inst.input0].upper[j] + interval_vars[inst.input1].upper[j];
-                }
-                break;
-            case OpCode::Sub:
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = interval_vars[inst.input0].lower[j] - interval_vars[inst.input1].upper[j];
-                    interval_vars[i].upper[j] = interval_vars[inst.input0].upper[j] - interval_vars[inst.input1].lower[j];
-                }
-                break;
-            case OpCode::Mul: {
-                for(int j = 0; j < 4; j++) {
-                    float a = interval_vars[inst.input0].lower[j], b = interval_vars[inst.input0].upper[j];
-                    float c = interval_vars[inst.input1].lower[j], d = interval_vars[inst.input1].upper[j];
-                    float p1 = a*c, p2 = a*d, p3 = b*c, p4 = b*d;
-                    interval_vars[i].lower[j] = min4(p1, p2, p3, p4);
-                    interval_vars[i].upper[j] = max4(p1, p2, p3, p4);
-                }
-                break;
-            }
-            case OpCode::Div: {
-                for(int j = 0; j < 4; j++) {
-                    float a = interval_vars[inst.input0].lower[j], b = interval_vars[inst.input0].upper[j];
-                    float c = interval_vars[inst.input1].lower[j], d = interval_vars[inst.input1].upper[j];
-                    // Handle division by zero by clamping denominator away from zero
-                    if (c <= 0.0f && d >= 0.0f) {
-                        interval_vars[i].lower[j] = -std::numeric_limits<float>::infinity();
-                        interval_vars[i].upper[j] = std::numeric_limits<float>::infinity();
-                        continue;
-                    }
-                    float p1 = a/c, p2 = a/d, p3 = b/c, p4 = b/d;
-                    interval_vars[i].lower[j] = min4(p1, p2, p3, p4);
-                    interval_vars[i].upper[j] = max4(p1, p2, p3, p4);
-                }
-                break;
-            }
-            case OpCode::Max: {
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = max2(interval_vars[inst.input0].lower[j], interval_vars[inst.input1].lower[j]);
-                    interval_vars[i].upper[j] = max2(interval_vars[inst.input0].upper[j], interval_vars[inst.input1].upper[j]);
-                }
-                break;
-            }
-            case OpCode::Min: {
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = min2(interval_vars[inst.input0].lower[j], interval_vars[inst.input1].lower[j]);
-                    interval_vars[i].upper[j] = min2(interval_vars[inst.input0].upper[j], interval_vars[inst.input1].upper[j]);
-                }
-                break;
-            }
-            case OpCode::Neg:
-                for(int j = 0; j < 4; j++) {
-                    interval_vars[i].lower[j] = -interval_vars[inst.input0].upper[j];
-                    interval_vars[i].upper[j] = -interval_vars[inst.input0].lower[j];
-                    if (interval_vars[i].lower[j] > interval_vars[i].upper[j]) std::swap(interval_vars[i].lower[j], interval_vars[i].upper[j]);
-                }
-                break;
-            case OpCode::Abs:
-                for(int j = 0; j < 4; j++) {
-                    float l = interval_vars[inst.input0].lower[j];
-                    float u = interval_vars[inst.input0].upper[j];
-                    if (l >= 0.0f) {
-                        interval_vars[i].lower[j] = l;
-                        interval_vars[i].upper[j] = u;
-                    } else if (u <= 0.0f) {
-                        interval_vars[i].lower[j] = -u;
-                        interval_vars[i].upper[j] = -l;
-                    } else {
-                        interval_vars[i].lower[j] = 0.0f;
-                        interval_vars[i].upper[j] = fmaxf(-l, u);
-                    }
-                }
-                break;
-            case OpCode::Square: {
-                for(int j = 0; j < 4; j++) {
-                    float l = interval_vars[inst.input0].lower[j];
-                    float u = interval_vars[inst.input0].upper[j];
-                    float sq_l = l*l;
-                    float sq_u = u*u;
-                    float min_val = min2(sq_l, sq_u);
-                    if (l <= 0.0f && u >= 0.0f) min_val = 0.0f;
-                    interval_vars[i].lower[j] = min_val;
-                    interval_vars[i].upper[j] = max2(sq_l, sq_u);
-                }
-                break;
-            }
-            case OpCode::Sqrt: {
-                for(int j = 0; j < 4; j++) {
-                    float a = interval_vars[inst.input0].lower[j], b = interval_vars[inst.input0].upper[j];
-                    float sqrt_a = sqrt(max2(0.0f, a));
-                    float sqrt_b = sqrt(max2(0.0f, b));
-                    interval_vars[i].lower[j] = (b < 0.0f) ? 0.0f : sqrt_a;
-                    interval_vars[i].upper[j] = (b < 0.0f) ? 0.0f : sqrt_b;
-                }
-                break;
-            }
-        }
+    assert(x_coords.size() == y_coords.size() && x_coords.size() <= static_cast<size_t>(batch_capacity));
+    const size_t n = x_coords.size();
+    // Every slot takes three rows: value, d/dx and d/dy
+    const size_t stride = batch_capacity;
+    const size_t padded_n = (n + SIMD_BATCH_ALIGNMENT - 1) / SIMD_BATCH_ALIGNMENT * SIMD_BATCH_ALIGNMENT;
+    if (gradient_vars.size() < (3 * tape.num_slots + 3) * stride) {
+        gradient_vars.resize((3 * tape.num_slots + 3) * stride);
     }
 
-    return interval_vars[num_instructions - 1];
+    // Gradients are taken in the plane z = 0
+    float* x_row = gradient_vars.data() + 3 * tape.num_slots * stride;
+    float* y_row = x_row + stride;
+    float* z_row = y_row + stride;
+    std::copy(x_coords.begin(), x_coords.end(), x_row);
+    std::copy(y_coords.begin(), y_coords.end(), y_row);
+    std::fill(x_row + n, x_row + padded_n, 0.0f);
+    std::fill(y_row + n, y_row + padded_n, 0.0f);
+    std::fill(z_row, z_row + padded_n, 0.0f);
+
+    if (!use_simd) {
+        evaluate_gradient_lanes<ScalarLanes>(tape, gradient_vars.data(), stride, padded_n);
+    }
+#if defined(HYBRID_MODELING_X86_SIMD)
+    else if (host_has_avx2()) {
+        evaluate_gradient_avx2(tape, gradient_vars.data(), stride, padded_n);
+    }
+#endif
+    else {
+        evaluate_gradient_lanes<DefaultLanes>(tape, gradient_vars.data(), stride, padded_n);
+    }
+
+    float* result = gradient_vars.data() + 3 * tape.instructions.back().output * stride;
+    return {{result, n}, {result + stride, n}, {result + 2 * stride, n}};
+}
+
+Interval4 VM::evaluate_interval4(Scratch& s, const std::vector<Instruction>& instructions, const Interval4& x, const Interval4& y, const Interval4& z) {
+    assert(s.interval_vars.size() >= instructions.size());
+    return evaluate_intervals<DefaultLanes>(s.interval_vars, instructions, x, y, z);
 }
 
-void VM::prune_instructions4(const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 4>& compacted_instructions) {
+Interval8 VM::evaluate_interval8(Scratch& s, const std::vector<Instruction>& instructions, const Interval8& x, const Interval8& y, const Interval8& z) {
+    assert(s.interval8_vars.size() >= instructions.size());
+#if defined(HYBRID_MODELING_X86_SIMD)
+    if (host_has_avx2()) {
+        return evaluate_interval8_avx2(s.interval8_vars, instructions, x, y, z);
+    }
+#endif
+    return evaluate_intervals<DefaultLanes>(s.interval8_vars, instructions, x, y, z);
+}
+
+Interval4 VM::evaluate_affine4(Scratch& s, const std::vector<Instruction>& instructions, const Interval4& x, const Interval4& y, const Interval4& z) {
+    assert(s.affine_vars.size() >= instructions.size());
+    return evaluate_affine(s.affine_vars, s.interval_vars, instructions, x, y, z);
+}
+
+Interval8 VM::evaluate_affine8(Scratch& s, const std::vector<Instruction>& instructions, const Interval8& x, const Interval8& y, const Interval8& z) {
+    assert(s.affine8_vars.size() >= instructions.size());
+    return evaluate_affine(s.affine8_vars, s.interval8_vars, instructions, x, y, z);
+}
+
+// Bounds of the values on the lanes of the last interval evaluation
+template<typename IntervalN>
+struct IntervalBounds
+{
+    const std::vector<IntervalN>& interval_vars;
+
+    float lower(int i, int j) const { return interval_vars[i].lower[j]; }
+    float upper(int i, int j) const { return interval_vars[i].upper[j]; }
+    // Whether value a is at least value b everywhere in the region of lane j
+    bool at_least(int a, int b, int j) const { return interval_vars[a].lower[j] >= interval_vars[b].upper[j]; }
+};
+
+// Bounds of the values on the lanes of the last affine evaluation. Comparing the operands
+// through the form of their difference cancels the terms both depend on.
+template<typename AffineN, typename IntervalN>
+struct AffineBounds
+{
+    const std::vector<AffineN>& affine_vars;
+    const std::vector<IntervalN>& interval_vars;
+
+    float lower(int i, int j) const { return interval_vars[i].lower[j]; }
+    float upper(int i, int j) const { return interval_vars[i].upper[j]; }
+    bool at_least(int a, int b, int j) const {
+        if (interval_vars[a].lower[j] >= interval_vars[b].upper[j]) return true;
+        return affine_sub(load_form(affine_vars[a], j), load_form(affine_vars[b], j)).lower() >= 0.0f;
+    }
+};
+
+// Computes one compacted instruction stream per lane of the interval evaluation that
+// was done last, dropping the branches of min/max that are dominated on that lane.
+//
+// Besides comparing the two operands of a min, every operand of a chain of mins is compared
+// against the upper bound of the whole chain, the threshold. An operand whose lower bound
+// exceeds it is never the minimum of the chain, so it is dropped even if its sibling does not
+// dominate it. With the balanced trees of balance_min_max this drops whole groups of far away
+// shapes at once. Max chains are handled the same way with the lower bounds.
+template<int N, typename Bounds>
+static void prune_instructions(const Bounds& bounds, std::vector<std::array<int, N>>& remap, std::vector<int>& uses, std::vector<float>& thresholds, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, N>& compacted_instructions) {
     int remap_size = static_cast<int>(instructions.size());
     assert(static_cast<size_t>(remap_size) <= remap.size());
-    assert(interval_vars.size() >= static_cast<size_t>(remap_size));
 
-    memset(remap.data(), -1, remap_size * 4 * sizeof(int));
+    memset(remap.data(), -1, remap_size * N * sizeof(int));
+
+    // A threshold only applies to an operand that is not read by anything else
+    uses.assign(remap_size, 0);
+    for (const Instruction& inst : instructions) {
+        if (inst.input0 != -1) ++uses[inst.input0];
+        if (inst.input1 != -1) ++uses[inst.input1];
+    }
+    // NaN means no threshold, fmin and fmax ignore it
+    thresholds.assign(remap_size * N, NAN);
+    auto hand_down = [&](int parent, int operand, int lane, float threshold) {
+        if (instructions[operand].op == instructions[parent].op && uses[operand] == 1) thresholds[operand * N + lane] = threshold;
+    };
 
     // Mark the final instruction as needed 
-    for(int j = 0; j < 4; j++) {
+    for(int j = 0; j < N; j++) {
         remap[remap_size - 1][j] = 1;
     }
 
     // First we do a backwards pass to determine which instructions are needed
     for (int i = remap_size - 1; i >= 0; --i) {
         const Instruction& inst = instructions[i];
-        for(int j = 0; j < 4; j++) {
+        for(int j = 0; j < N; j++) {
             if(remap[i][j] == -1) continue;
 
             if(inst.op == OpCode::Max) {
                 assert(inst.input0 < i && inst.input1 < i);
-                const float i0_lower = interval_vars[inst.input0].lower[j];
-                const float i0_upper = interval_vars[inst.input0].upper[j];
-                const float i1_lower = interval_vars[inst.input1].lower[j];
-                const float i1_upper = interval_vars[inst.input1].upper[j];
+                const float i0_upper = bounds.upper(inst.input0, j);
+                const float i1_upper = bounds.upper(inst.input1, j);
+
+                const float threshold = std::fmax(thresholds[i * N + j], bounds.lower(i, j));
 
                 // We "misuse" the remap array to store which input dominates the other one
-                if (i0_lower >= i1_upper) { remap[inst.input0][j] = 1; remap[i][j] = 0; } // i0 dominates, mark with 0
-                else if (i1_lower >= i0_upper) { remap[inst.input1][j] = 1; assert(remap[i][j] == 1); } // i1 dominates, already marked with 1
+                if (bounds.at_least(inst.input0, inst.input1, j) || i1_upper < threshold) { remap[inst.input0][j] = 1; remap[i][j] = 0; } // i0 dominates, mark with 0
+                else if (bounds.at_least(inst.input1, inst.input0, j) || i0_upper < threshold) { remap[inst.input1][j] = 1; assert(remap[i][j] == 1); } // i1 dominates, already marked with 1
                 else { remap[inst.input0][j] = 1; remap[inst.input1][j] = 1; remap[i][j] = 2; } // Overlap, mark with 2
+                if (remap[i][j] != 1) hand_down(i, inst.input0, j, threshold);
+                if (remap[i][j] != 0) hand_down(i, inst.input1, j, threshold);
             } else if(inst.op == OpCode::Min) {
                 assert(inst.input0 < i && inst.input1 < i);
-                const float i0_lower = interval_vars[inst.input0].lower[j];
-                const float i0_upper = interval_vars[inst.input0].upper[j];
-                const float i1_lower = interval_vars[inst.input1].lower[j];
-                const float i1_upper = interval_vars[inst.input1].upper[j];
+                const float i0_lower = bounds.lower(inst.input0, j);
+                const float i1_lower = bounds.lower(inst.input1, j);
+
+                const float threshold = std::fmin(thresholds[i * N + j], bounds.upper(i, j));
 
-                if (i0_upper <= i1_lower) { remap[inst.input0][j] = 1; remap[i][j] = 0; } // i0 dominates, mark with 0
-                else if (i1_upper <= i0_lower) { remap[inst.input1][j] = 1; assert(remap[i][j] == 1); } // i1 dominates, already marked with 1
+                if (bounds.at_least(inst.input1, inst.input0, j) || i1_lower > threshold) { remap[inst.input0][j] = 1; remap[i][j] = 0; } // i0 dominates, mark with 0
+                else if (bounds.at_least(inst.input0, inst.input1, j) || i0_lower > threshold) { remap[inst.input1][j] = 1; assert(remap[i][j] == 1); } // i1 dominates, already marked with 1
                 else { remap[inst.input0][j] = 1; remap[inst.input1][j] = 1; remap[i][j] = 2; } // Overlap, mark with 2
+                if (remap[i][j] != 1) hand_down(i, inst.input0, j, threshold);
+                if (remap[i][j] != 0) hand_down(i, inst.input1, j, threshold);
             } else {
                 // propagate needed instructions
                 if(inst.input0 != -1) remap[inst.input0][j] = 1;
@@ -265,14 +529,14 @@ void VM::prune_instructions4(const std::vector<Instruction>& instructions, std::
         }
     }
 
-    // Initialize the four compacted instruction streams
-    for(int j = 0; j < 4; j++) {
+    // Initialize the compacted instruction streams
+    for(int j = 0; j < N; j++) {
         compacted_instructions[j].reserve(instructions.size());
     }
 
     // Second we do a forwards pass to compact the instructions and compute the input remapping
     for (int i = 0; i < remap_size; ++i) {
-        for(int j = 0; j < 4; j++) {
+        for(int j = 0; j < N; j++) {
             Instruction inst = instructions[i];
             if(remap[i][j] == -1) continue;
 
@@ -293,93 +557,678 @@ void VM::prune_instructions4(const std::vector<Instruction>& instructions, std::
     }
 }
 
-void VM::solve_region(std::deque<Tile>& tiles, Subgrid subgrid, std::vector<Instruction> instructions) 
+// Bounds the Lipschitz constant of every instruction on every lane of the interval evaluation
+// that was done last and returns the one of the final instruction. The value ranges of the lane
+// bound the derivatives, e.g. of a square, and a min/max whose operand dominates on the lane
+// only passes that operand's constant on. Composing these rules loses the correlation between
+// the terms of a smooth union, so its bound grows with every union of a chain. Where the bound
+// the instruction carries from its node (see Scalar::bound_lipschitz) is tighter, it is used.
+//
+// The norm of the gradient of sqrt(u^2 + v^2) is at most max(|grad u|, |grad v|) if u only
+// depends on x and v only on y, as in the distance of a rectangle, so `axes` tracks which
+// variables each instruction depends on.
+template<int N, typename IntervalN>
+static std::array<float, N> lipschitz_bounds(const std::vector<IntervalN>& interval_vars, std::vector<float>& lipschitz, std::vector<uint8_t>& axes, const std::vector<Instruction>& instructions) {
+    const size_t size = instructions.size();
+    assert(interval_vars.size() >= size);
+    lipschitz.resize(size * N);
+    axes.resize(size);
+
+    auto magnitude = [&](int i, int j) { return std::max(std::abs(interval_vars[i].lower[j]), std::abs(interval_vars[i].upper[j])); };
+
+    for (size_t i = 0; i < size; ++i) {
+        const Instruction& inst = instructions[i];
+        float* l = &lipschitz[i * N];
+        const float* l0 = inst.input0 != -1 ? &lipschitz[inst.input0 * N] : nullptr;
+        const float* l1 = inst.input1 != -1 ? &lipschitz[inst.input1 * N] : nullptr;
+        axes[i] = (inst.input0 != -1 ? axes[inst.input0] : 0) | (inst.input1 != -1 ? axes[inst.input1] : 0);
+
+        for (int j = 0; j < N; ++j) {
+            switch (inst.op) {
+            case OpCode::VarX:
+                l[j] = 1.0f;
+                axes[i] = 1;
+                break;
+            case OpCode::VarY:
+                l[j] = 1.0f;
+                axes[i] = 2;
+                break;
+            case OpCode::VarZ:
+                l[j] = 1.0f;
+                axes[i] = 4;
+                break;
+            case OpCode::Const:
+            case OpCode::Param:
+                l[j] = 0.0f;
+                break;
+            case OpCode::Add:
+            case OpCode::Sub:
+                l[j] = l0[j] + l1[j];
+                break;
+            case OpCode::Mul:
+                l[j] = magnitude(inst.input1, j) * l0[j] + magnitude(inst.input0, j) * l1[j];
+                break;
+            case OpCode::Div: {
+                const float lower = interval_vars[inst.input1].lower[j];
+                const float upper = interval_vars[inst.input1].upper[j];
+                if (lower > 0.0f || upper < 0.0f) {
+                    const float m = std::min(std::abs(lower), std::abs(upper));
+                    l[j] = l0[j] / m + magnitude(inst.input0, j) * l1[j] / (m * m);
+                } else {
+                    l[j] = INFINITY;
+                }
+                break;
+            }
+            case OpCode::Max:
+            case OpCode::Min: {
+                const IntervalN& a = interval_vars[inst.input0];
+                const IntervalN& b = interval_vars[inst.input1];
+                const bool first = inst.op == OpCode::Max ? a.lower[j] >= b.upper[j] : a.upper[j] <= b.lower[j];
+                const bool second = inst.op == OpCode::Max ? b.lower[j] >= a.upper[j] : b.upper[j] <= a.lower[j];
+                l[j] = first ? l0[j] : second ? l1[j] : std::max(l0[j], l1[j]);
+                break;
+            }
+            case OpCode::Neg:
+            case OpCode::Abs:
+                l[j] = l0[j];
+                break;
+            case OpCode::Square:
+                l[j] = 2.0f * magnitude(inst.input0, j) * l0[j];
+                break;
+            case OpCode::Sqrt: {
+                const Instruction& sum = instructions[inst.input0];
+                if (sum.op == OpCode::Add && instructions[sum.input0].op == OpCode::Square && instructions[sum.input1].op == OpCode::Square) {
+                    const int u = instructions[sum.input0].input0;
+                    const int v = instructions[sum.input1].input0;
+                    const float lu = lipschitz[u * N + j];
+                    const float lv = lipschitz[v * N + j];
+                    l[j] = (axes[u] & axes[v]) == 0 ? std::max(lu, lv) : std::sqrt(lu * lu + lv * lv);
+                } else if (interval_vars[inst.input0].lower[j] > 0.0f) {
+                    l[j] = l0[j] / (2.0f * std::sqrt(interval_vars[inst.input0].lower[j]));
+                } else {
+                    l[j] = INFINITY;
+                }
+                break;
+            }
+            }
+            l[j] = std::min(l[j], inst.lipschitz);
+        }
+    }
+
+    std::array<float, N> result;
+    std::copy_n(&lipschitz[(size - 1) * N], N, result.begin());
+    return result;
+}
+
+void VM::prune_instructions4(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 4>& compacted_instructions) {
+    prune_instructions<4>(IntervalBounds<Interval4>{s.interval_vars}, s.remap, s.uses, s.thresholds, instructions, compacted_instructions);
+}
+
+void VM::prune_instructions8(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 8>& compacted_instructions) {
+    prune_instructions<8>(IntervalBounds<Interval8>{s.interval8_vars}, s.remap8, s.uses, s.thresholds, instructions, compacted_instructions);
+}
+
+void VM::prune_affine4(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 4>& compacted_instructions) {
+    prune_instructions<4>(AffineBounds<Affine4, Interval4>{s.affine_vars, s.interval_vars}, s.remap, s.uses, s.thresholds, instructions, compacted_instructions);
+}
+
+void VM::prune_affine8(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 8>& compacted_instructions) {
+    prune_instructions<8>(AffineBounds<Affine8, Interval8>{s.affine8_vars, s.interval8_vars}, s.remap8, s.uses, s.thresholds, instructions, compacted_instructions);
+}
+
+bool VM::split_pays(int num_points, size_t tape_length, int crossing_quadrants) const
+{
+    if (num_points <= MIN_TILE_SIZE) return false;
+    // The children are assumed to keep the tape, pruning them only makes splitting cheaper
+    const float length = static_cast<float>(tape_length);
+    const float sample = num_points * length + TILE_COST + INTERN_COST * length;
+    const float split = QUADRANT_BOUND_COST * length
+        + crossing_quadrants * (0.25f * num_points * length + TILE_COST + INTERN_COST * length);
+    return split < sample;
+}
+
+void VM::solve_region(std::vector<std::deque<Tile>>& thread_tiles, Subgrid subgrid, std::vector<Instruction> instructions) 
 {
-    if ((subgrid.nx + 1) * (subgrid.ny + 1) <= MAX_TILE_SIZE) 
+    if (region_filter && !(*region_filter)(subgrid)) return;
+
+    if (union_culling && !union_nodes.empty() && instructions.size() > UNION_CULL_MIN_INSTRUCTIONS) cull_union(subgrid, instructions);
+
+    if (lod_tolerance > 0.0f && solve_coarse(thread_tiles, subgrid, instructions)) return;
+
+    const int num_points = (subgrid.nx + 1) * (subgrid.ny + 1);
+    bool leaf = num_points <= (adaptive_tiles ? MAX_TILE_SIZE : FIXED_TILE_SIZE);
+    if (leaf && (leaf_culling || adaptive_tiles)) {
+        // The quadrants are bounded with the tape of the region itself, so the leaf size does
+        // not depend on shapes that were pruned above it
+        const auto [positive, negative] = quadrant_signs(subgrid, instructions);
+        if (leaf_culling && (positive == 4 || negative == 4)) {
+            local_scratch().skipped_tiles++;
+            return;
+        }
+        if (adaptive_tiles) leaf = !split_pays(num_points, instructions.size(), 4 - positive - negative);
+    }
+
+    if (leaf) 
     {
-        Interval ix = get_x_interval(subgrid);
-        Interval iy = get_y_interval(subgrid);
-        float x_range = ix.upper - ix.lower;
-        float y_range = iy.upper - iy.lower;
+        TapeRef tape = tapes->intern(std::move(instructions));
+        if (skip_sampling && skip_sampling(*tape)) {
+            if (tile_consumer) {
+                const Tile tile(subgrid, {}, std::move(tape));
+                (*tile_consumer)(tile);
+            } else {
+                thread_tiles[omp_get_thread_num()].emplace_back(subgrid, std::span<float>{}, std::move(tape));
+            }
+            return;
+        }
 
         std::array<float, MAX_TILE_SIZE> x_coords;
         std::array<float, MAX_TILE_SIZE> y_coords;
 
-        // Include boundary points
+        // Include boundary points. The coordinates are computed from the global grid indices,
+        // so a grid point gets the same coordinates in tiles of any size.
         const int num_x_points = subgrid.nx + 1;
         const int num_y_points = subgrid.ny + 1;
+        const float x_step = (domain_x_max - domain_x_min) / grid_nx;
+        const float y_step = (domain_y_max - domain_y_min) / grid_ny;
 
         for (int dy = 0; dy < num_y_points; ++dy) 
         {
-            float y = iy.lower + dy * y_range / subgrid.ny;
+            float y = domain_y_min + (subgrid.py + dy) * y_step;
             for (int dx = 0; dx < num_x_points; ++dx) 
             {
                 int idx = dy * num_x_points + dx;
-                x_coords[idx] = ix.lower + dx * x_range / subgrid.nx;
+                x_coords[idx] = domain_x_min + (subgrid.px + dx) * x_step;
                 y_coords[idx] = y;
             }
         }
 
         const size_t total_points = (size_t)num_x_points * (size_t)num_y_points;
-        std::span<float> values = evaluate_batch(instructions, {x_coords.data(), total_points}, {y_coords.data(), total_points});
-        tiles.emplace_back(subgrid, values, std::move(instructions));
+        std::span<float> values = evaluate_batch(tape->registers, {x_coords.data(), total_points}, {y_coords.data(), total_points});
+        if (tile_consumer) {
+            const Tile tile(subgrid, values, std::move(tape));
+            (*tile_consumer)(tile);
+        } else {
+            thread_tiles[omp_get_thread_num()].emplace_back(subgrid, values, std::move(tape));
+        }
 
         return;
     } 
 
-    // Integer division `subgrid.n / 2` means that if n is odd,
-    // the first half will be `(n-1)/2` and the second half will be `n - (n-1)/2 = (n+1)/2`.
-    // This ensures the entire grid is covered without overlap.
-    int nx_first_half = subgrid.nx / 2;
-    int nx_second_half = subgrid.nx - nx_first_half;
-    int ny_first_half = subgrid.ny / 2;
-    int ny_second_half = subgrid.ny - ny_first_half;
+    if (split8 && std::min(subgrid.nx, subgrid.ny) >= 2 && std::max(subgrid.nx, subgrid.ny) >= 4) {
+        if (subgrid.nx >= subgrid.ny) {
+            subdivide<4, 2>(thread_tiles, subgrid, instructions);
+        } else {
+            subdivide<2, 4>(thread_tiles, subgrid, instructions);
+        }
+    } else {
+        subdivide<2, 2>(thread_tiles, subgrid, instructions);
+    }
+}
+
+bool VM::solve_coarse(std::vector<std::deque<Tile>>& thread_tiles, const Subgrid& subgrid, std::vector<Instruction>& instructions)
+{
+    // The smallest stride that fits the longer side into the lattice
+    int stride = 1;
+    while ((std::max(subgrid.nx, subgrid.ny) + stride - 1) / stride > LOD_LATTICE_CELLS) stride *= 2;
+    if (stride == 1) return false;
+    const int lattice_nx = lattice_lines(subgrid.nx, stride);
+    const int lattice_ny = lattice_lines(subgrid.ny, stride);
+    const int lattice_points = lattice_nx * lattice_ny;
+    const int total_points = lattice_points + 2 * (subgrid.nx + 1) + 2 * (subgrid.ny + 1);
+    if (total_points > MAX_TILE_SIZE) return false;
+
+    std::array<float, MAX_TILE_SIZE> x_coords;
+    std::array<float, MAX_TILE_SIZE> y_coords;
+    const float x_step = (domain_x_max - domain_x_min) / grid_nx;
+    const float y_step = (domain_y_max - domain_y_min) / grid_ny;
+    auto add_point = [&](int idx, int dx, int dy) {
+        x_coords[idx] = domain_x_min + (subgrid.px + dx) * x_step;
+        y_coords[idx] = domain_y_min + (subgrid.py + dy) * y_step;
+    };
+    for (int j = 0; j < lattice_ny; ++j) {
+        for (int i = 0; i < lattice_nx; ++i) add_point(j * lattice_nx + i, lattice_line(i, subgrid.nx, stride), lattice_line(j, subgrid.ny, stride));
+    }
+
+    // Lipschitz bound of the tape over the tile, from the intervals of its instructions as in
+    // lipschitz_culling. It is infinite where the rules cannot bound the gradient, e.g. sqrt at
+    // zero, and then every cell counts as within reach.
+    Scratch& s = local_scratch();
+    Interval4 ix4, iy4;
+    const Interval ix = get_x_interval(subgrid);
+    const Interval iy = get_y_interval(subgrid);
+    for (int i = 0; i < 4; i++) {
+        ix4.lower[i] = ix.lower;
+        ix4.upper[i] = ix.upper;
+        iy4.lower[i] = iy.lower;
+        iy4.upper[i] = iy.upper;
+    }
+    evaluate_interval4(s, instructions, ix4, iy4, Interval4{});
+    const float lipschitz = lipschitz_bounds<4>(s.interval_vars, s.lipschitz, s.axes, instructions)[0];
+
+    // Every lattice cell within reach of the level set has to be flat enough that the contour
+    // stays within the tolerance of its chord. An arc turning by an angle a over a chord of
+    // length h leaves it by about h * a / 8.
+    const BatchGradient g = evaluate_batch_gradient(instructions, {x_coords.data(), static_cast<size_t>(lattice_points)}, {y_coords.data(), static_cast<size_t>(lattice_points)});
+    for (int j = 0; j + 1 < lattice_ny; ++j) {
+        for (int i = 0; i + 1 < lattice_nx; ++i) {
+            const int corners[4] = {j * lattice_nx + i, j * lattice_nx + i + 1, (j + 1) * lattice_nx + i, (j + 1) * lattice_nx + i + 1};
+            const float width = x_coords[corners[1]] - x_coords[corners[0]];
+            const float height = y_coords[corners[2]] - y_coords[corners[0]];
+            const float diagonal = std::hypot(width, height);
 
-    // Create subgrids for the four quadrants
-    Subgrid ll = {subgrid.px, subgrid.py, nx_first_half, ny_first_half};                       // lower left
-    Subgrid lr = {subgrid.px + nx_first_half, subgrid.py, nx_second_half, ny_first_half};           // lower right
-    Subgrid ul = {subgrid.px, subgrid.py + ny_first_half, nx_first_half, ny_second_half};           // upper left
-    Subgrid ur = {subgrid.px + nx_first_half, subgrid.py + ny_first_half, nx_second_half, ny_second_half}; // upper right
+            float nx[4], ny[4];
+            float closest = INFINITY;
+            for (int k = 0; k < 4; ++k) {
+                const int c = corners[k];
+                const float length = std::hypot(g.dx[c], g.dy[c]);
+                if (!(length > 0.0f)) return false;
+                nx[k] = g.dx[c] / length;
+                ny[k] = g.dy[c] / length;
+                closest = std::min(closest, std::abs(g.value[c]));
+            }
+            // Every point of the cell is within a diagonal of a corner, so the level set cannot
+            // reach the cell if the bound keeps all of them away from zero
+            if (closest > lipschitz * diagonal) continue;
+
+            const float turn = std::min(8.0f * lod_tolerance / diagonal, LOD_MAX_TURN);
+            const float min_cos = std::cos(turn);
+            for (int a = 0; a < 4; ++a) {
+                for (int b = a + 1; b < 4; ++b) {
+                    if (nx[a] * nx[b] + ny[a] * ny[b] < min_cos) return false;
+                }
+            }
+        }
+    }
 
-    Subgrid regions[4] = {ll, lr, ul, ur};
+    // The sides at every grid point, lower and upper first
+    int idx = lattice_points;
+    for (int dx = 0; dx <= subgrid.nx; ++dx) add_point(idx++, dx, 0);
+    for (int dx = 0; dx <= subgrid.nx; ++dx) add_point(idx++, dx, subgrid.ny);
+    for (int dy = 0; dy <= subgrid.ny; ++dy) add_point(idx++, 0, dy);
+    for (int dy = 0; dy <= subgrid.ny; ++dy) add_point(idx++, subgrid.nx, dy);
 
-    // Create intervals for the four quadrants
+    // The lattice is sampled again with the interned tape, so that the points it shares with the
+    // sides get the same values
+    TapeRef tape = tapes->intern(std::move(instructions));
+    std::span<float> values = evaluate_batch(tape->registers, {x_coords.data(), static_cast<size_t>(total_points)}, {y_coords.data(), static_cast<size_t>(total_points)});
+    if (tile_consumer) {
+        const Tile tile(subgrid, values, std::move(tape), stride);
+        (*tile_consumer)(tile);
+    } else {
+        thread_tiles[omp_get_thread_num()].emplace_back(subgrid, values, std::move(tape), stride);
+    }
+    return true;
+}
+
+std::pair<int, int> VM::quadrant_signs(const Subgrid& subgrid, const std::vector<Instruction>& instructions)
+{
+    // The quadrants are the lanes of one evaluation. They overlap on their shared sides, and the
+    // left or lower half of a single cell is just its side.
     Interval4 ix4, iy4;
     for (int i = 0; i < 4; i++) {
-        Interval ix = get_x_interval(regions[i]);
-        Interval iy = get_y_interval(regions[i]);
+        const int x0 = subgrid.nx * (i % 2) / 2;
+        const int x1 = subgrid.nx * (i % 2 + 1) / 2;
+        const int y0 = subgrid.ny * (i / 2) / 2;
+        const int y1 = subgrid.ny * (i / 2 + 1) / 2;
+        const Subgrid quadrant{subgrid.px + x0, subgrid.py + y0, x1 - x0, y1 - y0};
+        Interval ix = get_x_interval(quadrant);
+        Interval iy = get_y_interval(quadrant);
         ix4.lower[i] = ix.lower;
         ix4.upper[i] = ix.upper;
         iy4.lower[i] = iy.lower;
         iy4.upper[i] = iy.upper;
     }
+    const Interval4 iz4{};
 
-    Interval4 ir4 = evaluate_interval4(instructions, ix4, iy4);
-    std::array<std::vector<Instruction>, 4> compacted_instructions;
-    prune_instructions4(instructions, compacted_instructions);
+    Scratch& s = local_scratch();
+    const Interval4 bounds = affine ? evaluate_affine4(s, instructions, ix4, iy4, iz4) : evaluate_interval4(s, instructions, ix4, iy4, iz4);
+    Interval4 centers = bounds;
+    std::array<float, 4> reach{};
+    if (lipschitz_culling) {
+        // As in subdivide, the value at the center bounds the quadrant up to its half diagonal
+        std::array<float, 4> lipschitz = lipschitz_bounds<4>(s.interval_vars, s.lipschitz, s.axes, instructions);
+        Interval4 cx4, cy4;
+        for (int i = 0; i < 4; i++) {
+            cx4.lower[i] = cx4.upper[i] = 0.5f * (ix4.lower[i] + ix4.upper[i]);
+            cy4.lower[i] = cy4.upper[i] = 0.5f * (iy4.lower[i] + iy4.upper[i]);
+            reach[i] = lipschitz[i] * 0.5f * std::hypot(ix4.upper[i] - ix4.lower[i], iy4.upper[i] - iy4.lower[i]);
+        }
+        centers = evaluate_interval4(s, instructions, cx4, cy4, iz4);
+    }
+
+    int positive = 0;
+    int negative = 0;
+    for (int i = 0; i < 4; i++) {
+        if (bounds.lower[i] > 0.0f || centers.lower[i] > reach[i]) {
+            positive++;
+        } else if (bounds.upper[i] < 0.0f || centers.upper[i] < -reach[i]) {
+            negative++;
+        }
+    }
+    return {positive, negative};
+}
+
+template<int NX, int NY>
+void VM::subdivide(std::vector<std::deque<Tile>>& thread_tiles, Subgrid subgrid, const std::vector<Instruction>& instructions)
+{
+    constexpr int N = NX * NY;
+    static_assert(N == 4 || N == 8);
+    using IntervalN = std::conditional_t<N == 4, Interval4, Interval8>;
 
-    for(size_t i = 0; i < 4; i++) 
+    // The children are ordered row by row starting at the lower left corner. Integer division
+    // means that if n is odd, e.g. for two parts the first half will be `(n-1)/2` and the
+    // second half will be `n - (n-1)/2 = (n+1)/2`. This ensures the entire grid is covered
+    // without overlap.
+    std::array<Subgrid, N> regions;
+    IntervalN ixn, iyn;
+    for (int cy = 0; cy < NY; cy++) {
+        const int y0 = subgrid.ny * cy / NY;
+        const int y1 = subgrid.ny * (cy + 1) / NY;
+        for (int cx = 0; cx < NX; cx++) {
+            const int x0 = subgrid.nx * cx / NX;
+            const int x1 = subgrid.nx * (cx + 1) / NX;
+            const int i = cy * NX + cx;
+            regions[i] = {subgrid.px + x0, subgrid.py + y0, x1 - x0, y1 - y0};
+
+            Interval ix = get_x_interval(regions[i]);
+            Interval iy = get_y_interval(regions[i]);
+            ixn.lower[i] = ix.lower;
+            ixn.upper[i] = ix.upper;
+            iyn.lower[i] = iy.lower;
+            iyn.upper[i] = iy.upper;
+        }
+    }
+
+    // The quadtree evaluates the plane z = 0
+    const IntervalN izn{};
+
+    // The scratch buffers are only used up to this point, afterwards the thread
+    // is free to pick up other tasks which may reuse them.
+    Scratch& s = local_scratch();
+    IntervalN irn;
+    std::array<std::vector<Instruction>, N> compacted_instructions;
+    if constexpr (N == 4) {
+        if (affine) {
+            irn = evaluate_affine4(s, instructions, ixn, iyn, izn);
+            prune_affine4(s, instructions, compacted_instructions);
+        } else {
+            irn = evaluate_interval4(s, instructions, ixn, iyn, izn);
+            prune_instructions4(s, instructions, compacted_instructions);
+        }
+    } else {
+        if (affine) {
+            irn = evaluate_affine8(s, instructions, ixn, iyn, izn);
+            prune_affine8(s, instructions, compacted_instructions);
+        } else {
+            irn = evaluate_interval8(s, instructions, ixn, iyn, izn);
+            prune_instructions8(s, instructions, compacted_instructions);
+        }
+    }
+
+    // A child whose center value is farther away from zero than the Lipschitz bound allows
+    // within its half diagonal cannot contain the zero level set either. The centers are
+    // evaluated as degenerate intervals, which overwrites the intervals of the children.
+    std::array<bool, N> lipschitz_empty{};
+    if (lipschitz_culling) {
+        IntervalN cxn, cyn;
+        std::array<float, N> lipschitz;
+        if constexpr (N == 4) {
+            lipschitz = lipschitz_bounds<4>(s.interval_vars, s.lipschitz, s.axes, instructions);
+        } else {
+            lipschitz = lipschitz_bounds<8>(s.interval8_vars, s.lipschitz, s.axes, instructions);
+        }
+        for (int i = 0; i < N; i++) {
+            cxn.lower[i] = cxn.upper[i] = 0.5f * (ixn.lower[i] + ixn.upper[i]);
+            cyn.lower[i] = cyn.upper[i] = 0.5f * (iyn.lower[i] + iyn.upper[i]);
+        }
+        IntervalN centers;
+        if constexpr (N == 4) {
+            centers = evaluate_interval4(s, instructions, cxn, cyn, izn);
+        } else {
+            centers = evaluate_interval8(s, instructions, cxn, cyn, izn);
+        }
+        for (int i = 0; i < N; i++) {
+            const float reach = lipschitz[i] * 0.5f * std::hypot(ixn.upper[i] - ixn.lower[i], iyn.upper[i] - iyn.lower[i]);
+            lipschitz_empty[i] = centers.lower[i] > reach || centers.upper[i] < -reach;
+        }
+    }
+
+    const bool spawn_tasks = subgrid.nx * subgrid.ny >= MIN_TASK_CELLS;
+
+    for(size_t i = 0; i < N; i++) 
     {
-        float lower = ir4.lower[i];
-        float upper = ir4.upper[i];
+        float lower = irn.lower[i];
+        float upper = irn.upper[i];
         if (upper < 0.0f)
             continue;
         if (lower > 0.0f) 
             continue;
+        if (lipschitz_empty[i])
+            continue;
+
+        // Pruning replaces dominated branches by constants, which lets whole subexpressions
+        // fold away, e.g. the blend term of a smooth union far away from the other shape.
+        // Children nothing was pruned from keep the already optimized instructions.
+        const bool pruned = compacted_instructions[i].size() < instructions.size();
+        if (spawn_tasks) {
+            #pragma omp task default(shared) firstprivate(i, pruned)
+            {
+                if (pruned) optimize_instructions(compacted_instructions[i]);
+                solve_region(thread_tiles, regions[i], std::move(compacted_instructions[i]));
+            }
+        } else {
+            if (pruned) optimize_instructions(compacted_instructions[i]);
+            solve_region(thread_tiles, regions[i], std::move(compacted_instructions[i]));
+        }
+    }
 
-        solve_region(tiles, regions[i], std::move(compacted_instructions[i]));
+    // compacted_instructions has to outlive the tasks that consume it
+    if (spawn_tasks) {
+        #pragma omp taskwait
     }
 }
 
 void VM::evaluate(std::deque<Tile>& tiles, Subgrid grid) 
+{
+    evaluate(tiles, grid, {});
+}
+
+void VM::evaluate(std::deque<Tile>& tiles, Subgrid grid, const std::function<bool(const Subgrid&)>& filter)
 {
     // Store grid dimensions for interval calculations
     grid_nx = grid.nx;
     grid_ny = grid.ny;
-    solve_region(tiles, grid, original_instructions);
+    solve_grid(tiles, grid, filter);
+}
+
+void VM::evaluate_window(std::deque<Tile>& tiles, Subgrid window, int nx, int ny)
+{
+    assert(window.px >= 0 && window.py >= 0 && window.px + window.nx <= nx && window.py + window.ny <= ny);
+    grid_nx = nx;
+    grid_ny = ny;
+    solve_grid(tiles, window, {});
+}
+
+void VM::solve_grid(std::deque<Tile>& tiles, Subgrid grid, const std::function<bool(const Subgrid&)>& filter)
+{
+    region_filter = filter ? &filter : nullptr;
+
+    const int num_threads = parallel ? omp_get_max_threads() : 1;
+    if (scratch.size() < static_cast<size_t>(num_threads)) {
+        scratch.resize(num_threads);
+    }
+    for (Scratch& s : scratch) s.skipped_tiles = 0;
+
+    // Every thread collects its tiles separately, they are merged once the quadtree is solved
+    std::vector<std::deque<Tile>> thread_tiles(num_threads);
+
+    #pragma omp parallel num_threads(num_threads)
+    #pragma omp single
+    solve_region(thread_tiles, grid, original_instructions);
+    region_filter = nullptr;
+
+    skipped_tiles = 0;
+    for (const Scratch& s : scratch) skipped_tiles += s.skipped_tiles;
+
+    const size_t first_new_tile = tiles.size();
+    for (std::deque<Tile>& local_tiles : thread_tiles) {
+        std::move(local_tiles.begin(), local_tiles.end(), std::back_inserter(tiles));
+    }
+
+    std::sort(tiles.begin() + first_new_tile, tiles.end(), [](const Tile& a, const Tile& b) {
+        return a.subgrid.py != b.subgrid.py ? a.subgrid.py < b.subgrid.py : a.subgrid.px < b.subgrid.px;
+    });
+}
+
+void VM::evaluate(Subgrid grid, const std::function<void(const Tile&)>& consumer)
+{
+    std::deque<Tile> tiles;
+    tile_consumer = &consumer;
+    evaluate(tiles, grid, {});
+    tile_consumer = nullptr;
+}
+
+void VM::solve_region3(std::vector<std::deque<Tile3>>& thread_tiles, Subgrid3 subgrid, std::vector<Instruction> instructions)
+{
+    const int num_x_points = subgrid.nx + 1;
+    const int num_y_points = subgrid.ny + 1;
+    const int num_z_points = subgrid.nz + 1;
+    if (num_x_points * num_y_points * num_z_points > FIXED_TILE_SIZE) {
+        subdivide3(thread_tiles, subgrid, instructions);
+        return;
+    }
+
+    // The coordinates are computed from the global grid indices, so the points on the faces
+    // shared by neighbouring tiles get exactly the same values in both
+    const float x_step = (domain_x_max - domain_x_min) / grid_nx;
+    const float y_step = (domain_y_max - domain_y_min) / grid_ny;
+    const float z_step = (domain_z_max - domain_z_min) / grid_nz;
+
+    std::array<float, FIXED_TILE_SIZE> x_coords;
+    std::array<float, FIXED_TILE_SIZE> y_coords;
+    std::array<float, FIXED_TILE_SIZE> z_coords;
+    int idx = 0;
+    for (int dz = 0; dz < num_z_points; ++dz) {
+        const float z = domain_z_min + (subgrid.pz + dz) * z_step;
+        for (int dy = 0; dy < num_y_points; ++dy) {
+            const float y = domain_y_min + (subgrid.py + dy) * y_step;
+            for (int dx = 0; dx < num_x_points; ++dx) {
+                x_coords[idx] = domain_x_min + (subgrid.px + dx) * x_step;
+                y_coords[idx] = y;
+                z_coords[idx] = z;
+                ++idx;
+            }
+        }
+    }
+
+    const size_t total_points = idx;
+    TapeRef tape = tapes->intern(std::move(instructions));
+    std::span<float> values = evaluate_batch(tape->registers, {x_coords.data(), total_points}, {y_coords.data(), total_points}, {z_coords.data(), total_points});
+    thread_tiles[omp_get_thread_num()].emplace_back(subgrid, values, std::move(tape));
+}
+
+void VM::subdivide3(std::vector<std::deque<Tile3>>& thread_tiles, Subgrid3 subgrid, const std::vector<Instruction>& instructions)
+{
+    // Children are ordered with x varying fastest, an odd number of cells is split like in
+    // subdivide
+    const int sx = subgrid.nx > 1 ? 2 : 1;
+    const int sy = subgrid.ny > 1 ? 2 : 1;
+    const int sz = subgrid.nz > 1 ? 2 : 1;
+    std::array<Subgrid3, 8> regions;
+    Interval8 ixn, iyn, izn;
+    int count = 0;
+    for (int cz = 0; cz < sz; cz++) {
+        const int z0 = subgrid.nz * cz / sz;
+        const int z1 = subgrid.nz * (cz + 1) / sz;
+        for (int cy = 0; cy < sy; cy++) {
+            const int y0 = subgrid.ny * cy / sy;
+            const int y1 = subgrid.ny * (cy + 1) / sy;
+            for (int cx = 0; cx < sx; cx++) {
+                const int x0 = subgrid.nx * cx / sx;
+                const int x1 = subgrid.nx * (cx + 1) / sx;
+                regions[count] = {subgrid.px + x0, subgrid.py + y0, subgrid.pz + z0, x1 - x0, y1 - y0, z1 - z0};
+                count++;
+            }
+        }
+    }
+    // Lanes without a child repeat the first one
+    for (int i = 0; i < 8; i++) {
+        const Subgrid3& region = regions[i < count ? i : 0];
+        const Interval ix = get_x_interval(region);
+        const Interval iy = get_y_interval(region);
+        const Interval iz = get_z_interval(region);
+        ixn.lower[i] = ix.lower;
+        ixn.upper[i] = ix.upper;
+        iyn.lower[i] = iy.lower;
+        iyn.upper[i] = iy.upper;
+        izn.lower[i] = iz.lower;
+        izn.upper[i] = iz.upper;
+    }
+
+    // As in subdivide, the scratch buffers are free again once the children are pruned
+    Scratch& s = local_scratch();
+    std::array<std::vector<Instruction>, 8> compacted_instructions;
+    const Interval8 irn = evaluate_interval8(s, instructions, ixn, iyn, izn);
+    prune_instructions8(s, instructions, compacted_instructions);
+
+    const bool spawn_tasks = static_cast<int64_t>(subgrid.nx) * subgrid.ny * subgrid.nz >= MIN_TASK_CELLS;
+
+    for (int i = 0; i < count; i++) {
+        if (irn.upper[i] < 0.0f || irn.lower[i] > 0.0f) continue;
+
+        const bool pruned = compacted_instructions[i].size() < instructions.size();
+        if (spawn_tasks) {
+            #pragma omp task default(shared) firstprivate(i, pruned)
+            {
+                if (pruned) optimize_instructions(compacted_instructions[i]);
+                solve_region3(thread_tiles, regions[i], std::move(compacted_instructions[i]));
+            }
+        } else {
+            if (pruned) optimize_instructions(compacted_instructions[i]);
+            solve_region3(thread_tiles, regions[i], std::move(compacted_instructions[i]));
+        }
+    }
+
+    // compacted_instructions has to outlive the tasks that consume it
+    if (spawn_tasks) {
+        #pragma omp taskwait
+    }
+}
+
+void VM::evaluate(std::deque<Tile3>& tiles, Subgrid3 grid)
+{
+    grid_nx = grid.nx;
+    grid_ny = grid.ny;
+    grid_nz = grid.nz;
+
+    const int num_threads = parallel ? omp_get_max_threads() : 1;
+    if (scratch.size() < static_cast<size_t>(num_threads)) {
+        scratch.resize(num_threads);
+    }
+
+    std::vector<std::deque<Tile3>> thread_tiles(num_threads);
+
+    #pragma omp parallel num_threads(num_threads)
+    #pragma omp single
+    solve_region3(thread_tiles, grid, original_instructions);
+
+    const size_t first_new_tile = tiles.size();
+    for (std::deque<Tile3>& local_tiles : thread_tiles) {
+        std::move(local_tiles.begin(), local_tiles.end(), std::back_inserter(tiles));
+    }
+
+    std::sort(tiles.begin() + first_new_tile, tiles.end(), [](const Tile3& a, const Tile3& b) {
+        if (a.subgrid.pz != b.subgrid.pz) return a.subgrid.pz < b.subgrid.pz;
+        return a.subgrid.py != b.subgrid.py ? a.subgrid.py < b.subgrid.py : a.subgrid.px < b.subgrid.px;
+    });
+}
+
+std::array<float, 3> VM::evaluate_gradient(float x, float y) {
+    BatchGradient results = evaluate_batch_gradient(original_tape, {&x, 1}, {&y, 1});
+    return {results.value[0], results.dx[0], results.dy[0]};
 }
 
 float VM::evaluate(float x, float y) {
-    std::span<float> results = evaluate_batch(original_instructions, {&x, 1}, {&y, 1});
+    std::span<float> results = evaluate_batch(original_tape, {&x, 1}, {&y, 1});
     return results[0];
 }
\ No newline at end of file
@@ -1,12 +1,53 @@
 #pragma once
 
 #include "compiler.h"
+#include "jit.h"
+#include "tape.h"
 
 #include <vector>
+#include <array>
 #include <span>
 #include <deque>
+#include <memory>
+#include <functional>
+#include <cstring>
+#include <utility>
+#include <algorithm>
 
-constexpr int MAX_TILE_SIZE = 256;
+// Largest number of points of a leaf tile. The quadtree chooses the leaf size of every region
+// up to this from the cost of sampling it, see VM::adaptive_tiles.
+constexpr int MAX_TILE_SIZE = 1024;
+
+// Regions with at most this many points are never split by the cost model
+constexpr int MIN_TILE_SIZE = 64;
+
+// Leaf size of the quadtree without adaptive tile sizing and of the octree
+constexpr int FIXED_TILE_SIZE = 256;
+
+// Costs of the adaptive tile model, in evaluations of one instruction at one point: bounding
+// the quadrants of a region and interning a tape, both per instruction, and the fixed cost of
+// a tile
+constexpr float QUADRANT_BOUND_COST = 8.0f;
+constexpr float INTERN_COST = 4.0f;
+constexpr float TILE_COST = 128.0f;
+
+// Cells of the lattice of a coarse leaf tile along its longer side, see VM::lod_tolerance
+constexpr int LOD_LATTICE_CELLS = 8;
+
+// Largest angle in radians the normals of a coarse lattice cell near the level set may differ
+// by, whatever the tolerance. Features smaller than a cell turn the normals further.
+constexpr float LOD_MAX_TURN = 0.5f;
+
+// Batch rows are padded to a multiple of the widest vector (16 floats for AVX-512)
+constexpr int SIMD_BATCH_ALIGNMENT = 16;
+
+// Regions whose tape is longer than this are first rebuilt from the shapes of the union near
+// them, see VM::union_culling
+constexpr size_t UNION_CULL_MIN_INSTRUCTIONS = 256;
+
+// Regions with at least this many cells are handed to separate OpenMP tasks,
+// smaller ones are solved recursively on the thread that reached them.
+constexpr int MIN_TASK_CELLS = 64 * 64;
 
 // A subgrid is a rectangular set of grid vertices. It is defined by its lower left corner
 // and the number of vertices in the x and y directions. Note that the subgrid includes
@@ -19,17 +60,76 @@ struct Subgrid
     int nx, ny;
 };
 
+// Values of a tile in a block of a per-thread pool. Blocks are rounded up to a power of two
+// and freed blocks are kept for later tiles of the same class, so solving the quadtree again
+// mostly reuses the blocks of the last tiles.
+class TileValues {
+public:
+    TileValues() = default;
+    explicit TileValues(std::span<const float> values);
+    TileValues(const TileValues& other) : TileValues(std::span<const float>(other.data(), other.size())) {}
+    TileValues(TileValues&& other) noexcept : block(std::exchange(other.block, nullptr)), count(std::exchange(other.count, 0)) {}
+    TileValues& operator=(TileValues other) noexcept {
+        std::swap(block, other.block);
+        std::swap(count, other.count);
+        return *this;
+    }
+    ~TileValues();
+
+    float& operator[](size_t i) { return block[i]; }
+    float operator[](size_t i) const { return block[i]; }
+    float* data() { return block; }
+    const float* data() const { return block; }
+    size_t size() const { return count; }
+
+private:
+    float* block = nullptr;
+    uint32_t count = 0;
+};
+
 struct Tile {
-    Tile(Subgrid subgrid, std::span<float> values, std::vector<Instruction> instructions) : 
+    Tile(Subgrid subgrid, std::span<float> values, TapeRef tape, int stride = 1) : 
         subgrid(subgrid),  
-        instructions(std::move(instructions)) 
-    {
-        memcpy(this->values, values.data(), values.size() * sizeof(float));
-    }
+        values(values),
+        tape(std::move(tape)),
+        stride(stride)
+    {}
     Subgrid subgrid;
     // values are stored in row-major order
-    float values[MAX_TILE_SIZE];
-    std::vector<Instruction> instructions;
+    TileValues values;
+    // Pruned instructions of the tile, shared with all tiles that have the same ones
+    TapeRef tape;
+    // Coarse tiles only sample every stride-th grid line inside, see VM::lod_tolerance. Their
+    // values are the lattice of the lines at multiples of stride and at the far sides, followed
+    // by every grid point of the lower, upper, left and right side.
+    int stride = 1;
+};
+
+// Number of lattice lines of a tile side with n cells, see Tile::stride
+inline int lattice_lines(int n, int stride) { return (n + stride - 1) / stride + 1; }
+
+// Local grid line of lattice line k of a tile side with n cells
+inline int lattice_line(int k, int n, int stride) { return std::min(k * stride, n); }
+
+// Subgrid of a 3D grid, like Subgrid it includes the grid points nx, ny, nz units away from
+// its lower corner
+struct Subgrid3
+{
+    int px, py, pz;
+    int nx, ny, nz;
+};
+
+// Leaf of the octree, see Tile
+struct Tile3 {
+    Tile3(Subgrid3 subgrid, std::span<float> values, TapeRef tape) :
+        subgrid(subgrid),
+        values(values),
+        tape(std::move(tape))
+    {}
+    Subgrid3 subgrid;
+    // values are stored with x varying fastest, then y, then z
+    TileValues values;
+    TapeRef tape;
 };
 
 struct Interval 
@@ -43,31 +143,227 @@ struct Interval4
     alignas(16) float upper[4]; 
 };
 
+struct Interval8 
+{ 
+    alignas(32) float lower[8]; 
+    alignas(32) float upper[8]; 
+};
+
+// Affine forms center + x * ex + y * ey + error * ee of the lanes of an affine evaluation, see
+// affine_kernels.h. ex and ey range over [-1, 1] across the region of the lane, ee stands for
+// the approximation errors.
+struct Affine4
+{
+    alignas(16) float center[4];
+    alignas(16) float x[4];
+    alignas(16) float y[4];
+    alignas(16) float error[4];
+};
+
+struct Affine8
+{
+    alignas(32) float center[8];
+    alignas(32) float x[8];
+    alignas(32) float y[8];
+    alignas(32) float error[8];
+};
+
+// Values and partial derivatives of a batch evaluation
+struct BatchGradient
+{
+    std::span<float> value;
+    std::span<float> dx;
+    std::span<float> dy;
+};
+
+// Scratch buffers used while evaluating a tape. Every OpenMP thread owns one so that
+// quadtree regions can be solved concurrently.
+struct Scratch
+{
+    RegisterTape tape;
+    std::vector<float> batch_vars;
+    std::vector<float> gradient_vars;
+    std::vector<float> jit_slots;
+    std::vector<Interval4> interval_vars;
+    std::vector<std::array<int, 4>> remap;
+    std::vector<Interval8> interval8_vars;
+    std::vector<std::array<int, 8>> remap8;
+    std::vector<Affine4> affine_vars;
+    std::vector<Affine8> affine8_vars;
+    // Use counts and the thresholds of min/max chains while pruning
+    std::vector<int> uses;
+    std::vector<float> thresholds;
+    // Lipschitz bounds per instruction and lane and the variables each instruction depends on
+    std::vector<float> lipschitz;
+    std::vector<uint8_t> axes;
+    // Instructions reached from the kept shapes of a union, their marks and new indices, and
+    // the stack of the hierarchy walks, see VM::cull_union
+    std::vector<int> union_order;
+    std::vector<uint32_t> union_marks;
+    uint32_t union_generation = 0;
+    std::vector<int> union_remap;
+    std::vector<int> union_roots;
+    std::vector<int> union_stack;
+    // Leaf tiles skipped by this thread in the running evaluation
+    size_t skipped_tiles = 0;
+};
+
 struct VM
 {
     VM(const Scalar& implicit);
     VM(const std::vector<Instruction>& instructions);
 
+    // Program the VM evaluates. For programs with Param instructions these are the compiled
+    // instructions with the bound parameter values substituted and folded.
     std::vector<Instruction> original_instructions;
+    RegisterTape original_tape;
+
+    // Binds new values to the parameters of the program and rebuilds original_instructions
+    // from the compiled instructions, without compiling the SDF again. Must not be called
+    // while the VM is evaluating.
+    void set_parameters(std::span<const float> values);
+
+    size_t num_parameters() const { return parameters.size(); }
+
+    // Solve the quadtree on all OpenMP threads. The resulting tiles are sorted by
+    // their position, so the output does not depend on the number of threads.
+    bool parallel = true;
+
+    // Split regions into 4x2 (or 2x4) children instead of quadrants. The eight child
+    // intervals are evaluated in one pass, with AVX2 when the host supports it.
+    bool split8 = false;
+
+    // Additionally skip the children of a region whose value at the center is too far away from
+    // zero for the level set to reach the region, given a bound on the Lipschitz constant of the
+    // instructions on the region. Intervals get loose through the divisions and square roots
+    // of smooth unions, the bound stays close to the one of the blended shapes.
+    bool lipschitz_culling = false;
+
+    // Bound the regions with affine arithmetic instead of intervals. The forms keep track of
+    // how values depend on the position, so e.g. the distance of a disk or the difference of
+    // the operands of a smooth union are bounded more tightly, and a min/max operand is
+    // dropped when the bound of the difference of both operands shows it is dominated.
+    bool affine = false;
+
+    // Before sampling a leaf tile, bound its quadrants with the pruned instructions of the tile
+    // (and with the Lipschitz bound or affine forms when enabled) and skip the tile if all of
+    // them have the same sign. The bound of the whole tile was taken with the instructions of
+    // its parent, which often is not tight enough to cull it.
+    bool leaf_culling = true;
+
+    // Before bounding a region with a long tape, rebuild the tape from the operands of the
+    // top-level union that can hold its minimum on the region. Shapes with exact distance SDFs
+    // (IShape::exact_distance) are found in a hierarchy of their bounds: a shape whose bounds
+    // are farther from the region than the center of another shape's bounds is dropped, since
+    // that shape's value is at most the distance to its center. Other operands are always
+    // kept. The bounds are taken from the shapes whenever the program is built or parameters
+    // are bound, so the shapes must match the program then.
+    bool union_culling = true;
+
+    // Choose the leaf size of every region with up to MAX_TILE_SIZE points from a cost model.
+    // Sampling costs the number of points times the length of the pruned tape. Splitting costs
+    // bounding the quadrants, and then only the quadrants whose bounds contain zero are sampled,
+    // each as a tile of its own. Regions with long tapes are thus split as long as that culls
+    // quadrants, and regions with tapes of a few instructions become large leaves since the
+    // cost of a tile dominates. Otherwise every leaf has FIXED_TILE_SIZE points at most.
+    bool adaptive_tiles = false;
+
+    // Level of detail contouring: the largest distance, in domain units, by which the contour
+    // may leave the chords between crossings of coarse tiles. With a positive tolerance every
+    // region of up to LOD_LATTICE_CELLS lattice cells of a stride of two or more grid cells is
+    // first sampled on that lattice with gradients. If the normals of every lattice cell near
+    // the level set turn little enough for the tolerance, the region becomes a coarse leaf,
+    // otherwise it is split as usual and its children try half the stride. The sides of coarse
+    // tiles are sampled at every grid point, so they share their crossings with neighbouring
+    // tiles of any stride and the contour has no cracks.
+    float lod_tolerance = 0.0f;
+
+    // Leaf tiles whose pruned tape this returns true for are not sampled and have no values,
+    // e.g. the ones implicit_to_mesh_hybrid meshes from the exact shapes. It is called on the
+    // thread that reached the tile.
+    std::function<bool(const Tape&)> skip_sampling;
+
+    // Number of leaf tiles the last 2D evaluation skipped, see leaf_culling
+    size_t skipped_tiles = 0;
 
     void evaluate(std::deque<Tile>& tiles, Subgrid grid);
 
+    // Only solves the regions of the grid for which `filter` returns true. The subdivision only
+    // depends on the grid and the pruned tapes, so where the SDF did not change the tiles are
+    // the same a full evaluation produces there.
+    void evaluate(std::deque<Tile>& tiles, Subgrid grid, const std::function<bool(const Subgrid&)>& filter);
+
+    // Streams the tiles to `consumer` instead of collecting them. It is called on the thread that
+    // solved a tile as soon as its values are known, so with parallel evaluation it runs
+    // concurrently and the tiles arrive in no particular order.
+    void evaluate(Subgrid grid, const std::function<void(const Tile&)>& consumer);
+
+    // Only solves `window` of a grid with grid_nx x grid_ny cells over the domain. The tiles keep
+    // the indices of the whole grid, so the windows of one grid sample the same points whichever
+    // VM solves them and fit together without a seam.
+    void evaluate_window(std::deque<Tile>& tiles, Subgrid window, int grid_nx, int grid_ny);
+
     float evaluate(float x, float y);
 
+    // Solves the octree of a 3D grid over the domain box, like the quadtree of the 2D
+    // evaluation the regions are pruned on all OpenMP threads and the tiles are sorted by
+    // their position. Regions are only culled with intervals, lipschitz_culling and affine
+    // are ignored.
+    void evaluate(std::deque<Tile3>& tiles, Subgrid3 grid);
+
+    // Allocates registers for the instructions and evaluates them on a batch of points
     std::span<float> evaluate_batch(const std::vector<Instruction>& instructions, std::span<float> x_coords, std::span<float> y_coords);
 
+    std::span<float> evaluate_batch(const RegisterTape& tape, std::span<float> x_coords, std::span<float> y_coords);
+
+    // Evaluates at 3D points, the other overloads evaluate the plane z = 0
+    std::span<float> evaluate_batch(const RegisterTape& tape, std::span<float> x_coords, std::span<float> y_coords, std::span<float> z_coords);
+
+    // Forward mode automatic differentiation, evaluates the value and gradient of the
+    // instructions (e.g. the pruned tape of a tile) on a batch of points
+    BatchGradient evaluate_batch_gradient(const std::vector<Instruction>& instructions, std::span<float> x_coords, std::span<float> y_coords);
+
+    BatchGradient evaluate_batch_gradient(const RegisterTape& tape, std::span<float> x_coords, std::span<float> y_coords);
+
+    // Returns the value and the partial derivatives in x and y
+    std::array<float, 3> evaluate_gradient(float x, float y);
+
+    // The slot buffers grow on demand to (num_slots + 3) * batch_capacity floats,
+    // the three extra rows hold the x, y and z coordinates
     void set_batch_size(int size) {
-        batch_capacity = size;
-        batch_vars.resize(batch_capacity * original_instructions.size());
+        batch_capacity = (size + SIMD_BATCH_ALIGNMENT - 1) / SIMD_BATCH_ALIGNMENT * SIMD_BATCH_ALIGNMENT;
+    }
+
+    // Use the widest batch kernel the host supports, otherwise the scalar one
+    bool use_simd = true;
+
+    // Evaluate batches with native code compiled from the tapes, see JitCache. The cache
+    // can be shared between VMs, e.g. to keep the compiled tapes across remeshing.
+    std::shared_ptr<JitCache> jit;
+
+    // Interns the pruned tapes of the tiles. Like the JIT cache it can be shared between VMs,
+    // tape ids then stay the same across evaluations.
+    std::shared_ptr<TapeInterner> tapes = std::make_shared<TapeInterner>();
+
+    // Box the grid of an evaluation spans, it can be changed between evaluations
+    float domain_x_min = -1.0f;
+    float domain_x_max = 1.0f;
+    float domain_y_min = -1.0f;
+    float domain_y_max = 1.0f;
+    float domain_z_min = -1.0f;
+    float domain_z_max = 1.0f;
+
+    void set_domain(const Bounds& bounds) {
+        domain_x_min = bounds.x_min;
+        domain_x_max = bounds.x_max;
+        domain_y_min = bounds.y_min;
+        domain_y_max = bounds.y_max;
     }
 
-    // Domain information
-    const float domain_x_min = -1.0f;
-    const float domain_x_max = 1.0f;
-    const float domain_y_min = -1.0f;
-    const float domain_y_max = 1.0f;
+    // Number of cells of the grid over the domain, set by every evaluation
     int grid_nx = -1;
     int grid_ny = -1;
+    int grid_nz = -1;
 
     // Helper to compute intervals for a subgrid
     Interval get_x_interval(const Subgrid& subgrid) const {
@@ -88,15 +384,106 @@ struct VM
         };
     }
 
+    Interval get_x_interval(const Subgrid3& subgrid) const {
+        return get_x_interval(Subgrid{subgrid.px, subgrid.py, subgrid.nx, subgrid.ny});
+    }
+
+    Interval get_y_interval(const Subgrid3& subgrid) const {
+        return get_y_interval(Subgrid{subgrid.px, subgrid.py, subgrid.nx, subgrid.ny});
+    }
+
+    Interval get_z_interval(const Subgrid3& subgrid) const {
+        float z_size = domain_z_max - domain_z_min;
+        float z_step = z_size / grid_nz;
+        return {
+            domain_z_min + subgrid.pz * z_step,
+            domain_z_min + (subgrid.pz + subgrid.nz) * z_step
+        };
+    }
+
 private:
-    Interval4 evaluate_interval4(const std::vector<Instruction>& instructions, const Interval4& x, const Interval4& y);
+    Interval4 evaluate_interval4(Scratch& s, const std::vector<Instruction>& instructions, const Interval4& x, const Interval4& y, const Interval4& z);
+    Interval8 evaluate_interval8(Scratch& s, const std::vector<Instruction>& instructions, const Interval8& x, const Interval8& y, const Interval8& z);
+
+    // Affine evaluation, also stores the ranges of the forms like the interval evaluation does
+    Interval4 evaluate_affine4(Scratch& s, const std::vector<Instruction>& instructions, const Interval4& x, const Interval4& y, const Interval4& z);
+    Interval8 evaluate_affine8(Scratch& s, const std::vector<Instruction>& instructions, const Interval8& x, const Interval8& y, const Interval8& z);
+
+    void prune_instructions4(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 4>& compacted_instructions);
+    void prune_instructions8(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 8>& compacted_instructions);
+
+    // Pruning after an affine evaluation
+    void prune_affine4(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 4>& compacted_instructions);
+    void prune_affine8(Scratch& s, const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 8>& compacted_instructions);
+
+    // Operands of the top-level union with exact distance SDFs, with their bounds, ordered by
+    // a hierarchy of nodes over them. Empty if the union has fewer than two of them.
+    struct UnionShape
+    {
+        int root;
+        Bounds bounds;
+    };
+    struct UnionNode
+    {
+        Bounds bounds;
+        int first, count;
+        // Children, -1 for a node of a single shape
+        int left = -1, right = -1;
+    };
+    std::vector<UnionShape> union_shapes;
+    std::vector<UnionNode> union_nodes;
+    // Roots of the other operands of the top-level union
+    std::vector<int> union_others;
+    void build_union_hierarchy();
+    static int build_union_node(std::vector<UnionShape>& shapes, std::vector<UnionNode>& nodes, int first, int count);
+
+    // Replaces the instructions of the region with the operands of the union near it, see
+    // union_culling. Returns false and keeps them if that is not shorter.
+    bool cull_union(const Subgrid& subgrid, std::vector<Instruction>& instructions);
+
+    // Solves the quadtree of a subgrid of the grid set by the caller and collects its tiles
+    void solve_grid(std::deque<Tile>& tiles, Subgrid subgrid, const std::function<bool(const Subgrid&)>& filter);
 
-    void prune_instructions4(const std::vector<Instruction>& instructions, std::array<std::vector<Instruction>, 4>& compacted_instructions);
+    void solve_region(std::vector<std::deque<Tile>>& thread_tiles, Subgrid subgrid, std::vector<Instruction> instructions);
 
-    void solve_region(std::deque<Tile>& tiles, Subgrid subgrid, std::vector<Instruction> instructions);
+    // Samples the region as a coarse tile if the tolerance allows it, see lod_tolerance.
+    // Returns false if the region has to be split or sampled at every grid point instead.
+    bool solve_coarse(std::vector<std::deque<Tile>>& thread_tiles, const Subgrid& subgrid, std::vector<Instruction>& instructions);
+
+    // Whether splitting a region is cheaper than sampling it, given the length of its tape and
+    // the number of its quadrants that may contain the zero level set, see adaptive_tiles
+    bool split_pays(int num_points, size_t tape_length, int crossing_quadrants) const;
+
+    // Bounds the instructions on the quadrants of the subgrid and returns how many of them are
+    // positive and negative for sure
+    std::pair<int, int> quadrant_signs(const Subgrid& subgrid, const std::vector<Instruction>& instructions);
+
+    // Splits the subgrid into NX x NY children, prunes the instructions for each of them
+    // and recurses into the ones that may contain the zero level set
+    template<int NX, int NY>
+    void subdivide(std::vector<std::deque<Tile>>& thread_tiles, Subgrid subgrid, const std::vector<Instruction>& instructions);
+
+    void solve_region3(std::vector<std::deque<Tile3>>& thread_tiles, Subgrid3 subgrid, std::vector<Instruction> instructions);
+
+    // Splits the subgrid into up to 2 x 2 x 2 children, an axis with a single cell is not split.
+    // The children are evaluated and pruned as the lanes of one Interval8.
+    void subdivide3(std::vector<std::deque<Tile3>>& thread_tiles, Subgrid3 subgrid, const std::vector<Instruction>& instructions);
+
+    // Returns the scratch buffers of the calling thread, allocating them on first use.
+    Scratch& local_scratch();
+
+    // Substitutes the parameter values into the compiled instructions and folds the
+    // subexpressions that only depend on parameters
+    void bind_parameters();
+
+    // Compiled instructions with Param instructions, empty for programs without parameters
+    std::vector<Instruction> parametric_instructions;
+    std::vector<float> parameters;
 
     int batch_capacity = 0;
-    std::vector<float> batch_vars;
-    std::vector<Interval4> interval_vars;
-    std::vector<std::array<int, 4>> remap;
+    std::vector<Scratch> scratch;
+    // Filter of the running evaluation, if any
+    const std::function<bool(const Subgrid&)>* region_filter = nullptr;
+    // Consumer of the running evaluation, if the tiles are streamed
+    const std::function<void(const Tile&)>* tile_consumer = nullptr;
 };
@@ -0,0 +1,18 @@
+// This translation unit is compiled with AVX2 enabled. Its functions may only be called
+// after checking that the host supports AVX2, see vm.cpp.
+#include "interval_kernels.h"
+#include "batch_kernels.h"
+
+#if defined(__AVX2__)
+Interval8 evaluate_interval8_avx2(std::vector<Interval8>& interval_vars, const std::vector<Instruction>& instructions, const Interval8& x, const Interval8& y, const Interval8& z) {
+    return evaluate_intervals<AvxLanes>(interval_vars, instructions, x, y, z);
+}
+
+void evaluate_batch_avx2(const RegisterTape& tape, float* vars, size_t stride, size_t n) {
+    evaluate_batch_lanes<AvxLanes>(tape, vars, stride, n);
+}
+
+void evaluate_gradient_avx2(const RegisterTape& tape, float* vars, size_t stride, size_t n) {
+    evaluate_gradient_lanes<AvxLanes>(tape, vars, stride, n);
+}
+#endif
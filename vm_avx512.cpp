@@ -0,0 +1,16 @@
+// This translation unit is compiled with AVX-512 enabled. Its functions may only be called
+// after checking that the host supports AVX-512F, see vm.cpp.
+
+// GCC 12 reports the deliberately undefined pass-through operand inside the AVX-512
+// intrinsics (_mm512_undefined_ps) as uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#include "batch_kernels.h"
+
+#if defined(__AVX512F__)
+void evaluate_batch_avx512(const RegisterTape& tape, float* vars, size_t stride, size_t n) {
+    evaluate_batch_lanes<Avx512Lanes>(tape, vars, stride, n);
+}
+#endif